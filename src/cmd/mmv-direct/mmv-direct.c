@@ -20,8 +20,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>      // Import EPERM
 #include <stdio.h>
 #include <stdlib.h>     // Import getenv()
+#include <string.h>     // Import strcmp(), strerror()
 #include <dbgprint.h>
 #include <cscript.h>
 #include <mmv.h>
@@ -32,6 +34,53 @@ const char *program_name;
 FILE *errprint_fh;
 FILE *dbgprint_fh;
 
+/*
+ * Options that libmmv takes from the environment, by way of the program.
+ */
+
+static const char *env_options[] = {
+    "MMV_SNAPSHOT_DIR",
+    "MMV_DIRMEM_CAP",
+    "MMV_PRUNE",
+    "MMV_WALK_MAXDEPTH",
+};
+
+/**
+ * @brief Set the options given by environment variables.
+ *
+ * @param mmv
+ *
+ * A value that cannot be used is reported, and ignored.
+ *
+ */
+
+static void
+setopt_environ(mmv_t *mmv)
+{
+    const char *name;
+    const char *val;
+    size_t i;
+    int err;
+
+    for (i = 0; i < sizeof (env_options) / sizeof (env_options[0]); ++i) {
+        name = env_options[i];
+        val = getenv(name);
+        err = mmv_setopt_var(mmv, name, val);
+        if (err == 0) {
+            continue;
+        }
+        if (strcmp(name, "MMV_SNAPSHOT_DIR") != 0) {
+            eprintf("Invalid %s='%s'; ignored.\n", name, val);
+        }
+        else if (err == EPERM) {
+            eprintf("Snapshot directory, '%s', must be yours, and writable only by you.\n", val);
+        }
+        else {
+            eprintf("Cannot use snapshot directory, '%s'; %s.\n", val, strerror(err));
+        }
+    }
+}
+
 /**
  * @brief Show how libmmv can be used directly from C code.
  *
@@ -59,6 +108,7 @@ main(int argc, char *const *argv)
     program_name = sname(program_path);
     mmv = mmv_new();
     mmv_set_default_options(mmv);
+    setopt_environ(mmv);
     mmv_setopt(mmv, 'x');
 
     if (argc == 3) {
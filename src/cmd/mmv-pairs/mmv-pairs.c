@@ -39,8 +39,10 @@
     // Import var stdout
 #include <stdlib.h>
     // Import exit()
+    // Import getenv()
 #include <string.h>
     // Import strcmp()
+    // Import strerror()
 #include <unistd.h>
     // Import getopt_long()
     // Import type size_t
@@ -61,8 +63,12 @@ FILE *dbgprint_fh;
 bool verbose = false;
 bool debug   = false;
 bool pairs_from_argv = false;
+bool parallel = false;
 
 const char *encoding_opt = NULL;
+const char *snapshot_dir_opt = NULL;
+size_t dircache_budget_opt = 0;
+size_t dirmem_cap_opt = 0;
 
 static struct option long_options[] = {
     {"help",           no_argument,       0,  'h'},
@@ -71,6 +77,10 @@ static struct option long_options[] = {
     {"debug",          no_argument,       0,  'd'},
     {"argv",           no_argument,       0,  'A'},
     {"encoding",       required_argument, 0,  'E'},
+    {"snapshot-dir",   required_argument, 0,  'S'},
+    {"dircache-budget", required_argument, 0, 'B'},
+    {"dirmem-cap",     required_argument, 0,  'M'},
+    {"parallel",       no_argument,       0,  'P'},
     {0, 0, 0, 0}
 };
 
@@ -84,6 +94,14 @@ static const char usage_text[] =
     "                       Default is that pairs are read in from stdin.\n"
     "  --encoding=<E>       Filename pairs are encoded <E>\n"
     "      Encoding is one of: { null, qp, vis, xnn }.\n"
+    "  --snapshot-dir=<D>   Keep snapshots of large directories in <D>,\n"
+    "                       to be reused by later runs.\n"
+    "  --dircache-budget=<N>  Keep at most about <N> bytes\n"
+    "                       of directory listings in memory.\n"
+    "  --dirmem-cap=<N>     Read any directory too big to sort\n"
+    "                       in <N> bytes in external memory.\n"
+    "  --parallel|-P        Read pairs ahead, and read their directories\n"
+    "                       in the background, with a pool of threads.\n"
     "\n"
     ;
 
@@ -146,6 +164,62 @@ vischar_r(char *buf, size_t sz, int c)
     return (buf);
 }
 
+/*
+ * Options that libmmv takes from the environment, by way of the program.
+ */
+
+static const char *env_options[] = {
+    "MMV_SNAPSHOT_DIR",
+    "MMV_DIRMEM_CAP",
+    "MMV_PRUNE",
+    "MMV_WALK_MAXDEPTH",
+};
+
+static void
+explain_snapshot_dir(const char *dir, int err)
+{
+    if (err == EPERM) {
+        eprintf("Snapshot directory, '%s', must be yours, and writable only by you.\n", dir);
+    }
+    else {
+        eprintf("Cannot use snapshot directory, '%s'; %s.\n", dir, strerror(err));
+    }
+}
+
+/**
+ * @brief Set the options given by environment variables.
+ *
+ * @param mmv
+ *
+ * A value that cannot be used is reported, and ignored.
+ * Command-line options are set later, so they win.
+ *
+ */
+
+static void
+setopt_environ(mmv_t *mmv)
+{
+    const char *name;
+    const char *val;
+    size_t i;
+    int err;
+
+    for (i = 0; i < sizeof (env_options) / sizeof (env_options[0]); ++i) {
+        name = env_options[i];
+        val = getenv(name);
+        err = mmv_setopt_var(mmv, name, val);
+        if (err == 0) {
+            continue;
+        }
+        if (strcmp(name, "MMV_SNAPSHOT_DIR") == 0) {
+            explain_snapshot_dir(val, err);
+        }
+        else {
+            eprintf("Invalid %s='%s'; ignored.\n", name, val);
+        }
+    }
+}
+
 static int
 mmv_pairs_stdin(mmv_t *mmv, const char *encoding_opt)
 {
@@ -211,7 +285,7 @@ main(int argc, char **argv)
         }
 
         this_option_optind = optind ? optind : 1;
-        optc = getopt_long(argc, argv, "+hVdvAE:", long_options, &option_index);
+        optc = getopt_long(argc, argv, "+hVdvAE:S:B:M:P", long_options, &option_index);
         if (optc == -1) {
             break;
         }
@@ -240,10 +314,40 @@ main(int argc, char **argv)
         case 'A':
             pairs_from_argv = true;
             break;
+        case 'P':
+            parallel = true;
+            break;
         case 'E':
             // XXX complain if more than 1 --encoding
             encoding_opt = optarg;
             break;
+        case 'S':
+            snapshot_dir_opt = optarg;
+            break;
+        case 'B':
+            {
+                char *end;
+
+                errno = 0;
+                dircache_budget_opt = strtoull(optarg, &end, 10);
+                if (errno != 0 || end == optarg || *end != '\0') {
+                    eprintf("Invalid --dircache-budget, '%s'.\n", optarg);
+                    ++err_count;
+                }
+            }
+            break;
+        case 'M':
+            {
+                char *end;
+
+                errno = 0;
+                dirmem_cap_opt = strtoull(optarg, &end, 10);
+                if (errno != 0 || end == optarg || *end != '\0') {
+                    eprintf("Invalid --dirmem-cap, '%s'.\n", optarg);
+                    ++err_count;
+                }
+            }
+            break;
         case '?':
             eprint(program_name);
             eprint(": ");
@@ -297,7 +401,23 @@ main(int argc, char **argv)
     set_debug_fh(NULL);
     mmv = mmv_new();
     mmv_set_default_options(mmv);
+    setopt_environ(mmv);
     mmv_setopt(mmv, 'x');
+    if (snapshot_dir_opt != NULL) {
+        rv = mmv_set_snapshot_dir(mmv, snapshot_dir_opt);
+        if (rv) {
+            explain_snapshot_dir(snapshot_dir_opt, rv);
+        }
+    }
+    if (dircache_budget_opt != 0) {
+        mmv_set_dircache_budget(mmv, dircache_budget_opt);
+    }
+    if (dirmem_cap_opt != 0) {
+        mmv_set_dirmem_cap(mmv, dirmem_cap_opt);
+    }
+    if (parallel) {
+        mmv_setopt(mmv, 'P');
+    }
 
     if (pairs_from_argv) {
         if (encoding_opt != NULL) {
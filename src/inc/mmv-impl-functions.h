@@ -52,9 +52,18 @@ typedef struct stage stage_t;
 struct pattern;
 typedef struct pattern pattern_t;
 
+struct pmatch;
+typedef struct pmatch pmatch_t;
+
+struct multipat;
+typedef struct multipat multipat_t;
+
 
 extern void *mmv_alloc(size_t sz);
 extern void *mmv_realloc(void *ptr, size_t sz);
+extern void *mmv_try_alloc(size_t sz);
+extern void *mmv_try_realloc(void *ptr, size_t sz);
+extern void mmv_nomem(void);
 extern void *challoc(size_t sz, unsigned int which);
 extern void chgive(void *p, size_t sz);
 
@@ -82,19 +91,134 @@ extern bool check_encoding(enum encode e);
 extern int tilde_expand(cstr_t *home, sbuf_t *fname);
 extern int trymatch(mmv_t *mmv, FILEINFO *ffrom, char *pat);
 extern int keepmatch(mmv_t *mmv, FILEINFO *ffrom, char *pathend, int *pk, int needslash, int dirs, bool fils);
-extern int badrep(mmv_t *mmv, HANDLE *hfrom, FILEINFO *ffrom, HANDLE **phto, char **pnto, FILEINFO **pfdel, int *pflags);
-extern int ffirst(char *s, int n, DIRINFO *d);
+extern int badrep(mmv_t *mmv, HANDLE *hfrom, FILEINFO *ffrom, HANDLE **phto, uint32_t *pnto, FILEINFO **pfdel, int *pflags);
+extern int ffirst(char *s, int n, DIRINFO *d, int *pend);
+extern unsigned int *fsuffix(const char *s, size_t n, DIRINFO *d, size_t *pcount);
+extern FILEINFO *fsearch(const char *s, DIRINFO *d);
 extern HANDLE *checkdir(const char *p, char *pathend, int which);
 extern unsigned int dwritable(HANDLE *h);
+extern void fdump_dircache_stats(FILE *f);
+extern void dircache_set_budget(size_t bytes);
+extern void dircache_release(mmv_t *mmv);
+extern void dir_pin(DIRINFO *di);
+extern void dir_unpin(DIRINFO *di);
+struct stat;
+extern bool dir_lazy_candidate(const struct stat *dstat);
+extern bool walk_pruned(const mmv_t *mmv, const char *name);
+extern bool walk_descend(mmv_t *mmv, HANDLE *h, FILEINFO *f, char *pathend, unsigned int level, DEVID dev);
+extern int getstat(const char *ffull, FILEINFO *f);
+extern unsigned int dtype_flags(unsigned char d_type);
+
+// ********** mmv-readdir.c
+
+extern int dirbuf_open(const char *path);
+extern int dirbuf_read(const char *path, dirbuf_t *db);
+extern int dirbuf_read_fd(int fd, dirbuf_t *db);
+extern int dirbuf_read_chunk(int fd, dirbuf_t *db, size_t limit, bool *peof);
+extern void dirbuf_sort(dirbuf_t *db);
+extern int dirbuf_try_sort(dirbuf_t *db);
+extern void dirbuf_free(dirbuf_t *db);
+
+// ********** mmv-fsort.c
+
+extern uint64_t namekey_prefix(const char *name, size_t n);
+extern void namekey_set(namekey_t *nk, const char *name);
+extern int namekey_sort(namekey_t *vec, size_t n);
+
+// ********** mmv-intern.c
+
+extern uint32_t str_intern(const char *s, size_t len);
+extern const char *str_name(uint32_t id);
+extern uint32_t path_intern(const char *path);
+extern size_t path_len(uint32_t id);
+extern size_t path_copy(uint32_t id, char *buf);
+extern char *path_str(uint32_t id, char *buf);
+extern void fdump_intern_stats(FILE *f);
+
+// ********** mmv-dirfd.c
+
+extern int long_path_at(const char *path, const char **pname);
+extern void long_path_done(int dfd);
+extern int long_open(const char *path, int flags, mode_t mode);
+extern int handle_fd(HANDLE *h);
+extern int handle_at(HANDLE *h, const char *name, const char *path, const char **pname);
+extern void dirfd_flush(void);
+extern void dirfd_moved(FILEINFO *f);
+extern void fdump_dirfd_stats(FILE *f);
+
+// ********** mmv-statx.c
+
+extern void statx_prefetch(mmv_t *mmv, HANDLE *h, int first, int end, char *lastend, bool anylev);
+extern int stat_perm(int dfd, const char *path, struct stat *st, unsigned int *pattr);
+extern void fdump_statx_stats(FILE *f);
+
+// ********** mmv-snapcache.c
+
+extern int snapcache_set_dir(const char *dir);
+extern bool snapcache_load(DIRINFO *di, const struct stat *dstat, int sticky);
+extern void snapcache_save(DIRINFO *di, const struct stat *dstat);
+extern void fdump_snapcache_stats(FILE *f);
+
+// ********** mmv-extdir.c
+
+extern void extdir_set_cap(size_t bytes);
+extern bool extdir_fits(size_t bytes);
+extern int extdir_read(int fd, DIRINFO *di, int sticky, dirbuf_t *db, bool *pdone);
+extern int extdir_read_small(int fd, dirbuf_t *db);
+extern void fdump_extdir_stats(FILE *f);
+
+// ********** mmv-patgen.c
+
+extern bool pattern_start_dir(const char *from, char *dir, unsigned int *pdepth, bool *pwalk);
+
+// ********** mmv-pmatch.c
+
+extern pmatch_t *pmatch_compile(const char *pat);
+extern int pmatch_exec(const pmatch_t *pm, char *s, const char *send, backref_t *bkref);
+extern void pmatch_free(pmatch_t *pm);
+extern void pmatch_end_bytes(const pmatch_t *pm, uint64_t *first, uint64_t *last);
+extern size_t pmatch_literal_suffix(const pmatch_t *pm, char *buf, size_t size);
+extern const char *pmatch_kernel_name(const pmatch_t *pm);
+extern void fdump_pmatch_stats(FILE *f);
+
+// ********** mmv-multipat.c
+
+extern bool multipat_batchable(const char *from, char *dir);
+extern multipat_t *multipat_new(mmv_t *mmv, char *const *froms, size_t n);
+extern void multipat_free(multipat_t *mp);
+extern void multipat_select(multipat_t *mp, size_t k);
+extern const unsigned int *multipat_candidates(DIRINFO *di, size_t *pn);
+extern void fdump_multipat_stats(FILE *f);
+
+// ********** mmv-readahead.c
+
+typedef int (*getfname_fn)(FILE *f, char *buf, size_t sz, size_t *rlen);
+extern int readahead_next(mmv_t *mmv, FILE *f, getfname_fn get, bool patterns);
+extern void readahead_finish(void);
+
+// ********** mmv-getpat.c
+
+extern int getpat_cb(mmv_t *mmv, void (*missing)(mmv_t *mmv, void *arg), void *arg);
+
+// ********** mmv-prefetch.c
+
+extern bool prefetch_start(mmv_t *mmv, const char *prefix, DIRINFO *di);
+extern bool prefetch_hold(mmv_t *mmv);
+extern bool prefetch_queue_dir(const char *path, unsigned int depth, bool walk, bool target);
+extern bool prefetch_start_dirs(mmv_t *mmv, char *const *paths, const unsigned int *depths, const bool *walks, size_t n);
+extern void prefetch_queue_pair(const char *from, const char *to);
+extern bool prefetch_take(const char *path, dirbuf_t *db);
+extern void prefetch_finish(void);
+extern void fdump_prefetch_stats(FILE *f);
 
 // ********** mmv-dostage-patterns.c
 
-extern int match(char *pat, char *s, backref_t *bkref);
+extern int match(char *pat, char *s, const char *send, backref_t *bkref);
 extern int dostage_patterns(mmv_t *mmv, char *lastend, char *pathend, backref_t *bkref, int stage, int anylev);
 
 // ********** mmv-dostage-fnames.c
 
-extern int dostage_fnames(mmv_t *mmv, char *lastend, char *pathend, int stage, int anylev);
+extern int dostage_fnames(mmv_t *mmv, char *lastend, char *pathend, int stage);
 
 // ********** mmv-debug.c
 
@@ -107,6 +231,10 @@ extern void dbg_println_str(const char *var, const char *str);
 // ********** mmv-sys.c
 
 extern void init_sys(void);
+extern void perm_fs_note(DEVID dev, const char *path);
+extern bool perm_granted(DEVID dev, mode_t mode, uid_t fuid, unsigned int attr, int amode);
+extern unsigned int perm_fi_flags(DEVID dev, mode_t mode, uid_t fuid, unsigned int attr);
+extern void fdump_perm_stats(FILE *f);
 
 // ********** mmv-util.c
 
@@ -23,6 +23,7 @@
 #ifndef MMV_IMPL_REP_H
 #define MMV_IMPL_REP_H
 
+#include <stdint.h>
 #include <sys/types.h>
 
 #ifndef MMV_H
@@ -35,30 +36,80 @@
 
 struct fileinfo {
     char *       fi_name;
+    unsigned int fi_len;        // strlen(fi_name)
     struct rep * fi_rep;
     short        fi_mode;
     unsigned int fi_stflags;
 };
 
+struct dirindex_slot {
+    unsigned int ix_tag;        // Part of the hash of the name not used for the slot
+    unsigned int ix_pos;        // 1 + index into |di_fils|; 0 means empty
+};
+
 struct dirinfo {
     DEVID di_vid;
     DIRID di_did;
     unsigned int di_nfils;
     FILEINFO **  di_fils;
     unsigned int di_flags;
+    unsigned int di_nuntyped;   // Entries of |di_fils| whose d_type told nothing
+
+    // Mode and owner of the directory itself, and its PERM_ATTR_* flags,
+    // for dwritable()
+    mode_t       di_mode;
+    uid_t        di_uid;
+    unsigned int di_pattr;
+
+    // Hash index of |di_fils|, for fsearch(); built on first use
+    struct dirindex_slot * di_index;
+    unsigned int di_indexsize;
+
+    // Eytzinger layout of name prefixes of |di_fils|, for ffirst();
+    // built on first use.  Slot 0 is not used.
+    uint64_t *   di_eytz;       // First 8 bytes of each name, as a namekey
+    unsigned int * di_eytzpos;  // Index into |di_fils| of each slot
+
+    // Indexes into |di_fils|, in order of reversed name, for fsuffix();
+    // built on the second use.
+    unsigned int * di_sfx;
+    unsigned int di_sfxuses;
+
+    // Only while DI_LAZY: names are looked up one at a time,
+    // and the answers are remembered in a small hash table.
+    char *       di_path;       // Path of the directory, for a full scan
+    HANDLE *     di_h;          // Its descriptor, from the cache in mmv-dirfd.c
+    unsigned int di_nprobes;    // fstatat() calls so far
+    unsigned int di_budget;     // fstatat() calls allowed before full scan
+    FILEINFO **  di_memo;       // Hash table of probed names, found or not;
+                                // after a full scan, the ones still owned
+    unsigned int di_memosize;
+    unsigned int di_nmemo;
+
+    // Storage of the listing, and the LRU list of the directory cache.
+    FILEINFO *   di_recs;       // Contiguous |FILEINFO|s of |di_fils|
+    void *       di_pool;       // Names; malloc()ed, or mapped if DI_MAPPED
+    size_t       di_poolsize;
+    size_t       di_bytes;      // Resident size of all of the above
+    unsigned int di_refs;       // Pins, by live |REP|s and walks in progress
+    DIRINFO *    di_lru_prev;
+    DIRINFO *    di_lru_next;
 };
 
 struct handle {
-    char *    h_name;
+    uint32_t  h_path;       // Interned path of the directory; see mmv-intern.c
     DIRINFO * h_di;
     char      h_err;
+    int       h_fd;         // O_PATH descriptor of the directory, or -1
+    HANDLE *  h_lru_prev;   // Neighbors in the descriptor cache; see mmv-dirfd.c
+    HANDLE *  h_lru_next;
 };
 
 struct rep {
     HANDLE *     r_hfrom;
     FILEINFO *   r_ffrom;
     HANDLE *     r_hto;
-    char *       r_nto;         // non-path part of new name
+    uint32_t     r_nto;         // non-path part of new name, interned
     FILEINFO *   r_fdel;
     struct rep * r_first;
     struct rep * r_thendo;
@@ -69,7 +120,7 @@ struct rep {
 struct repdict {
     REP *         rd_p;
     DIRINFO *     rd_dto;
-    char *        rd_nto;
+    uint32_t      rd_nto;
     unsigned int  rd_i;		// Unique index, position before sorting
 };
 
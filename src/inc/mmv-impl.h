@@ -23,7 +23,9 @@
 #ifndef MMV_IMPL_H
 #define MMV_IMPL_H
 
+#include <stdint.h>
 #include <sys/types.h>
+#include <linux/limits.h>	// Import PATH_MAX
 #include <strbuf.h>
 
 #ifndef MMV_H
@@ -67,7 +69,22 @@ typedef struct rep REP;
 struct repdict;
 typedef struct repdict REPDICT;
 
+struct dirbuf;
+typedef struct dirbuf dirbuf_t;
+
+struct namekey;
+typedef struct namekey namekey_t;
+
 #define SIZE_UNLIMITED ((size_t)(-1))
+#define INTERN_NONE ((uint32_t)(-1))    // No string or path has this id
+#define MAX_SCAN_THREADS 64
+
+/*
+ * Longest path built in mmv->pathbuf and mmv->fullrep, and longest
+ * |HANDLE| path.  System calls on paths longer than PATH_MAX go
+ * through long_path_at().
+ */
+#define MMV_PATH_MAX (4 * PATH_MAX)
 
 enum fi_stflags {
     FI_STTAKEN    = 0x01,
@@ -78,12 +95,32 @@ enum fi_stflags {
     FI_CANWRITE   = 0x20,
     FI_ISDIR      = 0x40,
     FI_ISLNK      = 0x80,
+    FI_TYPEKNOWN  = 0x100,      // FI_ISDIR is valid, even without FI_STTAKEN
+    FI_NOENT      = 0x200,      // Negative entry in a DI_LAZY memo table
+    FI_KNOWREAD   = 0x400,
+    FI_CANREAD    = 0x800,
+};
+
+/*
+ * What statx() tells about a file that bears on write permission.
+ * See perm_granted().
+ */
+
+enum perm_attr {
+    PERM_ATTR_KNOWN  = 0x01,    // stx_attributes covers immutable and append
+    PERM_ATTR_LOCKED = 0x02,    // Immutable or append-only
 };
 
 enum di_flags {
     DI_KNOWWRITE = 0x01,
     DI_CANWRITE  = 0x02,
     DI_CLEANED   = 0x04,
+    DI_LAZY      = 0x08,        // Not read, yet; probe names with fstatat()
+    DI_INSTICKY  = 0x10,        // Entries get FI_INSTICKY
+    DI_EVICTED   = 0x20,        // Listing was dropped; read again when needed
+    DI_MAPPED    = 0x40,        // |di_pool| is a snapshot mapping
+    DI_MARKED    = 0x80,        // Some |fi_rep| in |di_fils| has been set
+    DI_EXTERNAL  = 0x100,       // Listing is in a file mapping; see mmv-extdir.c
 };
 
 enum h_flags {
@@ -134,6 +171,49 @@ enum chr {
 
 #endif /* IMPORT_PATTERN */
 
+// ==================== DIRBUF ====================
+//
+// The raw contents of a directory, as read by getdents64().
+
+#ifdef IMPORT_DIRBUF
+
+#include <stdint.h>
+
+// Same layout as the kernel's struct linux_dirent64
+//
+struct dirbuf_rec {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+struct dirbuf {
+    char  *db_buf;      // Packed |dirbuf_rec| records
+    size_t db_len;      // Number of bytes used in |db_buf|
+    size_t db_size;     // Capacity of |db_buf|
+    size_t db_count;    // Number of records
+    int    db_sorted;   // Records are already in strcmp() order of name
+};
+
+#endif /* IMPORT_DIRBUF */
+
+// ==================== NAMEKEY ====================
+//
+// A filename, with its first 8 bytes inlined as a sort key.
+
+#ifdef IMPORT_NAMEKEY
+
+#include <stdint.h>
+
+struct namekey {
+    uint64_t    nk_key;     // First 8 bytes of |nk_name|, big-endian, 0-padded
+    const char *nk_name;
+};
+
+#endif /* IMPORT_NAMEKEY */
+
 // ==================== RFLAGS ====================
 //
 #ifdef IMPORT_RFLAGS
@@ -183,6 +263,9 @@ typedef struct backref backref_t;
 struct stage;
 typedef struct stage stage_t;
 
+struct repop;
+typedef struct repop repop_t;
+
 struct pattern;
 typedef struct pattern pattern_t;
 
@@ -232,6 +315,26 @@ struct stage {
     size_t   stg_count;   // Count of number of backreferences in this slice
     char *l;
     char *r;
+    pmatch_t *stg_pm;     // Compiled matcher; see mmv-pmatch.c
+};
+
+// The 'to' pattern is compiled once, by parse_dst_pattern(),
+// into a short program for makerep() to run for every match.
+// Each operation copies either a run of literal bytes
+// (escapes already removed) or one backreference.
+
+enum repop_kind {
+    RO_LIT,             // Copy rop_lit[ro_off .. ro_off + ro_len)
+    RO_BACKREF,         // Copy backreference number |ro_off|
+};
+
+struct repop {
+    enum repop_kind ro_kind;
+    int     ro_cnv;     // RO_BACKREF: '=', 'l' (lower case) or 'u' (upper case)
+    bool    ro_slash;   // RO_LIT: begins with '/', right after a backreference
+    bool    ro_empty;   // RO_LIT: begins with a '/' that makes the target bad
+    size_t  ro_off;
+    size_t  ro_len;
 };
 
 
@@ -249,6 +352,13 @@ struct pattern {
     stage_t   *stage_vec;
     size_t     stage_siz;
     size_t     stage_cnt;
+    size_t     pm_cnt;      // Stages that have |stg_pm| set
+
+    repop_t   *rop_vec;     // Compiled 'to' pattern
+    size_t     rop_siz;
+    size_t     rop_cnt;
+    char      *rop_lit;     // Literal bytes of all RO_LIT operations
+    size_t     rop_litlen;
 };
 
 // Identifier, 'mmv', is an explicit argument
@@ -283,7 +393,7 @@ mmv_backref_idx_diag(mmv_t *mmv, int br_index)
     return (0);
 }
 
-static backref_t *
+static inline backref_t *
 mmv_backref_idx(mmv_t *mmv, int br_index)
 {
     pattern_t *pat = mmv->aux;
@@ -77,6 +77,14 @@ struct mmv_state {
     int failed;
 
     int  matchall;
+    unsigned int scan_threads;  // Threads for parallel ';' prefetch; 0 = off
+    const char *snapshot_dir;   // Where directory snapshots are kept; NULL = off
+    size_t dircache_budget;     // Bytes of directory listings to keep; 0 = no limit
+    size_t dirmem_cap;          // Memory to read one directory in; 0 = no cap
+    char **prune_vec;           // Subdirectory name globs a ';' walk skips
+    size_t prune_cnt;
+    unsigned int walk_maxdepth; // Levels a ';' walk descends; 0 = no limit
+    bool walk_onefs;            // A ';' walk stays on one filesystem
     FILE *outfile;
     FILE *errfile;
 
@@ -41,6 +41,15 @@ extern int mmv_add_fname_pairs(mmv_t *mmv, size_t filec, char **filev);
 extern int mmv_compile(mmv_t *mmv);
 extern int mmv_execute(mmv_t *mmv);
 extern int mmv_setopt(mmv_t *mmv, int);
+extern int mmv_setopt_arg(mmv_t *mmv, int, const char *);
+extern int mmv_setopt_var(mmv_t *mmv, const char *name, const char *value);
+extern void mmv_set_scan_threads(mmv_t *mmv, unsigned int nthreads);
+extern int mmv_set_snapshot_dir(mmv_t *mmv, const char *dir);
+extern void mmv_set_dircache_budget(mmv_t *mmv, size_t bytes);
+extern void mmv_set_dirmem_cap(mmv_t *mmv, size_t bytes);
+extern void mmv_add_prune(mmv_t *mmv, const char *glob);
+extern void mmv_set_walk_maxdepth(mmv_t *mmv, unsigned int depth);
+extern void mmv_set_walk_onefs(mmv_t *mmv, int onefs);
 extern int patgen(mmv_t *mmv, int argc, char *const *argv);
 
 extern void quit(void);
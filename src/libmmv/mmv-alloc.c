@@ -75,6 +75,20 @@ static slicer_t slicer[2] = {
     {NULL, NULL, 0}
 };
 
+/**
+ * @brief Report that memory ran out, and quit.
+ *
+ * Only the main thread may call this, or anything that calls it.
+ *
+ */
+
+void
+mmv_nomem(void)
+{
+    fprintf(stderr, "Insufficient memory.\n");
+    mmv_abort();
+}
+
 void *
 mmv_alloc(size_t sz)
 {
@@ -85,8 +99,7 @@ mmv_alloc(size_t sz)
     }
     new_ptr = malloc(sz);
     if (new_ptr == NULL) {
-        fprintf(stderr, "Insufficient memory.\n");
-        mmv_abort();
+        mmv_nomem();
     }
     return (new_ptr);
 }
@@ -101,12 +114,38 @@ mmv_realloc(void *ptr, size_t sz)
     }
     new_ptr = realloc(ptr, sz);
     if (new_ptr == NULL) {
-        fprintf(stderr, "Insufficient memory.\n");
-        mmv_abort();
+        mmv_nomem();
     }
     return (new_ptr);
 }
 
+/**
+ * @brief Like mmv_alloc(), but return NULL if memory runs out.
+ *
+ * For the prefetch worker threads, which must not end the process
+ * while the main thread is in the middle of something.
+ *
+ */
+
+void *
+mmv_try_alloc(size_t sz)
+{
+    return (malloc(sz ? sz : 1));
+}
+
+/**
+ * @brief Like mmv_realloc(), but return NULL if memory runs out.
+ *
+ * On failure, |ptr| is left as it was.
+ *
+ */
+
+void *
+mmv_try_realloc(void *ptr, size_t sz)
+{
+    return (realloc(ptr, sz ? sz : 1));
+}
+
 void *
 challoc(size_t sz, unsigned int which)
 {
@@ -124,8 +163,15 @@ challoc(size_t sz, unsigned int which)
         }
 
         if (p == NULL) {
-            sl->sl_len = CHUNKSIZE - sizeof (memchunk_t *);
-            p = (memchunk_t *) mmv_alloc(CHUNKSIZE);
+            size_t csz;
+
+            // A path deep enough can be longer than a whole chunk.
+            csz = CHUNKSIZE;
+            if (sz + sizeof (memchunk_t *) > csz) {
+                csz = sz + sizeof (memchunk_t *);
+            }
+            sl->sl_len = csz - sizeof (memchunk_t *);
+            p = (memchunk_t *) mmv_alloc(csz);
         }
         else if (q == NULL) {
             freechunks = p->ch_next;
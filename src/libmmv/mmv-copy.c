@@ -83,16 +83,23 @@ int
 copy_ftimes(file_copy_t *cpy)
 {
     struct stat statb;
+    const char *name;
+    int dfd;
     int rv;
 
-    rv = stat(cpy->src_fname, &statb);
+    // Either path can be longer than PATH_MAX; see long_path_at().
+    dfd = long_path_at(cpy->src_fname, &name);
+    rv = dfd == -1 ? -1 : fstatat(dfd, name, &statb, 0);
+    long_path_done(dfd);
     if (rv) {
         eprintf("stat('%s') failed.\n", cpy->src_fname);
         cpy->src_err = errno;
         return (rv);
     }
 
-    rv = utimensat(AT_FDCWD, cpy->dst_fname, &statb.st_atim, 0);
+    dfd = long_path_at(cpy->dst_fname, &name);
+    rv = dfd == -1 ? -1 : utimensat(dfd, name, &statb.st_atim, 0);
+    long_path_done(dfd);
     if (rv) {
         cpy->dst_err = errno;
         eprintf("utimensat('%s') failed.\n", cpy->dst_fname);
@@ -167,17 +174,19 @@ file_copy_fds(file_copy_t *cpy)
 int
 file_copy(file_copy_t *cpy)
 {
+    const char *name;
+    int dfd;
     int rv_copy;
     int rv_close;
     int rv;
 
-    cpy->src_fd = open(cpy->src_fname, O_RDONLY | O_BINARY, 0);
+    cpy->src_fd = long_open(cpy->src_fname, O_RDONLY | O_BINARY, 0);
     if (cpy->src_fd < 0) {
         cpy->src_err = errno;
         return (-1);
     }
 
-    cpy->dst_fd = open(cpy->dst_fname, cpy->dst_o_flags, cpy->dst_o_perm);
+    cpy->dst_fd = long_open(cpy->dst_fname, cpy->dst_o_flags, cpy->dst_o_perm);
     if (cpy->dst_fd < 0) {
         cpy->dst_err = errno;
         close(cpy->src_fd);
@@ -225,7 +234,11 @@ file_copy(file_copy_t *cpy)
 
     if (rv) {
         if (!(cpy->op & APPEND)) {
-            unlink(cpy->dst_fname);
+            dfd = long_path_at(cpy->dst_fname, &name);
+            if (dfd != -1) {
+                unlinkat(dfd, name, 0);
+                long_path_done(dfd);
+            }
         }
     }
 
@@ -238,6 +251,9 @@ mmv_copy(mmv_t *mmv, FILEINFO *ff, size_t len)
     file_copy_t cpy;
     int rv;
 
+    // The mode bits are needed, but d_type alone does not provide them.
+    getstat(mmv->pathbuf, ff);
+
     memset(&cpy, 0, sizeof (file_copy_t));
     cpy.src_fname = mmv->pathbuf;
     cpy.dst_fname = mmv->fullrep;
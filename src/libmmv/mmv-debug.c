@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <stdint.h>		// Import uintptr_t
+#include <linux/limits.h>	// Import PATH_MAX
 #include <eprint.h>
 
 #define IMPORT_REP
@@ -103,12 +104,16 @@ decode_fi_stflags(char *buf, size_t sz, unsigned int flgs)
     pos = 0;
     append_flag(flgs, FI_ISLNK, buf, sz, &pos, "FI_ISLNK");
     append_flag(flgs, FI_ISDIR, buf, sz, &pos, "FI_ISDIR");
+    append_flag(flgs, FI_CANREAD, buf, sz, &pos, "FI_CANREAD");
+    append_flag(flgs, FI_KNOWREAD, buf, sz, &pos, "FI_KNOWREAD");
     append_flag(flgs, FI_CANWRITE, buf, sz, &pos, "FI_CANWRITE");
     append_flag(flgs, FI_KNOWWRITE, buf, sz, &pos, "FI_KNOWWRITE");
     append_flag(flgs, FI_NODEL, buf, sz, &pos, "FI_NODEL");
     append_flag(flgs, FI_INSTICKY, buf, sz, &pos, "FI_INSTICKY");
     append_flag(flgs, FI_LINKERR, buf, sz, &pos, "FI_LINKERR");
     append_flag(flgs, FI_STTAKEN, buf, sz, &pos, "FI_STTAKEN");
+    append_flag(flgs, FI_TYPEKNOWN, buf, sz, &pos, "FI_TYPEKNOWN");
+    append_flag(flgs, FI_NOENT, buf, sz, &pos, "FI_NOENT");
     buf[pos] = '\0';
 }
 
@@ -285,13 +290,15 @@ fdump_name(FILE *f, const char *p, const char *desc)
 void
 fdump_handle(FILE *f, HANDLE *h, const char *desc)
 {
+    char hn[MMV_PATH_MAX + 1];
+
     fdump_desc(f, h, desc);
     if (h == NULL) {
         return;
     }
 
     ++level;
-    fdump_name(f, h->h_name, "h_name");
+    fdump_name(f, path_str(h->h_path, hn), "h_path");
     fdump_pointer(f, h->h_di, "h_di");
     fdump_indent(f);
     fprintf(f, "h_err = %u\n", h->h_err);
@@ -344,7 +351,7 @@ fdump_replacement_structure(FILE *f, REP *rp)
     fdump_handle(f, rp->r_hfrom, "r_hfrom");
     fdump_fileinfo(f, rp->r_ffrom, "r_ffrom");
     fdump_handle(f, rp->r_hto, "r_hto");
-    fdump_name(f, rp->r_nto, "r_nto");
+    fdump_name(f, str_name(rp->r_nto), "r_nto");
     fdump_fileinfo(f, rp->r_fdel, "r_fdel");
     fdump_pointer(f, rp->r_first, "r_first");
     fdump_pointer(f, rp->r_thendo, "r_thendo");
@@ -0,0 +1,370 @@
+/*
+ * Filename: src/libmmv/mmv-dirfd.c
+ * Library: libmmv
+ * Brief: Keep directory descriptors for |HANDLE|s, in a bounded LRU cache
+ *
+ * Description:
+ *   Every operation on a file used to go through a full path,
+ *   directory + filename, so the kernel walked every component of the
+ *   directory again, for each access(), rename(), link(), unlink().
+ *   Instead, a |HANDLE| can have an O_PATH descriptor of its directory,
+ *   and the *at() system calls take just the simple filename,
+ *   relative to that descriptor.
+ *
+ *   Descriptors are kept in a least-recently-used list.  The number
+ *   of descriptors held is bounded, and the bound is well below the
+ *   RLIMIT_NOFILE soft limit, so that copies and lazy directories
+ *   still have descriptors to work with.
+ *
+ *   A descriptor stays attached to the directory it was opened on,
+ *   even if that directory is renamed.  mmv has always meant paths,
+ *   so whenever something that might be a directory, or a symbolic
+ *   link to one, is renamed or removed, all descriptors are dropped
+ *   with dirfd_flush(), and get opened again by path, as needed.
+ *
+ *   If a descriptor cannot be opened, callers fall back to the full
+ *   path, relative to AT_FDCWD, so nothing works any worse than before.
+ *
+ *   Paths can be longer than PATH_MAX, up to MMV_PATH_MAX, when a ';'
+ *   walk goes deep.  The kernel refuses those, so long_path_at() opens
+ *   the directories on the way a piece at a time, each piece shorter
+ *   than PATH_MAX, and leaves a short enough name for an *at() call.
+ *
+ * Copyright (C) 2016 Guy Shaw
+ * Written by Guy Shaw <gshaw@acm.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdbool.h>
+#include <stdio.h>          // Import fprintf()
+#include <string.h>         // Import memcpy(), memrchr(), strlen()
+#include <errno.h>          // Import errno
+#include <fcntl.h>          // Import openat(), O_PATH, AT_FDCWD
+#include <unistd.h>         // Import close()
+#include <sys/resource.h>   // Import getrlimit()
+#include <linux/limits.h>   // Import PATH_MAX
+
+#define IMPORT_FILEINFO
+#include <mmv-impl.h>
+#include <mmv-impl-rep.h>
+
+#ifndef O_PATH
+#define O_PATH O_RDONLY
+#endif
+
+/*
+ * Never hold more than DIRFD_MAX descriptors,
+ * nor more than 1/DIRFD_RLIMIT_SHARE of RLIMIT_NOFILE.
+ */
+
+#define DIRFD_MAX          256
+#define DIRFD_MIN          4
+#define DIRFD_RLIMIT_SHARE 4
+
+static HANDLE *lru_head;        // Most recently used
+static HANDLE *lru_tail;        // Least recently used
+static unsigned int lru_count;
+static unsigned int lru_limit;
+
+struct dirfd_stats {
+    size_t hits;
+    size_t opens;
+    size_t fails;       // open failed; caller used the full path
+    size_t evictions;
+    size_t flushes;
+};
+
+static struct dirfd_stats dfstats;
+
+static unsigned int
+dirfd_limit(void)
+{
+    struct rlimit rl;
+    rlim_t lim;
+
+    lim = DIRFD_MAX;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        if (rl.rlim_cur / DIRFD_RLIMIT_SHARE < lim) {
+            lim = rl.rlim_cur / DIRFD_RLIMIT_SHARE;
+        }
+    }
+    if (lim < DIRFD_MIN) {
+        lim = DIRFD_MIN;
+    }
+    return ((unsigned int)lim);
+}
+
+static void
+lru_unlink(HANDLE *h)
+{
+    if (h->h_lru_prev != NULL) {
+        h->h_lru_prev->h_lru_next = h->h_lru_next;
+    }
+    else {
+        lru_head = h->h_lru_next;
+    }
+    if (h->h_lru_next != NULL) {
+        h->h_lru_next->h_lru_prev = h->h_lru_prev;
+    }
+    else {
+        lru_tail = h->h_lru_prev;
+    }
+    h->h_lru_prev = NULL;
+    h->h_lru_next = NULL;
+}
+
+static void
+lru_push(HANDLE *h)
+{
+    h->h_lru_prev = NULL;
+    h->h_lru_next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->h_lru_prev = h;
+    }
+    else {
+        lru_tail = h;
+    }
+    lru_head = h;
+}
+
+static void
+dirfd_close(HANDLE *h)
+{
+    lru_unlink(h);
+    close(h->h_fd);
+    h->h_fd = -1;
+    --lru_count;
+}
+
+/**
+ * @brief Make a path of any length usable by the *at() system calls.
+ *
+ * @param path   IN   path, up to MMV_PATH_MAX long
+ * @param pname  OUT  what is left of |path|, relative to the result
+ * @return AT_FDCWD, if |path| is shorter than PATH_MAX, and |*pname| is
+ *         |path|; otherwise, a descriptor of a directory on the way,
+ *         to be given back with long_path_done(); or -1 (with errno set)
+ *
+ */
+
+int
+long_path_at(const char *path, const char **pname)
+{
+    char part[PATH_MAX];
+    const char *cut;
+    size_t len;
+    int dfd, fd;
+
+    dfd = AT_FDCWD;
+    while (strlen(path) >= PATH_MAX) {
+        cut = (const char *) memrchr(path, '/', PATH_MAX - 1);
+        if (cut == NULL || cut == path) {
+            // One component is too long, by itself.
+            long_path_done(dfd);
+            errno = ENAMETOOLONG;
+            return (-1);
+        }
+        len = cut - path;
+        memcpy(part, path, len);
+        part[len] = '\0';
+        fd = openat(dfd, part, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        long_path_done(dfd);
+        if (fd < 0) {
+            return (-1);
+        }
+        dfd = fd;
+        path = cut + 1;
+    }
+    *pname = path;
+    return (dfd);
+}
+
+/**
+ * @brief Give back a descriptor from long_path_at().
+ *
+ */
+
+void
+long_path_done(int dfd)
+{
+    if (dfd >= 0) {
+        close(dfd);
+    }
+}
+
+/**
+ * @brief open() a path of any length.
+ *
+ * @param path   IN  path, up to MMV_PATH_MAX long
+ * @param flags  IN  as for open()
+ * @param mode   IN  as for open(), with O_CREAT
+ * @return file descriptor, or -1 (with errno set)
+ *
+ */
+
+int
+long_open(const char *path, int flags, mode_t mode)
+{
+    const char *name;
+    int dfd, fd;
+
+    dfd = long_path_at(path, &name);
+    if (dfd == -1) {
+        return (-1);
+    }
+    fd = openat(dfd, name, flags, mode);
+    long_path_done(dfd);
+    return (fd);
+}
+
+/**
+ * @brief Get a descriptor of the directory of a |HANDLE|.
+ *
+ * @param h  IN  |HANDLE| in question
+ * @return O_PATH descriptor, or -1, if it could not be opened
+ *
+ * The descriptor belongs to the cache.  Do not close it.
+ * It stays open until dirfd_flush(), or until at least DIRFD_MIN - 1
+ * other |HANDLE|s have been asked for, since only the least recently
+ * used descriptor is ever evicted.
+ *
+ */
+
+int
+handle_fd(HANDLE *h)
+{
+    char dpath[MMV_PATH_MAX + 1];
+    const char *myp;
+    size_t len;
+    int fd;
+
+    if (h->h_fd >= 0) {
+        ++dfstats.hits;
+        if (h != lru_head) {
+            lru_unlink(h);
+            lru_push(h);
+        }
+        return (h->h_fd);
+    }
+
+    len = path_len(h->h_path);
+    if (len == 0) {
+        myp = ".";
+    }
+    else if (len > MMV_PATH_MAX) {
+        ++dfstats.fails;
+        return (-1);
+    }
+    else if (len == 1) {
+        myp = "/";
+    }
+    else {
+        path_copy(h->h_path, dpath);
+        dpath[len - 1] = '\0';
+        myp = dpath;
+    }
+
+    fd = long_open(myp, O_PATH | O_DIRECTORY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        ++dfstats.fails;
+        return (-1);
+    }
+    ++dfstats.opens;
+
+    if (lru_limit == 0) {
+        lru_limit = dirfd_limit();
+    }
+    if (lru_count >= lru_limit) {
+        ++dfstats.evictions;
+        dirfd_close(lru_tail);
+    }
+    h->h_fd = fd;
+    lru_push(h);
+    ++lru_count;
+    return (fd);
+}
+
+/**
+ * @brief Choose how to name a file in a |HANDLE|'s directory, for *at() calls.
+ *
+ * @param h      IN   |HANDLE| of the directory
+ * @param name   IN   simple filename, relative to |h|
+ * @param path   IN   full path of the same file
+ * @param pname  OUT  |name| or |path|, whichever goes with the result
+ * @return descriptor of the directory, or AT_FDCWD
+ *
+ */
+
+int
+handle_at(HANDLE *h, const char *name, const char *path, const char **pname)
+{
+    int fd;
+
+    fd = handle_fd(h);
+    if (fd < 0) {
+        *pname = path;
+        return (AT_FDCWD);
+    }
+    *pname = name;
+    return (fd);
+}
+
+/**
+ * @brief Close all cached directory descriptors.
+ *
+ */
+
+void
+dirfd_flush(void)
+{
+    if (lru_count != 0) {
+        ++dfstats.flushes;
+    }
+    while (lru_head != NULL) {
+        dirfd_close(lru_head);
+    }
+}
+
+/**
+ * @brief Note that a file has been renamed or removed.
+ *
+ * @param f  IN  |FILEINFO| of the file that went away, or NULL if not known
+ *
+ * If it could have been a directory that some |HANDLE| goes through,
+ * then the cached descriptors may no longer match their paths.
+ *
+ */
+
+void
+dirfd_moved(FILEINFO *f)
+{
+    if (lru_count == 0) {
+        return;
+    }
+    if (f == NULL || !(f->fi_stflags & (FI_TYPEKNOWN | FI_STTAKEN)) || (f->fi_stflags & (FI_ISDIR | FI_ISLNK))) {
+        dirfd_flush();
+    }
+}
+
+void
+fdump_dirfd_stats(FILE *f)
+{
+    fprintf(f, "dirfd:\n");
+    fprintf(f, "    hits=%zu, opens=%zu, fails=%zu, evictions=%zu, flushes=%zu, limit=%u\n",
+        dfstats.hits, dfstats.opens, dfstats.fails, dfstats.evictions, dfstats.flushes,
+        lru_limit);
+}
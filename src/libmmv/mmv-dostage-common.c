@@ -31,7 +31,10 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <fnmatch.h>
 #include <errno.h>	// Import EINVAL, ENOTSUP
+#include <stdint.h>	// Import uint64_t
+#include <limits.h>	// Import UINT_MAX
 
 /* For various flavors of Unix */
 
@@ -41,11 +44,11 @@
 #include <utime.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <signal.h>
 #include <fcntl.h>
 
 #include <dirent.h>
-typedef struct dirent DIRENTRY;
 
 #include <eprint.h>
 #include <dbgprint.h>
@@ -60,6 +63,7 @@ typedef struct dirent DIRENTRY;
 #define IMPORT_FILEINFO
 #define IMPORT_ALLOC
 #define IMPORT_DEBUG
+#define IMPORT_DIRBUF
 
 #include <mmv-impl.h>
 
@@ -97,8 +101,7 @@ size_t ndirs;
 HANDLE **handles;
 size_t nhandles;
 size_t handleroom;
-char badhandle_name[] = "\200";
-HANDLE badhandle = {badhandle_name, NULL, 0};
+HANDLE badhandle = {INTERN_NONE, NULL, 0, -1, NULL, NULL};
 HANDLE *(lasthandle[2]) = {&badhandle, &badhandle};
 int repbad;
 
@@ -108,6 +111,81 @@ int repbad;
 
 static size_t dirroom;
 
+/*
+ * Indexes into |handles| and |dirs|.
+ *
+ * |hbypath| maps the interned path of a handle (see mmv-intern.c)
+ * to the handle, or to NULL.  It is indexed directly by path id,
+ * and grows as needed.  |lasthandle[]| is still consulted first,
+ * as a front cache.
+ *
+ * |dtab| is an open-addressing table with linear probing,
+ * keyed by { devid, dirid }.  Its size is a power of 2, and it is
+ * doubled before it gets more than half full, so there is always
+ * an empty slot to terminate a probe sequence.
+ * Entries are never removed.
+ */
+
+#define HTAB_INITSIZE 64
+
+static HANDLE **hbypath;
+static size_t hbypath_size;
+static DIRINFO **dtab;
+static size_t dtab_size;
+
+struct dircache_stats {
+    size_t h_lookups;   // Calls to hsearch()
+    size_t h_lasthits;  // ... satisfied by |lasthandle[]|
+    size_t h_hits;      // ... satisfied by |hbypath|
+    size_t h_misses;    // ... that had to add a new handle
+    size_t d_lookups;   // Calls to dsearch()
+    size_t d_hits;
+    size_t d_misses;
+    size_t d_probes;    // Slots visited in |dtab|
+    size_t l_dirs;      // Directories started in lazy mode
+    size_t l_probes;    // fstatat() calls on lazy directories
+    size_t l_memohits;  // Lookups answered by |di_memo|
+    size_t l_scans;     // Lazy directories that were read in full, anyway
+    size_t i_builds;    // Hash indexes built for fsearch()
+    size_t i_lookups;   // fsearch() calls answered by a hash index
+    size_t s_builds;    // Suffix indexes built for fsuffix()
+    size_t s_lookups;   // fsuffix() calls answered by a suffix index
+    size_t s_names;     // ... and the names they gave, in all
+    size_t e_evictions; // Listings dropped by dircache_trim()
+    size_t e_reloads;   // Evicted directories that were needed again
+    size_t w_glob;      // Subdirectories a ';' walk skipped, by name
+    size_t w_depth;     // ... skipped, for being too deep
+    size_t w_xdev;      // ... skipped, for being on another filesystem
+};
+
+static struct dircache_stats dcstats;
+
+/*
+ * Memory budget of the directory cache.
+ *
+ * A library user that runs many batches in one process would
+ * otherwise keep every listing it ever read, forever.
+ * |dc_resident| is the sum of |di_bytes| of all |DIRINFO|s.
+ * When it goes over |dc_budget|, the least recently used listings
+ * are dropped, and read again, if they are ever needed again.
+ * A budget of 0 means no limit, which is the default.
+ */
+
+static size_t dc_budget;
+static size_t dc_resident;
+static DIRINFO *dc_lru_head;    // Most recently used
+static DIRINFO *dc_lru_tail;    // Least recently used
+
+static void **
+hashtab_new(size_t size)
+{
+    void **tab;
+
+    tab = (void **) mmv_alloc(size * sizeof (void *));
+    memset(tab, 0, size * sizeof (void *));
+    return (tab);
+}
+
 void
 init_dostage(void)
 {
@@ -121,6 +199,76 @@ init_dostage(void)
 
     handles = (HANDLE **) mmv_alloc(handleroom * sizeof (HANDLE *));
     nhandles = 0;
+
+    hbypath_size = dtab_size = HTAB_INITSIZE;
+    hbypath = (HANDLE **) hashtab_new(hbypath_size);
+    dtab = (DIRINFO **) hashtab_new(dtab_size);
+}
+
+/**
+ * @brief Hash a handle name (FNV-1a).
+ *
+ * @param s  IN  nul-terminated handle name
+ * @return hash value
+ *
+ */
+
+static inline size_t
+hash_name(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*s) {
+        h ^= (unsigned char)*s;
+        h *= 0x100000001b3ULL;
+        ++s;
+    }
+    return ((size_t)h);
+}
+
+/**
+ * @brief Hash a { devid, dirid } pair.
+ *
+ */
+
+static inline size_t
+hash_dirid(DEVID v, DIRID d)
+{
+    uint64_t h;
+
+    h = ((uint64_t)d * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t)v + 0x632be59bd9b4e019ULL);
+    h ^= h >> 29;
+    return ((size_t)h);
+}
+
+/**
+ * @brief Print hit/miss counters of the directory and handle registries.
+ *
+ * @param f  IN  Where to print
+ *
+ */
+
+void
+fdump_dircache_stats(FILE *f)
+{
+    fprintf(f, "dircache:\n");
+    fprintf(f, "    handles: n=%zu, by-path=%zu\n", nhandles, hbypath_size);
+    fprintf(f, "    hsearch: lookups=%zu, lasthandle-hits=%zu, hits=%zu, misses=%zu\n",
+        dcstats.h_lookups, dcstats.h_lasthits, dcstats.h_hits,
+        dcstats.h_misses);
+    fprintf(f, "    dirs:    n=%zu, table=%zu\n", ndirs, dtab_size);
+    fprintf(f, "    dsearch: lookups=%zu, hits=%zu, misses=%zu, probes=%zu\n",
+        dcstats.d_lookups, dcstats.d_hits, dcstats.d_misses, dcstats.d_probes);
+    fprintf(f, "    lazy:    dirs=%zu, probes=%zu, memo-hits=%zu, full-scans=%zu\n",
+        dcstats.l_dirs, dcstats.l_probes, dcstats.l_memohits, dcstats.l_scans);
+    fprintf(f, "    index:   builds=%zu, lookups=%zu\n",
+        dcstats.i_builds, dcstats.i_lookups);
+    fprintf(f, "    suffix:  builds=%zu, lookups=%zu, names=%zu\n",
+        dcstats.s_builds, dcstats.s_lookups, dcstats.s_names);
+    fprintf(f, "    memory:  resident=%zu, budget=%zu, evictions=%zu, reloads=%zu\n",
+        dc_resident, dc_budget, dcstats.e_evictions, dcstats.e_reloads);
+    fprintf(f, "    pruned:  by-name=%zu, by-depth=%zu, by-device=%zu\n",
+        dcstats.w_glob, dcstats.w_depth, dcstats.w_xdev);
 }
 
 /**
@@ -212,25 +360,34 @@ trymatch(mmv_t *mmv, FILEINFO *ffrom, char *pat)
 }
 
 /**
- * @brief  getstat  ???
+ * @brief Get full stat() information about a file; keep a record of it.
  *
- * @param ffull   ???  ???
- * @param f       ???  ???
+ * @param ffull   IN     full path of the file
+ * @param f       INOUT  |FILEINFO| of the file; gets fi_mode and FI_ISDIR
  * @return exit-style status.  0 = OK, non-zero = error.
  *
+ * Most callers only need to know whether a file is a directory,
+ * and should call gettype(), instead.
+ * getstat() is for when the mode bits are actually needed.
+ *
  */
 
-static int
-getstat(char *ffull, FILEINFO *f)
+int
+getstat(const char *ffull, FILEINFO *f)
 {
     struct stat fstat;
+    const char *name;
     unsigned int flags;
+    int dfd, rv;
 
     if ((flags = f->fi_stflags) & FI_STTAKEN) {
         return ((flags & FI_LINKERR) != 0);
     }
-    flags |= FI_STTAKEN;
-    if (stat(ffull, &fstat)) {
+    flags |= FI_STTAKEN | FI_TYPEKNOWN;
+    dfd = long_path_at(ffull, &name);
+    rv = dfd == -1 || fstatat(dfd, name, &fstat, 0);
+    long_path_done(dfd);
+    if (rv) {
         eprintf("Strange, couldn't stat %s.\n", ffull);
         // XXX Use libexplain
         quit();
@@ -238,11 +395,34 @@ getstat(char *ffull, FILEINFO *f)
     if (S_ISDIR(fstat.st_mode)) {
         flags |= FI_ISDIR;
     }
+    flags |= perm_fi_flags(fstat.st_dev, fstat.st_mode, fstat.st_uid, 0);
     f->fi_stflags = flags;
     f->fi_mode = fstat.st_mode;
     return (0);
 }
 
+/**
+ * @brief Make sure that we know whether a file is a directory.
+ *
+ * @param ffull   IN     full path of the file
+ * @param f       INOUT  |FILEINFO| of the file
+ *
+ * If the type was already learned from d_type, when the directory
+ * was read, then no system call is needed.  Otherwise, fall back
+ * to getstat().  Symbolic links are always stat()ed, because
+ * it is the type of the target that matters.
+ *
+ */
+
+static inline void
+gettype(const char *ffull, FILEINFO *f)
+{
+    if (f->fi_stflags & (FI_STTAKEN | FI_TYPEKNOWN)) {
+        return;
+    }
+    getstat(ffull, f);
+}
+
 /**
  * @brief keepmatch()  ???
  *
@@ -261,8 +441,8 @@ getstat(char *ffull, FILEINFO *f)
 int
 keepmatch(mmv_t *mmv, FILEINFO *ffrom, char *pathend, int *pk, int needslash, int dirs, bool fils)
 {
-    *pk = strlen(ffrom->fi_name);
-    if (pathend - mmv->pathbuf + *pk + needslash >= PATH_MAX) {
+    *pk = ffrom->fi_len;
+    if (pathend - mmv->pathbuf + *pk + needslash >= MMV_PATH_MAX) {
         *pathend = '\0';
         printf("%s -> %s : search path %s%s too long.\n",
             mmv->from, mmv->to, mmv->pathbuf, ffrom->fi_name);
@@ -270,7 +450,7 @@ keepmatch(mmv_t *mmv, FILEINFO *ffrom, char *pathend, int *pk, int needslash, in
         return (0);
     }
     strcpy(pathend, ffrom->fi_name);
-    getstat(mmv->pathbuf, ffrom);
+    gettype(mmv->pathbuf, ffrom);
     if ((ffrom->fi_stflags & FI_ISDIR) ? !dirs : !fils) {
         return (0);
     }
@@ -282,6 +462,85 @@ keepmatch(mmv_t *mmv, FILEINFO *ffrom, char *pathend, int *pk, int needslash, in
     return (1);
 }
 
+/**
+ * @brief Tell whether a ';' walk must skip a subdirectory, by its name.
+ *
+ * @param mmv
+ * @param name  IN  name of the subdirectory, with no slashes
+ * @return true if |name| matches one of the globs given to mmv_add_prune()
+ *
+ * This only reads |mmv->prune_vec|, so it is safe to call from any thread.
+ *
+ */
+
+bool
+walk_pruned(const mmv_t *mmv, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < mmv->prune_cnt; ++i) {
+        if (fnmatch(mmv->prune_vec[i], name, FNM_PERIOD) == 0) {
+            return (true);
+        }
+    }
+    return (false);
+}
+
+/**
+ * @brief Decide whether a ';' walk should descend into a subdirectory.
+ *
+ * @param mmv
+ * @param h        IN  the directory that |f| is in
+ * @param f        IN  an entry of that directory, maybe a subdirectory
+ * @param pathend  IN  end of the path of that directory, in mmv->pathbuf
+ * @param level    IN  how many levels below the start of the walk it is
+ * @param dev      IN  device of the directory where the walk started
+ * @return true to descend, false to prune the whole subtree
+ *
+ * This is asked before keepmatch(), so that a pruned subtree
+ * costs neither a stat() of its top, nor a complaint that its
+ * path is too long.  An entry known not to be a directory is left
+ * for keepmatch() to turn down.
+ *
+ * The checks are made in order of cost.  Only the last one,
+ * for mmv->walk_onefs, makes a system call, relative to the
+ * descriptor of |h|, if there is one.  A subtree that is
+ * pruned is never read, so patterns cannot match anything in it.
+ *
+ */
+
+bool
+walk_descend(mmv_t *mmv, HANDLE *h, FILEINFO *f, char *pathend, unsigned int level, DEVID dev)
+{
+    struct stat dstat;
+    const char *name;
+    int fd;
+
+    if ((f->fi_stflags & (FI_TYPEKNOWN | FI_ISDIR)) == FI_TYPEKNOWN) {
+        return (true);
+    }
+    if (mmv->walk_maxdepth != 0 && level > mmv->walk_maxdepth) {
+        ++dcstats.w_depth;
+        return (false);
+    }
+    if (walk_pruned(mmv, f->fi_name)) {
+        ++dcstats.w_glob;
+        return (false);
+    }
+    if (mmv->walk_onefs) {
+        if (pathend - mmv->pathbuf + f->fi_len >= MMV_PATH_MAX) {
+            return (true);      // keepmatch() reports it
+        }
+        strcpy(pathend, f->fi_name);
+        fd = handle_at(h, f->fi_name, mmv->pathbuf, &name);
+        if (fstatat(fd, name, &dstat, 0) == 0 && dstat.st_dev != dev) {
+            ++dcstats.w_xdev;
+            return (false);
+        }
+    }
+    return (true);
+}
+
 /**
  * @brief getpath()  ???
  *
@@ -310,114 +569,902 @@ getpath(mmv_t *mmv, char *tpath)
     return (pathend);
 }
 
-/*
- * @brief Search a sorted array of filenames.
- * @param s    IN  key: the filename to search for
- * @param d    IN  A sorted list of directory entries to be searched
- * @return The FILEINFO of the found filename, or NULL if not found.
- *
- * Method:
- *   The filenames to be searched are in an array and are sorted,
- *   so do a binary search.
+/*
+ * @brief Search a sorted array of filenames.
+ * @param s    IN  key: the filename to search for
+ * @param d    IN  A sorted list of directory entries to be searched
+ * @return The FILEINFO of the found filename, or NULL if not found.
+ *
+ * Method:
+ *   The filenames to be searched are in an array and are sorted,
+ *   so do a binary search.
+ *
+ */
+static FILEINFO *
+fsearch_sorted(const char *s, DIRINFO const *d)
+{
+    FILEINFO **fils = d->di_fils;
+    int nfils = d->di_nfils;
+    int first, k, last, res;
+
+    for (first = 0, last = nfils - 1; ; ) {
+        if (last < first) {
+            return (NULL);
+        }
+        k = (first + last) >> 1;
+        if ((res = strcmp(s, fils[k]->fi_name)) == 0) {
+            return (fils[k]);
+        }
+        if (res < 0) {
+            last = k - 1;
+        }
+        else {
+            first = k + 1;
+        }
+    }
+}
+
+/**
+ * @brief  Compare two |FILEINFO| structures by filename.
+ *
+ * @param  vp1  IN  comparand
+ * @param  vp2  IN  comparand
+ * @return (-,0,+) comparison result (a la strcmp())
+ *
+ * This is a callback function used by bsearch().
+ * bsearch() takes void pointers.  We use pointers to |FILEINFO| structures.
+ *
+ */
+
+static int
+fcmp(const void *vp1, const void *vp2)
+{
+    const FILEINFO * const *pf1 = (const FILEINFO * const *)vp1;
+    const FILEINFO * const *pf2 = (const FILEINFO * const *)vp2;
+    return (strcmp((*pf1)->fi_name, (*pf2)->fi_name));
+}
+
+/**
+ * @brief Translate a d_type value to |fi_stflags| bits.
+ *
+ * @param d_type  IN  DT_* value from getdents64()
+ * @return FI_TYPEKNOWN, FI_ISDIR bits
+ *
+ * For a symbolic link, d_type does not tell us whether it leads
+ * to a directory, so the type is left unknown, and gettype()
+ * will stat() it, just as before.
+ *
+ */
+
+unsigned int
+dtype_flags(unsigned char d_type)
+{
+    switch (d_type) {
+    case DT_UNKNOWN:
+    case DT_LNK:
+        return (0);
+    case DT_DIR:
+        return (FI_TYPEKNOWN | FI_ISDIR);
+    default:
+        return (FI_TYPEKNOWN);
+    }
+}
+
+/*
+ * Directory cache LRU list, and accounting.
+ *
+ * A |DIRINFO| itself is never freed, because |HANDLE|s point to it.
+ * Only its listing is: |di_fils|, |di_recs|, |di_pool|, |di_index|
+ * and |di_memo|, with the |FILEINFO|s that fprobe() made.
+ *
+ * A listing is never dropped while it is in use:
+ *   - |di_refs| counts walks in progress, from dostage_patterns()
+ *     and dostage_fnames(), which hold |FILEINFO| pointers;
+ *   - DI_MARKED is set on the 'from' and 'to' directories of every |REP|,
+ *     and on directories where a file was marked as a mistake,
+ *     until dircache_release(), at the end of mmv_execute().
+ */
+
+static void
+dir_lru_unlink(DIRINFO *di)
+{
+    if (di->di_lru_prev != NULL) {
+        di->di_lru_prev->di_lru_next = di->di_lru_next;
+    }
+    else if (dc_lru_head == di) {
+        dc_lru_head = di->di_lru_next;
+    }
+    else {
+        return;     // Not on the list
+    }
+    if (di->di_lru_next != NULL) {
+        di->di_lru_next->di_lru_prev = di->di_lru_prev;
+    }
+    else {
+        dc_lru_tail = di->di_lru_prev;
+    }
+    di->di_lru_prev = NULL;
+    di->di_lru_next = NULL;
+}
+
+/**
+ * @brief Make a |DIRINFO| the most recently used.
+ *
+ */
+
+static void
+dir_touch(DIRINFO *di)
+{
+    if (dc_lru_head == di) {
+        return;
+    }
+    dir_lru_unlink(di);
+    di->di_lru_next = dc_lru_head;
+    if (dc_lru_head != NULL) {
+        dc_lru_head->di_lru_prev = di;
+    }
+    else {
+        dc_lru_tail = di;
+    }
+    dc_lru_head = di;
+}
+
+/**
+ * @brief Recompute the resident size of the listing of a |DIRINFO|.
+ *
+ * @param di  INOUT  Directory information, just changed
+ *
+ * The sizes are of what was asked of malloc(), or of the mapping
+ * of a snapshot, not of what the allocator really uses.
+ *
+ */
+
+static void
+dir_account(DIRINFO *di)
+{
+    size_t bytes;
+
+    if (di->di_flags & DI_EXTERNAL) {
+        // File-backed; the kernel can write it back and drop it.
+        bytes = 0;
+    }
+    else {
+        bytes = di->di_poolsize;
+    }
+    if (di->di_fils != NULL && !(di->di_flags & DI_EXTERNAL)) {
+        bytes += (di->di_nfils + 1) * sizeof (FILEINFO *);
+    }
+    if (di->di_recs != NULL) {
+        bytes += (di->di_nfils + 1) * sizeof (FILEINFO);
+    }
+    bytes += di->di_indexsize * sizeof (struct dirindex_slot);
+    if (di->di_eytz != NULL) {
+        bytes += (di->di_nfils + 1) * (sizeof (uint64_t) + sizeof (unsigned int));
+    }
+    if (di->di_sfx != NULL) {
+        bytes += di->di_nfils * sizeof (unsigned int);
+    }
+    bytes += di->di_memosize * sizeof (FILEINFO *) + di->di_nmemo * sizeof (FILEINFO);
+    dc_resident += bytes - di->di_bytes;
+    di->di_bytes = bytes;
+}
+
+/**
+ * @brief Free |di_memo|, and the |FILEINFO|s that fprobe() made.
+ *
+ */
+
+static void
+memo_free(DIRINFO *di)
+{
+    unsigned int i;
+
+    for (i = 0; i < di->di_memosize; ++i) {
+        free(di->di_memo[i]);
+    }
+    free(di->di_memo);
+}
+
+/**
+ * @brief Drop the listing of a |DIRINFO|.
+ *
+ * @param di  INOUT  Directory information; must not be in use
+ *
+ * The next checkdir() that needs the directory reads it again.
+ * The |FILEINFO|s that fprobe() made, which |di_memo| still holds,
+ * even after a full scan, are freed with it.
+ *
+ */
+
+static void
+dir_evict(DIRINFO *di)
+{
+    if (!(di->di_flags & DI_EXTERNAL)) {
+        // Otherwise, they are in the mapping, at |di_pool|.
+        free(di->di_fils);
+        free(di->di_recs);
+    }
+    free(di->di_index);
+    free(di->di_eytz);
+    free(di->di_eytzpos);
+    free(di->di_sfx);
+    if (di->di_flags & (DI_MAPPED | DI_EXTERNAL)) {
+        munmap(di->di_pool, di->di_poolsize);
+    }
+    else {
+        free(di->di_pool);
+    }
+    if (di->di_memo != NULL) {
+        memo_free(di);
+    }
+    dc_resident -= di->di_bytes;
+    dir_lru_unlink(di);
+
+    di->di_nfils = 0;
+    di->di_nuntyped = 0;
+    di->di_mode = 0;
+    di->di_uid = 0;
+    di->di_pattr = 0;
+    di->di_fils = NULL;
+    di->di_recs = NULL;
+    di->di_pool = NULL;
+    di->di_poolsize = 0;
+    di->di_index = NULL;
+    di->di_indexsize = 0;
+    di->di_eytz = NULL;
+    di->di_eytzpos = NULL;
+    di->di_sfx = NULL;
+    di->di_sfxuses = 0;
+    di->di_h = NULL;
+    di->di_memo = NULL;
+    di->di_memosize = 0;
+    di->di_nmemo = 0;
+    di->di_bytes = 0;
+    di->di_flags = DI_EVICTED;
+    ++dcstats.e_evictions;
+}
+
+/**
+ * @brief Drop least recently used listings, until within budget.
+ *
+ * @param keep  IN  |DIRINFO| that must stay, or NULL
+ *
+ */
+
+static void
+dircache_trim(DIRINFO *keep)
+{
+    DIRINFO *di, *prev;
+
+    if (dc_budget == 0) {
+        return;
+    }
+    for (di = dc_lru_tail; di != NULL && dc_resident > dc_budget; di = prev) {
+        prev = di->di_lru_prev;
+        if (di != keep && di->di_refs == 0 && !(di->di_flags & DI_MARKED)) {
+            dir_evict(di);
+        }
+    }
+}
+
+/**
+ * @brief Set the memory budget of the directory cache.
+ *
+ * @param bytes  IN  budget, in bytes; 0 means no limit
+ *
+ */
+
+void
+dircache_set_budget(size_t bytes)
+{
+    dc_budget = bytes;
+    dircache_trim(NULL);
+}
+
+/**
+ * @brief Keep the listing of a directory, while a walk uses it.
+ *
+ */
+
+void
+dir_pin(DIRINFO *di)
+{
+    ++di->di_refs;
+}
+
+void
+dir_unpin(DIRINFO *di)
+{
+    --di->di_refs;
+}
+
+/**
+ * @brief Let go of all directories held for the |REP|s of a run.
+ *
+ * @param mmv  IN  context, after doreps()
+ *
+ * If the |REP|s were carried out, then the 'from' and 'to' directories
+ * no longer look like their listings, so those listings are dropped,
+ * to be read again by a later run in the same process.
+ * Otherwise, or if there is no budget, as in a one-shot mmv,
+ * the marks left in |fi_rep| are just cleared.
+ *
+ * Either way, the |REP|s of this run must not be used, afterwards.
+ *
+ */
+
+void
+dircache_release(mmv_t *mmv)
+{
+    DIRINFO *di;
+    size_t i, j;
+
+    for (i = 0; i < ndirs; ++i) {
+        di = dirs[i];
+        if (!(di->di_flags & DI_MARKED)) {
+            continue;
+        }
+        if (!mmv->noex && dc_budget != 0) {
+            dir_evict(di);
+            continue;
+        }
+        di->di_flags &= ~DI_MARKED;
+        for (j = 0; j < di->di_nfils; ++j) {
+            di->di_fils[j]->fi_rep = NULL;
+        }
+        for (j = 0; j < di->di_memosize; ++j) {
+            if (di->di_memo[j] != NULL) {
+                di->di_memo[j]->fi_rep = NULL;
+            }
+        }
+    }
+    dircache_trim(NULL);
+}
+
+/**
+ * @brief Populate a |DIRINFO| from a buffer of directory entries.
+ *
+ * @param db      INOUT  Directory entries, as read by dirbuf_read()
+ * @param di      OUT    Directory information to be populated
+ * @param sticky  IN     FI_INSTICKY, if the directory is sticky and not ours
+ *
+ * The d_type of each entry is recorded in |fi_stflags|, so that
+ * most entries never need to be stat()ed.
+ *
+ * The records are sorted by name first, and then all the |FILEINFO|s
+ * of the directory are laid out in one array, in that order, and all
+ * the names in one string pool, also in that order.  So, the entries
+ * in |di_fils| are sorted by simple filename, and a scan of |di_fils|
+ * runs sequentially through memory.  That is 3 allocations per
+ * directory, rather than 2 per entry.
+ *
+ * |di_fils| is still a vector of pointers, because |REP|s and
+ * lazy directories hold on to |FILEINFO| pointers.
+ *
+ */
+
+static void
+takedirbuf(dirbuf_t *db, DIRINFO *di, int sticky)
+{
+    struct dirbuf_rec *dp;
+    FILEINFO *f, *recs, **fils;
+    char *pool;
+    size_t pos, poolsize, len;
+    unsigned int nuntyped;
+    int cnt;
+
+    dirbuf_sort(db);
+
+    poolsize = 0;
+    for (pos = 0; pos < db->db_len; pos += dp->d_reclen) {
+        dp = (struct dirbuf_rec *)(db->db_buf + pos);
+        poolsize += strlen(dp->d_name) + 1;
+    }
+
+    di->di_fils = fils = (FILEINFO **) mmv_alloc((db->db_count + 1) * sizeof (FILEINFO *));
+    di->di_recs = recs = (FILEINFO *) mmv_alloc((db->db_count + 1) * sizeof (FILEINFO));
+    di->di_pool = pool = (char *) mmv_alloc(poolsize + 1);
+    di->di_poolsize = poolsize + 1;
+    cnt = 0;
+    nuntyped = 0;
+    for (pos = 0; pos < db->db_len; pos += dp->d_reclen) {
+        dp = (struct dirbuf_rec *)(db->db_buf + pos);
+        len = strlen(dp->d_name);
+        memcpy(pool, dp->d_name, len + 1);
+        *fils = f = &recs[cnt];
+        f->fi_name = pool;
+        f->fi_len = len;
+        f->fi_mode = 0;
+        f->fi_stflags = sticky | dtype_flags(dp->d_type);
+        f->fi_rep = NULL;
+        if (!(f->fi_stflags & FI_TYPEKNOWN)) {
+            ++nuntyped;
+        }
+        pool += len + 1;
+        ++cnt;
+        ++fils;
+    }
+    di->di_nfils = cnt;
+    di->di_nuntyped = nuntyped;
+    di->di_index = NULL;
+    di->di_indexsize = 0;
+}
+
+/**
+ * @brief Read an open directory into a |DIRINFO|.
+ *
+ * @param fd      IN   Descriptor of the directory, open for reading
+ * @param di      OUT  Directory information to be populated
+ * @param sticky  IN   FI_INSTICKY, if the directory is sticky and not ours
+ * @return errno-style status
+ *
+ * If the directory is too big for the memory cap, it goes to
+ * external memory; see mmv-extdir.c.  In any case, |fd| is closed.
+ *
+ */
+
+static int
+takedir_fd(int fd, DIRINFO *di, int sticky)
+{
+    dirbuf_t db;
+    bool done;
+    int err;
+
+    err = extdir_read(fd, di, sticky, &db, &done);
+    if (err == 0 && !done) {
+        takedirbuf(&db, di, sticky);
+        dirbuf_free(&db);
+    }
+    return (err);
+}
+
+/**
+ * @brief Snarf info on all files in a directory.
+ *
+ * @param p       IN   Path to directory
+ * @param di      OUT  Directory information to be populated
+ * @param dstat   IN   stat() information of the directory
+ * @param sticky  IN   FI_INSTICKY, if the directory is sticky and not ours
+ *
+ * If the directory was already read by the parallel prefetch,
+ * that listing is used.  Otherwise, all entries are read
+ * in large batches by takedir_fd().
+ * If snapshots are on, the result is saved; see mmv-snapcache.c.
+ *
+ */
+
+static void
+takedir(const char *p, DIRINFO *di, const struct stat *dstat, int sticky)
+{
+    dirbuf_t db;
+    int fd;
+
+    if (prefetch_take(p, &db)) {
+        takedirbuf(&db, di, sticky);
+        dirbuf_free(&db);
+    }
+    else if ((fd = dirbuf_open(p)) < 0 || takedir_fd(fd, di, sticky)) {
+        eprintf("Strange, can't scan %s.\n", p);
+        // XXX use libexplain
+        quit();
+    }
+    snapcache_save(di, dstat);
+}
+
+/*
+ * Lazy directories.
+ *
+ * A target directory may hold millions of files, while only a few
+ * of its names are ever looked up.  Reading and sorting the whole
+ * directory would dominate the run time.  So, a large directory that
+ * is only needed as a target is not read at first.  Instead, each
+ * lookup is answered by fstatat() on the name, and the answer,
+ * found or not, is remembered in |di_memo|.  Only "no such file"
+ * is remembered as not found; any other failure of fstatat()
+ * is answered by a full scan, instead.
+ *
+ * A lazy directory does not hold a descriptor of its own.
+ * fstatat() goes through the descriptor of its |HANDLE|, from the
+ * bounded cache in mmv-dirfd.c, so that a walk over many big
+ * directories does not run out of descriptors.
+ *
+ * A full scan is done, anyway, as soon as it is needed for wildcard
+ * matching (checkdir() with |which| == 0), or once the number of
+ * probes exceeds |di_budget|, which is derived from the estimated
+ * number of entries.  |FILEINFO|s that were handed out while lazy
+ * are merged into the full scan, so that the same file is always
+ * represented by the same |FILEINFO|.  Collision detection depends
+ * on that.
+ */
+
+/*
+ * A directory estimated to have fewer than DI_LAZY_MIN entries
+ * is read right away, just as before.
+ *
+ * DI_SCAN_PER_PROBE is the number of directory entries that can be
+ * read and sorted for about the cost of one fstatat().
+ *
+ * The number of entries is estimated from st_size, assuming about
+ * DI_BYTES_PER_ENTRY bytes per entry, or from st_nlink,
+ * which counts at least all subdirectories.
+ */
+
+#define DI_LAZY_MIN        4096
+#define DI_SCAN_PER_PROBE  32
+#define DI_BYTES_PER_ENTRY 32
+#define DI_MEMO_INITSIZE   16
+
+/**
+ * @brief Estimate the number of entries in a directory.
+ *
+ * @param dstat  IN  stat() information of the directory
+ * @return rough number of entries
+ *
+ */
+
+static size_t
+dir_estimate(const struct stat *dstat)
+{
+    size_t by_size, by_nlink;
+
+    by_size = (size_t)dstat->st_size / DI_BYTES_PER_ENTRY;
+    by_nlink = (size_t)dstat->st_nlink;
+    return (by_size > by_nlink ? by_size : by_nlink);
+}
+
+/**
+ * @brief Tell whether a directory is big enough to be probed lazily, as a target.
+ *
+ * @param dstat  IN  stat() information of the directory
+ * @return true if checkdir() would not read it, unless it must
+ *
+ * This only looks at |dstat|, so it is safe to call from any thread.
+ *
+ */
+
+bool
+dir_lazy_candidate(const struct stat *dstat)
+{
+    return (dir_estimate(dstat) >= DI_LAZY_MIN);
+}
+
+/**
+ * @brief Start a |DIRINFO| in lazy mode, if the directory is big enough.
+ *
+ * @param h      IN   |HANDLE| of the directory
+ * @param p      IN   Path to directory
+ * @param di     OUT  Directory information to be populated
+ * @param dstat  IN   stat() information of the directory
+ * @param sticky IN   FI_INSTICKY, if the directory is sticky and not ours
+ * @return 1 if lazy, 0 if the caller should read the directory
+ *
+ */
+
+static int
+takedir_lazy(HANDLE *h, const char *p, DIRINFO *di, const struct stat *dstat, int sticky)
+{
+    size_t est;
+
+    if (!dir_lazy_candidate(dstat)) {
+        return (0);
+    }
+    if (handle_fd(h) < 0) {
+        return (0);
+    }
+
+    di->di_flags |= DI_LAZY | (sticky ? DI_INSTICKY : 0);
+    di->di_path = mydup((char *)p);
+    di->di_h = h;
+    di->di_nprobes = 0;
+    est = dir_estimate(dstat) / DI_SCAN_PER_PROBE;
+    di->di_budget = est > UINT_MAX ? UINT_MAX : (unsigned int)est;
+    di->di_memosize = DI_MEMO_INITSIZE;
+    di->di_memo = (FILEINFO **) hashtab_new(di->di_memosize);
+    di->di_nmemo = 0;
+    ++dcstats.l_dirs;
+    return (1);
+}
+
+/**
+ * @brief Double the size of the memo table of a lazy |DIRINFO|.
+ *
+ */
+
+static void
+memo_grow(DIRINFO *di)
+{
+    FILEINFO **old_memo;
+    unsigned int old_size;
+    unsigned int i;
+    size_t mask, slot;
+
+    old_memo = di->di_memo;
+    old_size = di->di_memosize;
+    di->di_memosize *= 2;
+    di->di_memo = (FILEINFO **) hashtab_new(di->di_memosize);
+    mask = di->di_memosize - 1;
+    for (i = 0; i < old_size; ++i) {
+        if (old_memo[i] == NULL) {
+            continue;
+        }
+        slot = hash_name(old_memo[i]->fi_name) & mask;
+        while (di->di_memo[slot] != NULL) {
+            slot = (slot + 1) & mask;
+        }
+        di->di_memo[slot] = old_memo[i];
+    }
+    free(old_memo);
+    dir_account(di);
+}
+
+/**
+ * @brief Read a lazy directory in full; leave lazy mode.
+ *
+ * @param di  INOUT  Directory information
+ *
+ * Every |FILEINFO| already handed out by fprobe() replaces its
+ * counterpart in the new sorted array.  Negative memo entries are
+ * freed.  The rest stay in |di_memo|, now just a list, so that
+ * dir_evict() can free them.
+ *
+ */
+
+static void
+dir_unlazy(DIRINFO *di)
+{
+    FILEINFO *f, **pf;
+    unsigned int i, n;
+    int sticky;
+    int fd;
+
+    sticky = (di->di_flags & DI_INSTICKY) ? FI_INSTICKY : 0;
+    if ((fd = dirbuf_open(di->di_path)) < 0 || takedir_fd(fd, di, sticky)) {
+        eprintf("Strange, can't scan %s.\n", di->di_path);
+        // XXX use libexplain
+        quit();
+    }
+
+    n = 0;
+    for (i = 0; i < di->di_memosize; ++i) {
+        f = di->di_memo[i];
+        di->di_memo[i] = NULL;
+        if (f == NULL) {
+            continue;
+        }
+        if (f->fi_stflags & FI_NOENT) {
+            free(f);
+            continue;
+        }
+        pf = (FILEINFO **) bsearch(&f, di->di_fils, di->di_nfils, sizeof (FILEINFO *), fcmp);
+        if (pf != NULL) {
+            *pf = f;
+        }
+        di->di_memo[n++] = f;
+    }
+
+    di->di_nmemo = n;
+    di->di_h = NULL;
+    di->di_flags &= ~(DI_LAZY | DI_INSTICKY);
+    ++dcstats.l_scans;
+    dir_account(di);
+}
+
+/**
+ * @brief Look up one name in a lazy directory.
+ *
+ * @param s   IN     simple filename
+ * @param di  INOUT  lazy directory
+ * @return The FILEINFO of the found filename, or NULL if not found.
+ *
+ * The answer comes from |di_memo|, if the name was looked up before.
+ * Otherwise, fstatat() is asked, unless the probe budget is used up,
+ * in which case the directory is read in full.
+ *
+ */
+
+static FILEINFO *
+fprobe(const char *s, DIRINFO *di)
+{
+    struct stat fstat;
+    FILEINFO *f;
+    size_t mask, slot, len;
+    unsigned int flags;
+    int fd;
+
+    mask = di->di_memosize - 1;
+    slot = hash_name(s) & mask;
+    while ((f = di->di_memo[slot]) != NULL) {
+        if (strcmp(f->fi_name, s) == 0) {
+            ++dcstats.l_memohits;
+            return ((f->fi_stflags & FI_NOENT) ? NULL : f);
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    // A name with a slash in it is not an entry of this directory.
+    if (*s == '\0' || strchr(s, SLASH) != NULL) {
+        return (NULL);
+    }
+
+    if (++di->di_nprobes > di->di_budget) {
+        dir_unlazy(di);
+        return (fsearch(s, di));
+    }
+
+    fd = handle_fd(di->di_h);
+    if (fd < 0) {
+        dir_unlazy(di);
+        return (fsearch(s, di));
+    }
+
+    ++dcstats.l_probes;
+    if (fstatat(fd, s, &fstat, AT_SYMLINK_NOFOLLOW)) {
+        if (errno != ENOENT) {
+            // Do not take "permission denied", say, for "not there".
+            dir_unlazy(di);
+            return (fsearch(s, di));
+        }
+        flags = FI_NOENT;
+    }
+    else {
+        flags = (di->di_flags & DI_INSTICKY) ? FI_INSTICKY : 0;
+        // Like d_type: the type of a symbolic link is left unknown.
+        if (S_ISDIR(fstat.st_mode)) {
+            flags |= FI_TYPEKNOWN | FI_ISDIR;
+        }
+        else if (!S_ISLNK(fstat.st_mode)) {
+            flags |= FI_TYPEKNOWN;
+        }
+        if (!S_ISLNK(fstat.st_mode)) {
+            flags |= perm_fi_flags(fstat.st_dev, fstat.st_mode, fstat.st_uid, 0);
+        }
+    }
+
+    // One block, with its name, so that memo_free() can free it.
+    len = strlen(s);
+    f = (FILEINFO *) mmv_alloc(sizeof (FILEINFO) + len + 1);
+    f->fi_name = memcpy(f + 1, s, len + 1);
+    f->fi_len = len;
+    f->fi_mode = 0;
+    f->fi_stflags = flags;
+    f->fi_rep = NULL;
+    di->di_memo[slot] = f;
+    if (++di->di_nmemo * 2 > di->di_memosize) {
+        memo_grow(di);
+    }
+    return ((flags & FI_NOENT) ? NULL : f);
+}
+
+/*
+ * Hash index for exact-name lookups.
+ *
+ * The sorted array, |di_fils|, is still needed for prefix scans
+ * by ffirst(), but a binary search over a big directory costs about
+ * 20 string comparisons, each likely to be a cache miss.
+ * So, the first time fsearch() is called on a directory with at least
+ * DI_INDEX_MIN entries, an open-addressing table, |di_index|, is built.
+ * Each slot holds the position of a |FILEINFO| in |di_fils| and
+ * a tag made from the rest of the hash, so that strcmp() is called,
+ * almost always, only on the name that actually matches.
+ */
+
+#define DI_INDEX_MIN 16
+
+#define HASH_TAG(h) ((unsigned int)((h) >> (sizeof (size_t) * 4)))
+
+/**
+ * @brief Build the hash index of a |DIRINFO|.
+ *
+ * @param d  INOUT  directory, not lazy
+ *
+ */
+
+static void
+findex_build(DIRINFO *d)
+{
+    struct dirindex_slot *ix;
+    unsigned int size, i;
+    size_t h, mask, slot;
+
+    for (size = HTAB_INITSIZE; size < 2 * d->di_nfils; size *= 2) {
+        continue;
+    }
+    ix = (struct dirindex_slot *) mmv_alloc(size * sizeof (struct dirindex_slot));
+    memset(ix, 0, size * sizeof (struct dirindex_slot));
+    mask = size - 1;
+    for (i = 0; i < d->di_nfils; ++i) {
+        h = hash_name(d->di_fils[i]->fi_name);
+        slot = h & mask;
+        while (ix[slot].ix_pos != 0) {
+            slot = (slot + 1) & mask;
+        }
+        ix[slot].ix_tag = HASH_TAG(h);
+        ix[slot].ix_pos = i + 1;
+    }
+    d->di_index = ix;
+    d->di_indexsize = size;
+    ++dcstats.i_builds;
+    dir_account(d);
+}
+
+/**
+ * @brief Look up a simple filename using the hash index.
  *
  */
+
 static FILEINFO *
-fsearch(const char *s, DIRINFO const *d)
+fsearch_index(const char *s, DIRINFO const *d)
 {
-    FILEINFO **fils = d->di_fils;
-    int nfils = d->di_nfils;
-    int first, k, last, res;
-
-    for (first = 0, last = nfils - 1; ; ) {
-        if (last < first) {
-            return (NULL);
-        }
-        k = (first + last) >> 1;
-        if ((res = strcmp(s, fils[k]->fi_name)) == 0) {
-            return (fils[k]);
-        }
-        if (res < 0) {
-            last = k - 1;
+    struct dirindex_slot *ix = d->di_index;
+    size_t h, mask, slot;
+    unsigned int tag;
+    FILEINFO *f;
+
+    h = hash_name(s);
+    tag = HASH_TAG(h);
+    mask = d->di_indexsize - 1;
+    for (slot = h & mask; ix[slot].ix_pos != 0; slot = (slot + 1) & mask) {
+        if (ix[slot].ix_tag != tag) {
+            continue;
         }
-        else {
-            first = k + 1;
+        f = d->di_fils[ix[slot].ix_pos - 1];
+        if (strcmp(f->fi_name, s) == 0) {
+            return (f);
         }
     }
+    return (NULL);
 }
 
 /**
- * @brief  Compare two |FILEINFO| structures by filename.
- *
- * @param  vp1  IN  comparand
- * @param  vp2  IN  comparand
- * @return (-,0,+) comparison result (a la strcmp())
+ * @brief Search for a given simple filename in a directory.
  *
- * This is a callback function used by qsort().
- * qsort() takes void pointers.  We use pointers to |FILEINFO| structures.
+ * @param s  IN  filename to find
+ * @param d  IN  directory of |FILEINFO|
+ * @return The FILEINFO of the found filename, or NULL if not found.
  *
  */
 
-static int
-fcmp(const void *vp1, const void *vp2)
+FILEINFO *
+fsearch(const char *s, DIRINFO *d)
 {
-    const FILEINFO * const *pf1 = (const FILEINFO * const *)vp1;
-    const FILEINFO * const *pf2 = (const FILEINFO * const *)vp2;
-    return (strcmp((*pf1)->fi_name, (*pf2)->fi_name));
+    if (d->di_flags & DI_LAZY) {
+        return (fprobe(s, d));
+    }
+    if (d->di_nfils < DI_INDEX_MIN || (d->di_flags & DI_EXTERNAL)) {
+        return (fsearch_sorted(s, d));
+    }
+    if (d->di_index == NULL) {
+        findex_build(d);
+    }
+    ++dcstats.i_lookups;
+    return (fsearch_index(s, d));
 }
 
 /**
- * @brief Snarf info on all files in a directory.
- *
- * @param p       IN   Path to directory
- * @param di      OUT  Directory information to be populated
- * @param sticky  IN   ???
- *
- * After the directory is scanned, entries in the array, |di|
- * is dorted by simple filename.
+ * @brief Make room in |hbypath| for path id |id|.
  *
  */
 
 static void
-takedir(const char *p, DIRINFO *di, int sticky)
+hbypath_grow(uint32_t id)
 {
-    int cnt, room;
-    DIRENTRY *dp;
-    FILEINFO *f, **fils;
-    DIR *dirp;
+    HANDLE **newtab;
+    size_t newsize;
 
-    if ((dirp = opendir(p)) == NULL) {
-        eprintf("Strange, can't scan %s.\n", p);
-        // XXX use libexplain
-        quit();
-    }
-    room = INITROOM;
-    di->di_fils = fils = (FILEINFO **) mmv_alloc(room * sizeof (FILEINFO *));
-    cnt = 0;
-    while ((dp = readdir(dirp)) != NULL) {
-        if (cnt == room) {
-            room *= 2;
-            fils = (FILEINFO **) mmv_alloc(room * sizeof (FILEINFO *));
-            memcpy(fils, di->di_fils, cnt * sizeof (FILEINFO *));
-            chgive(di->di_fils, cnt * sizeof (FILEINFO *));
-            di->di_fils = fils;
-            fils = di->di_fils + cnt;
-        }
-        *fils = f = (FILEINFO *) challoc(sizeof (FILEINFO), 1);
-        f->fi_name = mydup(dp->d_name);
-        f->fi_stflags = sticky;
-        f->fi_rep = NULL;
-        ++cnt;
-        ++fils;
+    for (newsize = hbypath_size; newsize <= id; newsize *= 2) {
+        continue;
     }
-    closedir(dirp);
-    qsort(di->di_fils, cnt, sizeof (FILEINFO *), fcmp);
-    di->di_nfils = cnt;
+    newtab = (HANDLE **) hashtab_new(newsize);
+    memcpy(newtab, hbypath, hbypath_size * sizeof (HANDLE *));
+    chgive(hbypath, hbypath_size * sizeof (HANDLE *));
+    hbypath = newtab;
+    hbypath_size = newsize;
 }
 
 /**
- * @brief Add a new handle to |handles| array.
+ * @brief Add a new handle to |handles| array and to |hbypath|.
  *
- * @param new_name  IN  New filename to be added
+ * @param path  IN  Interned path of the new handle's directory
  * @return pointer to new, initialized handle
  *
  * Allocation failure is not an option.
@@ -425,7 +1472,7 @@ takedir(const char *p, DIRINFO *di, int sticky)
  */
 
 static HANDLE *
-hadd(const char *new_name)
+hadd(uint32_t path)
 {
     HANDLE **newhandles, *h;
 
@@ -437,9 +1484,16 @@ hadd(const char *new_name)
         handles = newhandles;
     }
     handles[nhandles++] = h = (HANDLE *) challoc(sizeof (HANDLE), 1);
-    h->h_name = (char *)challoc(strlen(new_name) + 1, 0);
-    strcpy(h->h_name, new_name);
+    h->h_path = path;
     h->h_di = NULL;
+    h->h_fd = -1;
+    h->h_lru_prev = NULL;
+    h->h_lru_next = NULL;
+
+    if (path >= hbypath_size) {
+        hbypath_grow(path);
+    }
+    hbypath[path] = h;
     return (h);
 }
 
@@ -447,34 +1501,68 @@ hadd(const char *new_name)
  * @brief Search |handles| by name.
  *
  * @param s_name  IN   name of handle to search for
- * @param which   IN   >>>
- * @param pret    OUT  >>>
+ * @param which   IN   which |lasthandle[]| front cache to use
+ * @param pret    OUT  the handle found, or a newly added handle
+ * @return 1 if found, 0 if a new handle was added
+ *
+ * The name is interned first; after that, everything
+ * is a comparison of path ids.
  *
  */
 static int
 hsearch(const char *s_name, int which, HANDLE **pret)
 {
-    size_t i;
-    HANDLE **ph;
+    uint32_t path;
+    HANDLE *h;
 
     assert(which == 0 || which == 1);
 
-    if (strcmp(s_name, lasthandle[which]->h_name) == 0) {
+    ++dcstats.h_lookups;
+    path = path_intern(s_name);
+    if (path == lasthandle[which]->h_path) {
+        ++dcstats.h_lasthits;
         *pret = lasthandle[which];
         return (1);
     }
 
-    for (i = 0, ph = handles; i < nhandles; ++ph, ++i)
-        if (strcmp(s_name, (*ph)->h_name) == 0) {
-            lasthandle[which] = *pret = *ph;
-            return (1);
-        }
+    if (path < hbypath_size && (h = hbypath[path]) != NULL) {
+        ++dcstats.h_hits;
+        lasthandle[which] = *pret = h;
+        return (1);
+    }
 
-    lasthandle[which] = *pret = hadd(s_name);
+    ++dcstats.h_misses;
+    lasthandle[which] = *pret = hadd(path);
     return (0);
 }
 
 
+/**
+ * @brief Double the size of |dtab| and re-insert all |DIRINFO|s.
+ *
+ */
+
+static void
+dtab_grow(void)
+{
+    size_t i, mask;
+    DIRINFO **pd;
+
+    chgive(dtab, dtab_size * sizeof (DIRINFO *));
+    dtab_size *= 2;
+    dtab = (DIRINFO **) hashtab_new(dtab_size);
+    mask = dtab_size - 1;
+    for (i = 0, pd = dirs; i < ndirs; ++pd, ++i) {
+        size_t slot;
+
+        slot = hash_dirid((*pd)->di_vid, (*pd)->di_did) & mask;
+        while (dtab[slot] != NULL) {
+            slot = (slot + 1) & mask;
+        }
+        dtab[slot] = *pd;
+    }
+}
+
 /**
  * @brief Add a |DIRINFO| to |dirs| array; allocate more space if needed.
  *
@@ -482,6 +1570,7 @@ hsearch(const char *s_name, int which, HANDLE **pret)
  * @param d   IN  dirid
  * @return  pointer to new, initialized |DIRINFO|.
  *
+ * The new |DIRINFO| is also entered into |dtab|.
  * Allocation failure is not an option.
  *
  */
@@ -491,6 +1580,7 @@ dadd(DEVID v, DIRID d)
 {
     DIRINFO *di;
     DIRINFO **newdirs;
+    size_t mask, slot;
 
     if (ndirs == dirroom) {
         dirroom *= 2;
@@ -503,8 +1593,36 @@ dadd(DEVID v, DIRID d)
     di->di_vid = v;
     di->di_did = d;
     di->di_nfils = 0;
+    di->di_nuntyped = 0;
     di->di_fils = NULL;
     di->di_flags = 0;
+    di->di_index = NULL;
+    di->di_indexsize = 0;
+    di->di_eytz = NULL;
+    di->di_eytzpos = NULL;
+    di->di_sfx = NULL;
+    di->di_sfxuses = 0;
+    di->di_path = NULL;
+    di->di_h = NULL;
+    di->di_memo = NULL;
+    di->di_memosize = 0;
+    di->di_nmemo = 0;
+    di->di_recs = NULL;
+    di->di_pool = NULL;
+    di->di_poolsize = 0;
+    di->di_bytes = 0;
+    di->di_refs = 0;
+    di->di_lru_prev = NULL;
+    di->di_lru_next = NULL;
+
+    mask = dtab_size - 1;
+    for (slot = hash_dirid(v, d) & mask; dtab[slot] != NULL; slot = (slot + 1) & mask) {
+        continue;
+    }
+    dtab[slot] = di;
+    if (ndirs * 2 > dtab_size) {
+        dtab_grow();
+    }
     return (di);
 }
 
@@ -521,17 +1639,44 @@ dadd(DEVID v, DIRID d)
 static DIRINFO *
 dsearch(DEVID v, DIRID d)
 {
-    size_t i;
+    size_t mask, slot;
     DIRINFO *di;
 
-    for (i = 0, di = *dirs; i < ndirs; ++di, ++i) {
+    ++dcstats.d_lookups;
+    mask = dtab_size - 1;
+    for (slot = hash_dirid(v, d) & mask; (di = dtab[slot]) != NULL; slot = (slot + 1) & mask) {
+        ++dcstats.d_probes;
         if (v == di->di_vid && d == di->di_did) {
+            ++dcstats.d_hits;
             return (di);
         }
     }
+    ++dcstats.d_misses;
     return (NULL);
 }
 
+/**
+ * @brief Read a directory, or get it from a snapshot, or start it lazy.
+ *
+ * @param h       IN   |HANDLE| of the directory
+ * @param p       IN   Path to directory
+ * @param di      OUT  Directory information to be populated
+ * @param dstat   IN   stat() information of the directory
+ * @param sticky  IN   FI_INSTICKY, if the directory is sticky and not ours
+ * @param which   IN   0 if wildcards will be matched against the listing
+ *
+ */
+
+static void
+dir_load(HANDLE *h, const char *p, DIRINFO *di, const struct stat *dstat, int sticky, int which)
+{
+    if (!snapcache_load(di, dstat, sticky)
+        && (which == 0 || !takedir_lazy(h, p, di, dstat, sticky))) {
+        takedir(p, di, dstat, sticky);
+    }
+    dir_account(di);
+}
+
 /**
  * @brief checkdir
  *
@@ -550,8 +1695,11 @@ checkdir(const char *p, char *pathend, int which)
     DEVID v;
     DIRINFO *di;
     const char *myp;
+    const char *name;
     char *lastslash;
+    unsigned int pattr;
     int sticky;
+    int dfd;
     HANDLE *h;
 
     lastslash = NULL;
@@ -560,9 +1708,14 @@ checkdir(const char *p, char *pathend, int which)
             direrr = h->h_err;
             return (NULL);
         }
-        else {
+        else if (!(h->h_di->di_flags & DI_EVICTED)) {
+            if (which == 0 && (h->h_di->di_flags & DI_LAZY)) {
+                dir_unlazy(h->h_di);
+            }
+            dir_touch(h->h_di);
             return (h);
         }
+        // Evicted; look at the directory again, as if for the first time.
     }
 
     if (*p == '\0') {
@@ -577,10 +1730,12 @@ checkdir(const char *p, char *pathend, int which)
         myp = p;
     }
 
-    if (stat(myp, &dstat) || !S_ISDIR(dstat.st_mode)) {
+    // The path of a directory deep in a ';' walk can be longer than PATH_MAX.
+    dfd = long_path_at(myp, &name);
+    if (dfd == -1 || stat_perm(dfd, name, &dstat, &pattr) || !S_ISDIR(dstat.st_mode)) {
         direrr = h->h_err = H_NODIR;
     }
-    else if (access(myp, R_OK | X_OK)) {
+    else if (perm_fs_note(dstat.st_dev, myp), !perm_granted(dstat.st_dev, dstat.st_mode, dstat.st_uid, 0, R_OK | X_OK) && faccessat(dfd, name, R_OK | X_OK, 0)) {
         direrr = h->h_err = H_NOREADDIR;
     }
     else {
@@ -590,14 +1745,30 @@ checkdir(const char *p, char *pathend, int which)
         d = dstat.st_ino;
 
         if ((di = dsearch(v, d)) == NULL) {
-            takedir(myp, di = dadd(v, d), sticky);
+            di = dadd(v, d);
+            dir_load(h, myp, di, &dstat, sticky, which);
         }
+        else if (di->di_flags & DI_EVICTED) {
+            di->di_flags = 0;
+            ++dcstats.e_reloads;
+            dir_load(h, myp, di, &dstat, sticky, which);
+        }
+        else if (which == 0 && (di->di_flags & DI_LAZY)) {
+            dir_unlazy(di);
+        }
+        di->di_mode = dstat.st_mode;
+        di->di_uid = dstat.st_uid;
+        di->di_pattr = pattr;
+        dir_touch(di);
+        dircache_trim(di);
     }
+    long_path_done(dfd);
 
     if (lastslash != NULL) {
         *lastslash = SLASH;
     }
     if (direrr != 0) {
+        h->h_di = NULL;
         return (NULL);
     }
     h->h_di = di;
@@ -620,9 +1791,9 @@ checkdir(const char *p, char *pathend, int which)
  */
 
 static int
-checkto(mmv_t *mmv, HANDLE *hfrom, char *f, HANDLE **phto, char **pnto, FILEINFO **pfdel)
+checkto(mmv_t *mmv, HANDLE *hfrom, char *f, HANDLE **phto, uint32_t *pnto, FILEINFO **pfdel)
 {
-    char tpath[PATH_MAX + 1];
+    char tpath[MMV_PATH_MAX + 1];
     char *pathend;
     FILEINFO *fdel;
     int hlen, tlen;
@@ -630,17 +1801,14 @@ checkto(mmv_t *mmv, HANDLE *hfrom, char *f, HANDLE **phto, char **pnto, FILEINFO
     fdel = NULL;  // XXX Compare to original mmv code.
     if (mmv->op & DIRMOVE) {
         *phto = hfrom;
-        hlen = strlen(hfrom->h_name);
+        hlen = path_len(hfrom->h_path);
         pathend = mmv->fullrep + hlen;
         memmove(pathend, mmv->fullrep, strlen(mmv->fullrep) + 1);
-        memmove(mmv->fullrep, hfrom->h_name, hlen);
+        path_copy(hfrom->h_path, mmv->fullrep);
         if ((fdel = *pfdel = fsearch(pathend, hfrom->h_di)) != NULL) {
-            *pnto = fdel->fi_name;
-            getstat(mmv->fullrep, fdel);
-        }
-        else {
-            *pnto = mydup(pathend);
+            gettype(mmv->fullrep, fdel);
         }
+        *pnto = str_intern(pathend, strlen(pathend));
     }
     else {
         pathend = getpath(mmv, tpath);
@@ -649,7 +1817,7 @@ checkto(mmv_t *mmv, HANDLE *hfrom, char *f, HANDLE **phto, char **pnto, FILEINFO
         if (*phto != NULL &&
             *pathend != '\0' &&
             (fdel = *pfdel = fsearch(pathend, (*phto)->h_di)) != NULL &&
-            (getstat(mmv->fullrep, fdel), fdel->fi_stflags & FI_ISDIR)) {
+            (gettype(mmv->fullrep, fdel), fdel->fi_stflags & FI_ISDIR)) {
             tlen = strlen(pathend);
             strcpy(pathend + tlen, SLASHSTR);
             ++tlen;
@@ -660,8 +1828,8 @@ checkto(mmv_t *mmv, HANDLE *hfrom, char *f, HANDLE **phto, char **pnto, FILEINFO
         }
 
         if (*pathend == '\0') {
-            *pnto = f;
-            if (pathend - mmv->fullrep + strlen(f) >= PATH_MAX) {
+            *pnto = str_intern(f, strlen(f));
+            if (pathend - mmv->fullrep + strlen(f) >= MMV_PATH_MAX) {
                 strcpy(mmv->fullrep, TOOLONG);
                 return (-1);
             }
@@ -669,15 +1837,12 @@ checkto(mmv_t *mmv, HANDLE *hfrom, char *f, HANDLE **phto, char **pnto, FILEINFO
             if (*phto != NULL) {
                 fdel = *pfdel = fsearch(f, (*phto)->h_di);
                 if (fdel != NULL) {
-                    getstat(mmv->fullrep, fdel);
+                    gettype(mmv->fullrep, fdel);
                 }
             }
         }
-        else if (fdel != NULL) {
-            *pnto = fdel->fi_name;
-        }
         else {
-            *pnto = mydup(pathend);
+            *pnto = str_intern(pathend, strlen(pathend));
         }
     }
 
@@ -705,47 +1870,79 @@ badname(const char *s)
  * @param h  IN  Directory |HANDLE| in question
  * @return 0/1 status
  *
+ * Usually, the mode, owner and attributes that checkdir() got
+ * are enough to tell.  Otherwise, the kernel is asked,
+ * relative to the descriptor of the directory.
+ *
  */
 
 unsigned int
 dwritable(HANDLE *h)
 {
-    char *p;
-    char *myp;
-    char *lastslash;
-    char *pathend;
+    char p[MMV_PATH_MAX + 1];
+    const char *myp;
+    size_t len;
     unsigned int r;
-    unsigned int *pw = &(h->h_di->di_flags);
-
-    p = h->h_name;
-    lastslash = NULL;
-    if (uid == 0) {
-        return (1);
-    }
+    DIRINFO *di = h->h_di;
+    unsigned int *pw = &(di->di_flags);
+    int dfd;
 
     if (*pw & DI_KNOWWRITE) {
         return (*pw & DI_CANWRITE);
     }
 
-    pathend = p + strlen(p);
-    if (*p == '\0') {
-        myp = dir_self;
+    if (perm_granted(di->di_vid, di->di_mode, di->di_uid, di->di_pattr, W_OK)) {
+        r = DI_CANWRITE;
     }
-    else if (pathend == p + 1) {
-        myp = SLASHSTR;
+    else if ((dfd = handle_fd(h)) >= 0) {
+        r = !faccessat(dfd, dir_self, W_OK, 0) ? DI_CANWRITE : 0;
     }
     else {
-        lastslash = pathend - 1;
-        *lastslash = '\0';
-        myp = p;
+        len = path_len(h->h_path);
+        if (len == 0) {
+            myp = dir_self;
+        }
+        else if (len == 1) {
+            myp = SLASHSTR;
+        }
+        else {
+            path_copy(h->h_path, p);
+            p[len - 1] = '\0';
+            myp = p;
+        }
+        r = !faccessat(AT_FDCWD, myp, W_OK, 0) ? DI_CANWRITE : 0;
     }
-    r = !access(myp, W_OK) ? DI_CANWRITE : 0;
     *pw |= DI_KNOWWRITE | r;
+    return (r);
+}
 
-    if (lastslash != NULL) {
-        *lastslash = SLASH;
+/**
+ * @brief Determine if a file is readable; keep a record of it.
+ *
+ * @param mmv
+ * @param h  IN  |HANDLE| of the directory that |f| is in
+ * @param f  IN  the file; its full path is in mmv->pathbuf
+ * @return true if it can be read
+ *
+ * If the file was stat()ed, the answer may already be known,
+ * from perm_fi_flags().
+ *
+ */
+
+static bool
+freadable(mmv_t *mmv, HANDLE *h, FILEINFO *f)
+{
+    const char *name;
+    unsigned int r;
+    int dfd;
+
+    if (f->fi_stflags & FI_KNOWREAD) {
+        return ((f->fi_stflags & FI_CANREAD) != 0);
     }
-    return (r);
+    dfd = handle_at(h, f->fi_name, mmv->pathbuf, &name);
+    r = !faccessat(dfd, name, R_OK, 0) ? FI_CANREAD : 0;
+    f->fi_stflags |= FI_KNOWREAD | r;
+    return (r != 0);
 }
 
 /**
@@ -762,7 +1959,7 @@ dwritable(HANDLE *h)
  */
 
 int
-badrep(mmv_t *mmv, HANDLE *hfrom, FILEINFO *ffrom, HANDLE **phto, char **pnto, FILEINFO **pfdel, int *pflags)
+badrep(mmv_t *mmv, HANDLE *hfrom, FILEINFO *ffrom, HANDLE **phto, uint32_t *pnto, FILEINFO **pfdel, int *pflags)
 {
     char *f = ffrom->fi_name;
 
@@ -771,7 +1968,7 @@ badrep(mmv_t *mmv, HANDLE *hfrom, FILEINFO *ffrom, HANDLE **phto, char **pnto, F
         printf("%s -> %s : source file is a directory.\n",
             mmv->pathbuf, mmv->fullrep);
     }
-    else if ((mmv->op & (COPY | APPEND)) && access(mmv->pathbuf, R_OK)) {
+    else if ((mmv->op & (COPY | APPEND)) && !freadable(mmv, hfrom, ffrom)) {
         printf("%s -> %s : no read permission for source file.\n",
             mmv->pathbuf, mmv->fullrep);
     }
@@ -779,7 +1976,7 @@ badrep(mmv_t *mmv, HANDLE *hfrom, FILEINFO *ffrom, HANDLE **phto, char **pnto, F
         printf("%s -> %s : . and .. can't be renamed.\n",
             mmv->pathbuf, mmv->fullrep);
     }
-    else if (repbad || checkto(mmv, hfrom, f, phto, pnto, pfdel) || badname(*pnto)) {
+    else if (repbad || checkto(mmv, hfrom, f, phto, pnto, pfdel) || badname(str_name(*pnto))) {
         printf("%s -> %s : bad new name.\n",
             mmv->pathbuf, mmv->fullrep);
     }
@@ -799,7 +1996,7 @@ badrep(mmv_t *mmv, HANDLE *hfrom, FILEINFO *ffrom, HANDLE **phto, char **pnto, F
         printf("%s -> %s : cross-device move.\n",
             mmv->pathbuf, mmv->fullrep);
     }
-    else if (*pflags && (mmv->op & MOVE) && !(ffrom->fi_stflags & FI_ISLNK) && access(mmv->pathbuf, R_OK)) {
+    else if (*pflags && (mmv->op & MOVE) && !(ffrom->fi_stflags & FI_ISLNK) && !freadable(mmv, hfrom, ffrom)) {
         printf("%s -> %s : no read permission for source file.\n",
             mmv->pathbuf, mmv->fullrep);
     }
@@ -810,34 +2007,342 @@ badrep(mmv_t *mmv, HANDLE *hfrom, FILEINFO *ffrom, HANDLE **phto, char **pnto, F
     return (-1);
 }
 
+/*
+ * Eytzinger layout for prefix range scans.
+ *
+ * A binary search over |di_fils| dereferences a |FILEINFO| pointer,
+ * and then its name, at every step: two dependent cache misses.
+ * So, the first time ffirst() is called on a directory with at least
+ * DI_EYTZ_MIN entries, the first 8 bytes of every name, as a namekey
+ * (see mmv-fsort.c), are laid out in one array, |di_eytz|, in
+ * breadth-first order of the implicit search tree.  The top levels
+ * of the tree share a few cache lines, and each step down goes to
+ * a predictable place, which is prefetched a few levels ahead.
+ * Names are looked at only when the literal prefix is longer than
+ * 8 bytes, and then only among names whose keys tie.
+ *
+ * ffirst() returns the whole range of names that have the prefix,
+ * so the walk over them needs no comparisons at all.
+ *
+ * Directories in external memory do not get one, because it would be
+ * another array the size of the directory, in memory.
+ */
+
+#define DI_EYTZ_MIN 64
+
+/**
+ * @brief Build the Eytzinger layout of a |DIRINFO|.
+ *
+ * @param d  INOUT  directory, sorted
+ *
+ * The slots are filled by an in-order walk of the implicit tree,
+ * which visits them in sorted order.
+ *
+ */
+
+static void
+eytz_build(DIRINFO *d)
+{
+    uint64_t *keys;
+    unsigned int *pos;
+    size_t n, i, k;
+
+    n = d->di_nfils;
+    keys = (uint64_t *) mmv_alloc((n + 1) * sizeof (uint64_t));
+    pos = (unsigned int *) mmv_alloc((n + 1) * sizeof (unsigned int));
+    keys[0] = 0;
+    pos[0] = 0;
+    for (k = 1; 2 * k <= n; k *= 2) {
+        continue;
+    }
+    for (i = 0; i < n; ++i) {
+        keys[k] = namekey_prefix(d->di_fils[i]->fi_name, 8);
+        pos[k] = i;
+        if (2 * k + 1 <= n) {
+            // Leftmost slot of the right subtree
+            for (k = 2 * k + 1; 2 * k <= n; k *= 2) {
+                continue;
+            }
+        }
+        else {
+            // Up, past all ancestors of which this is in the right subtree
+            while (k & 1) {
+                k >>= 1;
+            }
+            k >>= 1;
+        }
+    }
+    d->di_eytz = keys;
+    d->di_eytzpos = pos;
+    dir_account(d);
+}
+
+/**
+ * @brief Find the first name whose key is at least |x|.
+ *
+ * @return index into |di_fils|, or |di_nfils| if there is none
+ *
+ */
+
+static unsigned int
+eytz_lower(const DIRINFO *d, uint64_t x)
+{
+    const uint64_t *e = d->di_eytz;
+    size_t n = d->di_nfils;
+    size_t k;
+
+    for (k = 1; k <= n; k = 2 * k + (e[k] < x)) {
+        __builtin_prefetch(e + 8 * k);
+    }
+    // Undo the right turns after the last left turn, and that left turn.
+    k >>= __builtin_ffsl(~(long)k);
+    return (k == 0 ? n : d->di_eytzpos[k]);
+}
+
+/**
+ * @brief Find the first name, in |fils[lo .. hi)|, whose first |n| bytes
+ * compare greater than (|upper|), or not less than (!|upper|), |s|.
+ *
+ */
+
+static unsigned int
+fils_bound(const char *s, int n, FILEINFO **fils, unsigned int lo, unsigned int hi, bool upper)
+{
+    unsigned int mid;
+    int res;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        res = strncmp(fils[mid]->fi_name, s, n);
+        if (res < 0 || (upper && res == 0)) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return (lo);
+}
+
 /**
- * @brief ???
+ * @brief Find all names in a directory that start with a given literal.
+ *
+ * @param s     IN   literal prefix
+ * @param n     IN   length of the prefix
+ * @param d     IN   directory
+ * @param pend  OUT  index just past the last name with the prefix
+ * @return index of the first name with the prefix, or |di_nfils| if none
+ *
+ * If |n| is 0, every name has the prefix.
  *
  */
 
 int
-ffirst(char *s, int n, DIRINFO *d)
+ffirst(char *s, int n, DIRINFO *d, int *pend)
 {
-    int first, k, last, res;
     FILEINFO **fils = d->di_fils;
-    int nfils = d->di_nfils;
+    unsigned int nfils = d->di_nfils;
+    unsigned int first, end;
+    uint64_t key, next;
 
     if (nfils == 0 || n == 0) {
+        *pend = nfils;
         return (0);
     }
-    first = 0;
-    last = nfils - 1;
-    for (;;) {
-        k = (first + last) >> 1;
-        res = strncmp(s, fils[k]->fi_name, n);
-        if (first == last) {
-            return (res == 0 ? k : nfils);
+
+    if (d->di_eytz == NULL && nfils >= DI_EYTZ_MIN && !(d->di_flags & DI_EXTERNAL)) {
+        eytz_build(d);
+    }
+
+    if (d->di_eytz == NULL) {
+        first = fils_bound(s, n, fils, 0, nfils, false);
+        end = fils_bound(s, n, fils, first, nfils, true);
+    }
+    else if (n <= 8) {
+        // Names with the prefix are the keys in [ key, next ).
+        key = namekey_prefix(s, n);
+        next = key + ((uint64_t)1 << (64 - 8 * n));
+        first = eytz_lower(d, key);
+        end = next == 0 ? nfils : eytz_lower(d, next);
+    }
+    else {
+        // Look at the rest of the names, only where the keys tie.
+        key = namekey_prefix(s, 8);
+        first = eytz_lower(d, key);
+        end = key + 1 == 0 ? nfils : eytz_lower(d, key + 1);
+        first = fils_bound(s, n, fils, first, end, false);
+        end = fils_bound(s, n, fils, first, end, true);
+    }
+
+    if (first == end) {
+        first = end = nfils;
+    }
+    *pend = end;
+    return (first);
+}
+
+/*
+ * Suffix index, for stages that start with a wildcard.
+ *
+ * ffirst() narrows the names to look at by the literal prefix of a
+ * stage, but a stage like *.log has none, so every name is tried.
+ * For such a stage, fsuffix() uses the literal that it ends with.
+ * |di_sfx| holds the indexes of |di_fils|, sorted as if each name
+ * were spelled backwards, so all names with a given suffix are
+ * in one range of it, found by binary search.
+ *
+ * A single pattern is faster off just trying every name once,
+ * so the index is built only the second time a directory is asked
+ * for, by another stage or another pattern line.  Directories smaller
+ * than DI_SFX_MIN, lazy directories and directories in external
+ * memory never get one.
+ */
+
+#define DI_SFX_MIN 64
+
+/**
+ * @brief Compare a name, spelled backwards, to the first |n| bytes
+ *        of a suffix, also spelled backwards.
+ *
+ * @return < 0, 0, > 0, as strncmp() would on the reversed strings
+ *
+ */
+
+static int
+rev_ncmp(const FILEINFO *f, const char *s, size_t n)
+{
+    const unsigned char *e1 = (const unsigned char *)f->fi_name + f->fi_len;
+    const unsigned char *e2 = (const unsigned char *)s + n;
+    size_t i;
+
+    for (i = 1; i <= n; ++i) {
+        if (i > f->fi_len) {
+            return (-1);
         }
-        else if (res > 0) {
-            first = k + 1;
+        if (e1[-i] != e2[-i]) {
+            return (e1[-i] < e2[-i] ? -1 : 1);
+        }
+    }
+    return (0);
+}
+
+struct sfx_ent {
+    FILEINFO *   se_f;
+    unsigned int se_pos;
+};
+
+static int
+sfx_cmp(const void *vp1, const void *vp2)
+{
+    const FILEINFO *f2 = ((const struct sfx_ent *)vp2)->se_f;
+    int rv;
+
+    rv = rev_ncmp(((const struct sfx_ent *)vp1)->se_f, f2->fi_name, f2->fi_len);
+    if (rv == 0) {
+        rv = ((const struct sfx_ent *)vp1)->se_f->fi_len > f2->fi_len;
+    }
+    return (rv);
+}
+
+static int
+pos_cmp(const void *vp1, const void *vp2)
+{
+    unsigned int p1 = *(const unsigned int *)vp1;
+    unsigned int p2 = *(const unsigned int *)vp2;
+
+    return (p1 < p2 ? -1 : p1 > p2);
+}
+
+/**
+ * @brief Build the suffix index of a |DIRINFO|.
+ *
+ */
+
+static void
+sfx_build(DIRINFO *d)
+{
+    struct sfx_ent *ents;
+    unsigned int i, n;
+
+    n = d->di_nfils;
+    ents = (struct sfx_ent *) mmv_alloc(n * sizeof (struct sfx_ent));
+    for (i = 0; i < n; ++i) {
+        ents[i].se_f = d->di_fils[i];
+        ents[i].se_pos = i;
+    }
+    qsort(ents, n, sizeof (struct sfx_ent), sfx_cmp);
+    d->di_sfx = (unsigned int *) mmv_alloc(n * sizeof (unsigned int));
+    for (i = 0; i < n; ++i) {
+        d->di_sfx[i] = ents[i].se_pos;
+    }
+    free(ents);
+    ++dcstats.s_builds;
+    dir_account(d);
+}
+
+/**
+ * @brief Find the first entry of |di_sfx|, at or after |lo|, whose name
+ *        ends in something not less than (or greater than, if |upper|)
+ *        the suffix.
+ *
+ */
+
+static unsigned int
+sfx_bound(const char *s, size_t n, const DIRINFO *d, unsigned int lo, bool upper)
+{
+    unsigned int hi, mid;
+    int res;
+
+    hi = d->di_nfils;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        res = rev_ncmp(d->di_fils[d->di_sfx[mid]], s, n);
+        if (res < 0 || (upper && res == 0)) {
+            lo = mid + 1;
         }
         else {
-            last = k;
+            hi = mid;
+        }
+    }
+    return (lo);
+}
+
+/**
+ * @brief Find all names in a directory that end with a given literal.
+ *
+ * @param s       IN   literal suffix
+ * @param n       IN   length of the suffix; not 0
+ * @param d       IN   directory
+ * @param pcount  OUT  number of names found
+ * @return indexes into |di_fils| of those names, in increasing order,
+ *         in an array that the caller must free(); or NULL if there
+ *         is no suffix index, and every name must be tried, as usual
+ *
+ */
+
+unsigned int *
+fsuffix(const char *s, size_t n, DIRINFO *d, size_t *pcount)
+{
+    unsigned int *pos;
+    unsigned int first, end;
+
+    if (d->di_sfx == NULL) {
+        if (d->di_nfils < DI_SFX_MIN || (d->di_flags & (DI_EXTERNAL | DI_LAZY))) {
+            return (NULL);
+        }
+        if (++d->di_sfxuses < 2) {
+            return (NULL);
         }
+        sfx_build(d);
     }
+
+    first = sfx_bound(s, n, d, 0, false);
+    end = sfx_bound(s, n, d, first, true);
+    pos = (unsigned int *) mmv_alloc((end - first + 1) * sizeof (unsigned int));
+    memcpy(pos, d->di_sfx + first, (end - first) * sizeof (unsigned int));
+    qsort(pos, end - first, sizeof (unsigned int), pos_cmp);
+    ++dcstats.s_lookups;
+    dcstats.s_names += end - first;
+    *pcount = end - first;
+    return (pos);
 }
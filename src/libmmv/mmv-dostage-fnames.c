@@ -62,12 +62,10 @@
 
 /*
  * Symbolic constants used to pass C-int-boolean flags
- * functions like to keepmatch() and dostage_fnames()
+ * functions like to keepmatch()
  */
 
-#define ANY_LEVEL   1
 #define WANT_DIRS   1
-#define WANT_FILES  1
 #define NEED_SLASH 1
 
 /*
@@ -88,8 +86,32 @@ extern size_t sys_homelen;
 
 extern int direrr;
 
-static char *stagel[20], *stager[20];
+/*
+ * Left and right ends of each stage of the 'from' filename.
+ * The vectors grow as needed; there is no limit on the number of stages.
+ */
+
+static char **stagel, **stager;
 static int nstages;
+static int stage_room;
+
+#define STAGE_INITROOM 8
+
+/**
+ * @brief Make sure that there is room for stage [idx].
+ *
+ */
+
+static void
+stage_grow(int idx)
+{
+    if (idx < stage_room) {
+        return;
+    }
+    stage_room = stage_room ? stage_room * 2 : STAGE_INITROOM;
+    stagel = (char **) mmv_realloc(stagel, stage_room * sizeof (char *));
+    stager = (char **) mmv_realloc(stager, stage_room * sizeof (char *));
+}
 
 /**
  * @brief Do match of a given string, up to the end of a simple filename.
@@ -181,6 +203,7 @@ parse_src_fname(mmv_t *mmv)
         case SLASH:
             lastname = p + 1;
             if (instage) {
+                stage_grow(nstages);
                 stager[nstages++] = p;
                 instage = 0;
             }
@@ -188,6 +211,7 @@ parse_src_fname(mmv_t *mmv)
         }
     }
 
+    stage_grow(nstages);
     if (instage) {
         stager[nstages++] = p;
     }
@@ -277,7 +301,7 @@ makerep_fnames(mmv_t *mmv)
     // XXX Use strncpy()-like function, instead of my own loop
     //
     for (pat = mmv->to, l = 0; (c = *pat) != '\0'; ++pat, ++l) {
-        if (l >= PATH_MAX) {
+        if (l >= MMV_PATH_MAX) {
             goto toolong;
         }
         *(p++) = c;
@@ -296,42 +320,50 @@ makerep_fnames(mmv_t *mmv)
 }
 
 /**
- * @brief  dostage_fnames ???
+ * @brief Find the file named by the 'from' filename; record its rename.
  *
  * @param mmv
- * @param lastend  ???  ???
- * @param pathend  ???  ???
- * @param stage    ???  ???
- * @param anylev   IN   ???
+ * @param lastend  IN  where matching picks up, in mmv->from
+ * @param pathend  IN  end of the directory so far, in mmv->pathbuf
+ * @param stage    IN  index of the first stage to match
+ * @return 0 if a rename was recorded, or else non-zero
+ *
+ * A filename has no wildcards, so each stage matches at most one
+ * name, and the stages are simply taken in turn, in a loop.
+ * There is no recursion, and no limit on the number of stages.
+ * A filename has no ';', either, so there is never any walk
+ * of subdirectories.
  *
  */
 
 int
-dostage_fnames(mmv_t *mmv, char *lastend, char *pathend, int stage, int anylev)
+dostage_fnames(mmv_t *mmv, char *lastend, char *pathend, int stage)
 {
     DIRINFO *di;
     HANDLE *h, *hto;
-    int prelen, litlen, nfils, i, k, flags, match_rv;
+    int prelen, litlen, i, end, k, flags, match_rv;
     FILEINFO **pf, *fdel;
-    char *nto;
+    uint32_t nto;
     REP *p;
     int ret;
     bool laststage;
-
-    if (dbgprint_fh) {
-        fprintf(dbgprint_fh, "%s:\n", __FUNCTION__);
-        fprintln_str(dbgprint_fh, "    lastend=", lastend);
-        fprintln_str(dbgprint_fh, "    pathend=", pathend);
-        fprintf(dbgprint_fh, "    stage=%d\n", stage);
-        fprintf(dbgprint_fh, "    anylev=%d\n", anylev);
-    }
+    bool nested;
+    bool found;
 
     ret = 1;
-    laststage = (stage + 1 == nstages);
+    nested = false;
+    for (;;) {
+        if (dbgprint_fh) {
+            fprintf(dbgprint_fh, "%s:\n", __FUNCTION__);
+            fprintln_str(dbgprint_fh, "    lastend=", lastend);
+            fprintln_str(dbgprint_fh, "    pathend=", pathend);
+            fprintf(dbgprint_fh, "    stage=%d\n", stage);
+        }
+
+        laststage = (stage + 1 == nstages);
 
-    if (!anylev) {
         prelen = stagel[stage] - lastend;
-        if (pathend - mmv->pathbuf + prelen >= PATH_MAX) {
+        if (pathend - mmv->pathbuf + prelen >= MMV_PATH_MAX) {
             printf("%s -> %s : search path after '%s' too long.\n",
                 mmv->from, mmv->to, mmv->pathbuf);
             // XXX mmv_abort();
@@ -342,49 +374,52 @@ dostage_fnames(mmv_t *mmv, char *lastend, char *pathend, int stage, int anylev)
         pathend += prelen;
         *pathend = '\0';
         lastend = stagel[stage];
-    }
 
-    if ((h = checkdir(mmv->pathbuf, pathend, 0)) == NULL) {
-        if (stage == 0 || direrr == H_NOREADDIR) {
-            printf("%s -> %s : directory '%s'",
-                mmv->from, mmv->to, mmv->pathbuf);
-            if (stage == 0) {
-                printf(" does not exist.\n");
-            }
-            else if (direrr == H_NOREADDIR) {
-                printf(" does not allow reads/searches.\n");
+        if ((h = checkdir(mmv->pathbuf, pathend, 0)) == NULL) {
+            if (stage == 0 || direrr == H_NOREADDIR) {
+                printf("%s -> %s : directory '%s'",
+                    mmv->from, mmv->to, mmv->pathbuf);
+                if (stage == 0) {
+                    printf(" does not exist.\n");
+                }
+                else if (direrr == H_NOREADDIR) {
+                    printf(" does not allow reads/searches.\n");
+                }
+                mmv->paterr = 1;
             }
-            mmv->paterr = 1;
+            // As the enclosing stages would have and-ed it into theirs
+            return (nested ? (ret & stage) : stage);
         }
-        return (stage);
-    }
-    di = h->h_di;
+        di = h->h_di;
+        dir_pin(di);
 
-    nfils = di->di_nfils;
-
-    if ((mmv->op & MOVE) && !dwritable(h)) {
-        printf("%s -> %s : directory %s does not allow writes.\n",
-            mmv->from, mmv->to, mmv->pathbuf);
-        mmv->paterr = 1;
-        goto skiplev;
-    }
+        if ((mmv->op & MOVE) && !dwritable(h)) {
+            printf("%s -> %s : directory %s does not allow writes.\n",
+                mmv->from, mmv->to, mmv->pathbuf);
+            mmv->paterr = 1;
+            dir_unpin(di);
+            return (ret);
+        }
 
-    litlen = 0;
-    while (lastend[litlen + 1] && lastend[litlen + 1] != '/') {
-        ++litlen;
-    }
-    pf = di->di_fils + (i = ffirst(lastend, litlen, di));
-    if (i < nfils) {
-        do {
+        litlen = 0;
+        while (lastend[litlen + 1] && lastend[litlen + 1] != '/') {
+            ++litlen;
+        }
+        found = false;
+        k = 0;
+        pf = di->di_fils + (i = ffirst(lastend, litlen, di, &end));
+        statx_prefetch(mmv, h, i, end, lastend, false);
+        for (; i < end && !found; ++pf, ++i) {
             if ((match_rv = trymatch(mmv, *pf, lastend)) != 0 && (match_rv == 1 || match_sfn(lastend + litlen, (*pf)->fi_name + litlen)) && keepmatch(mmv, *pf, pathend, &k, !NEED_SLASH, WANT_DIRS, laststage)) {
                 if (!laststage) {
-                    ret &= dostage_fnames(mmv, stager[stage], pathend + k, stage + 1, !ANY_LEVEL);
+                    found = true;
                 }
                 else {
                     ret = 0;
                     makerep_fnames(mmv);
                     if (badrep(mmv, h, *pf, &hto, &nto, &fdel, &flags)) {
                         (*pf)->fi_rep = &mmv->mistake;
+                        di->di_flags |= DI_MARKED;
                     }
                     else {
                         (*pf)->fi_rep = p = (REP *) challoc(sizeof (REP), 1);
@@ -400,22 +435,20 @@ dostage_fnames(mmv_t *mmv, char *lastend, char *pathend, int stage, int anylev)
                         mmv->lastrep->r_next = p;
                         mmv->lastrep = p;
                         ++mmv->nreps;
+                        di->di_flags |= DI_MARKED;
+                        hto->h_di->di_flags |= DI_MARKED;
                     }
                 }
             }
-            ++pf;
-            ++i;
-        } while (i < nfils && strncmp(lastend, (*pf)->fi_name, litlen) == 0);
-    }
+        }
 
-  skiplev:
-    if (anylev) {
-        for (pf = di->di_fils, i = 0; i < nfils; ++pf, ++i) {
-            if (*((*pf)->fi_name) != '.' && keepmatch(mmv, *pf, pathend, &k, NEED_SLASH, WANT_DIRS, WANT_FILES)) {
-                ret &= dostage_fnames(mmv, lastend, pathend + k, stage, ANY_LEVEL);
-            }
+        dir_unpin(di);
+        if (!found) {
+            return (ret);
         }
+        lastend = stager[stage];
+        pathend += k;
+        ++stage;
+        nested = true;
     }
-
-    return (ret);
 }
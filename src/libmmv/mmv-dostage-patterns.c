@@ -80,6 +80,7 @@ myupper(int c)
 
 static const size_t bkref_alloc_init = 10;
 static const size_t stage_alloc_init = 10;
+static const size_t rop_alloc_init = 10;
 
 /*
  * Constants
@@ -104,6 +105,14 @@ extern int repbad;
 static DIRID cwdd = NULL_DIRID;
 static DEVID cwdv = NULL_DIRID;
 
+/*
+ * Where the current ';' walk is: how many levels below the
+ * directory where it started, and the device of that directory.
+ */
+
+static unsigned int walk_level;
+static DEVID walk_dev;
+
 static void
 init_backrefs(mmv_t *mmv)
 {
@@ -127,6 +136,14 @@ init_backrefs(mmv_t *mmv)
     pat->stage_vec = (stage_t *) mmv_alloc(sz);
     pat->stage_siz = sz;
     pat->stage_cnt = 0;
+    pat->pm_cnt = 0;
+
+    sz = rop_alloc_init * sizeof (repop_t);
+    pat->rop_vec = (repop_t *) mmv_alloc(sz);
+    pat->rop_siz = sz;
+    pat->rop_cnt = 0;
+    pat->rop_lit = (char *) mmv_alloc(MAXPATLEN);
+    pat->rop_litlen = 0;
 
     pat->pat_magic = PATTERN_MAGIC;
 }
@@ -167,13 +184,14 @@ mmv_init_patgen(mmv_t *mmv)
  *
  * @param pat     IN   pattern to match
  * @param s       IN   string to match agains |pattern|
+ * @param send    IN   end of |s|; the length of the name is already known
  * @param bkref   OUT  Wildcard info, vector of start and length
  * @return 0/1 status: 1 = match, 0 = not match
  *
  */
 
 int
-match(char *pat, char *s, backref_t *bkref)
+match(char *pat, char *s, const char *send, backref_t *bkref)
 {
     char c;
 
@@ -182,16 +200,16 @@ match(char *pat, char *s, backref_t *bkref)
         switch (c = *pat) {
         case '\0':
         case SLASH:
-            return (*s == '\0');
+            return (s == send);
         case '*':
             bkref->br_start = s;
             if ((c = *(++pat)) == '\0') {
-                bkref->br_len = strlen(s);
+                bkref->br_len = send - s;
                 return (1);
             }
             else {
-                for (bkref->br_len = 0; !match(pat, s, bkref + 1); ++bkref->br_len, ++s) {
-                    if (*s == '\0') {
+                for (bkref->br_len = 0; !match(pat, s, send, bkref + 1); ++bkref->br_len, ++s) {
+                    if (s == send) {
                         return (0);
                     }
                 }
@@ -323,93 +341,75 @@ memmove_lc(char *dst, const char *src, size_t len)
  * At this stage, |mmv| already contains a source filename
  * and a replacement pattern.  Do pattern expansion on this pair.
  *
- * The 'from' pattern must have already been parsed, because
+ * The 'to' pattern must have already been compiled, by parse_dst_pattern(),
+ * and the 'from' pattern must have already been matched, because
  * if there are any back-references in the 'to' pattern, all information
  * about them is in static data: start[], wild_len[], nwilds, etc.
  *
+ * Backreference numbers were checked when the pattern was compiled,
+ * so they are used here without going through mmv_backref().
+ *
  */
 
 void
 makerep(mmv_t *mmv)
 {
-    char *pat;
+    pattern_t *pat = mmv->aux;
+    const repop_t *op, *end;
+    const char *src;
     char *p;
-    size_t l;
-    int c, pc;
+    size_t l, len;
 
     repbad = 0;
     p = mmv->fullrep;
-    for (pat = mmv->to, l = 0; (c = *pat) != '\0'; ++pat, ++l) {
-        if (mmv->encoding == ENCODE_PAT && c == BACKREF) {
-            int cnv;
-            int backref_nr;
-            char   *mv_start;
-            size_t  mv_len;
-
-            c = *(++pat);
-            cnv = '=';
-            switch (c) {
-            case 'l':
-            case 'u':
-                cnv = c;
-                c = *(++pat);
-                break;
-            }
-
-            for (backref_nr = 0; ; backref_nr *= 10) {
-                backref_nr += c - '0';
-                c = *(pat + 1);
-                if (!isdigit(c)) {
-                    break;
-                }
-                ++pat;
-            }
-
-            if (backref_nr == 0) {
-                mv_start = mmv->from;
-                mv_len   = mmv->fromlen;
+    l = 0;
+    end = pat->rop_vec + pat->rop_cnt;
+    for (op = pat->rop_vec; op < end; ++op) {
+        if (op->ro_kind == RO_BACKREF) {
+            if (op->ro_off == 0) {
+                src = mmv->from;
+                len = mmv->fromlen;
             }
             else {
-                --backref_nr;
-                mv_start = start(backref_nr);
-                mv_len   = wild_len(backref_nr);
+                src = pat->bkref_vec[op->ro_off - 1].br_start;
+                len = pat->bkref_vec[op->ro_off - 1].br_len;
             }
 
-            if (l + mv_len >= PATH_MAX) {
+            if (l + len >= MMV_PATH_MAX) {
                 goto toolong;
             }
 
-            switch (cnv) {
+            switch (op->ro_cnv) {
             case '=':
-                memmove(p, mv_start, mv_len);
+                memmove(p, src, len);
                 break;
             case 'l':
-                memmove_lc(p, mv_start, mv_len);
+                memmove_lc(p, src, len);
                 break;
             case 'u':
-                memmove_uc(p, mv_start, mv_len);
+                memmove_uc(p, src, len);
                 break;
             }
-            p += mv_len;
-            l += mv_len;
+            p += len;
+            // The limit has always counted each backreference as one more
+            l += len + 1;
         }
         else {
-            if (c == ESC) {
-                c = *(++pat);
-            }
-            if (l >= PATH_MAX) {
-                goto toolong;
-            }
-            if ((c == SLASH) && (p == mmv->fullrep ? pat != mmv->to : (((pc = *(p - 1)) == SLASH) && *(pat - 1) != pc))) {
+            if (op->ro_empty || (op->ro_slash && (p == mmv->fullrep || *(p - 1) == SLASH))) {
                 repbad = 1;
-                if (l + strlen(EMPTY) >= PATH_MAX) {
+                if (l + strlen(EMPTY) >= MMV_PATH_MAX) {
                     goto toolong;
                 }
                 strcpy(p, EMPTY);
                 p += strlen(EMPTY);
                 l += strlen(EMPTY);
             }
-            *(p++) = c;
+            if (l + op->ro_len > MMV_PATH_MAX) {
+                goto toolong;
+            }
+            memcpy(p, pat->rop_lit + op->ro_off, op->ro_len);
+            p += op->ro_len;
+            l += op->ro_len;
         }
     }
 
@@ -425,45 +425,124 @@ makerep(mmv_t *mmv)
     strcpy(mmv->fullrep, TOOLONG);
 }
 
+/*
+ * The walk in dostage_patterns() does not recurse.  It keeps its own
+ * stack of frames, one for each directory that it is in the middle of:
+ * the directory of each stage, and each level below a ';'.
+ * The stack is kept from one call to the next, so a walk allocates
+ * memory only when it goes deeper than any walk before it,
+ * and the C stack does not grow with the depth of the tree.
+ *
+ * Directories are held by their |HANDLE|; any descriptor a frame
+ * needs comes from the bounded cache in mmv-dirfd.c, so the number
+ * of open descriptors does not grow with depth, either.
+ */
+
+enum walk_phase {
+    WP_ENTER,           // Directory not looked up yet
+    WP_MATCH,           // Matching names against this stage
+    WP_SUBDIRS,         // Going into every subdirectory, for ';'
+    WP_LEAVE,           // Done; release the directory
+};
+
+struct walk_frame {
+    enum walk_phase wf_phase;
+    char         *wf_lastend;
+    char         *wf_pathend;
+    backref_t    *wf_bkref;
+    size_t        wf_stage;
+    int           wf_anylev;
+    int           wf_ret;
+    HANDLE       *wf_h;
+    DIRINFO      *wf_di;            // Pinned, if not NULL
+    int           wf_i;             // Next entry of |wf_di| to look at
+    int           wf_end;
+    const unsigned int *wf_cand;    // Entries to look at, from a batch, or NULL
+    unsigned int *wf_candbuf;       // |wf_cand|, if it is from fsuffix()
+    int           wf_nfils;
+    int           wf_litlen;
+    int           wf_wantdirs;
+    bool          wf_prefetching;
+    bool          wf_walking;       // A ';' walk starts here
+    unsigned int  wf_save_level;
+    DEVID         wf_save_dev;
+};
+
+static struct walk_frame *walk_stack;
+static size_t walk_room;
+static size_t walk_depth;
+
+#define WALK_INITROOM 16
+
+/**
+ * @brief Push a frame for one directory, in place of a recursive call.
+ *
+ * Any pointer into |walk_stack| is stale after this.
+ *
+ */
+
+static void
+walk_push(char *lastend, char *pathend, backref_t *bkref, size_t stage, int anylev)
+{
+    struct walk_frame *wf;
+
+    if (walk_depth == walk_room) {
+        walk_room = walk_room ? walk_room * 2 : WALK_INITROOM;
+        walk_stack = (struct walk_frame *) mmv_realloc(walk_stack, walk_room * sizeof (struct walk_frame));
+    }
+    wf = &walk_stack[walk_depth++];
+    wf->wf_phase = WP_ENTER;
+    wf->wf_lastend = lastend;
+    wf->wf_pathend = pathend;
+    wf->wf_bkref = bkref;
+    wf->wf_stage = stage;
+    wf->wf_anylev = anylev;
+    wf->wf_ret = 1;
+    wf->wf_h = NULL;
+    wf->wf_di = NULL;
+    wf->wf_cand = NULL;
+    wf->wf_candbuf = NULL;
+    wf->wf_prefetching = false;
+    wf->wf_walking = false;
+}
+
 /**
- * @brief  dostage_patterns ???
+ * @brief Look up the directory of a frame, and get ready to match in it.
  *
  * @param mmv
- * @param lastend  ???  ???
- * @param pathend  ???  ???
- * @param backref  View into a subset of backrefs
- * @param stage    ???  ???
- * @param anylev   IN   ???
+ * @param wf   INOUT  frame in phase WP_ENTER
  *
  */
 
-int
-dostage_patterns(mmv_t *mmv, char *lastend, char *pathend, backref_t *bkref, int istage, int anylev)
+static void
+walk_enter(mmv_t *mmv, struct walk_frame *wf)
 {
     DIRINFO *di;
-    HANDLE *h, *hto;
-    int prelen, litlen, nfils, i, k, flags, match_rv;
-    FILEINFO **pf, *fdel;
-    char *nto, *firstesc;
-    REP *p;
-    int wantdirs;
-    int ret;
+    HANDLE *h;
+    int prelen, i, end;
+    size_t ncand, sfxlen;
+    char sfx[MAXPATLEN];
+    char *firstesc;
+    char *lastend, *pathend;
     bool laststage;
     pattern_t *pat;
     backref_t *lastbkref;
     size_t stage;
 
-    stage = (size_t)istage; // XXX convert: make stage argument of type size_t
     pat = mmv->aux;
+    lastend = wf->wf_lastend;
+    pathend = wf->wf_pathend;
+    stage = wf->wf_stage;
     if (dbgprint_fh) {
-        fprintf(dbgprint_fh, "%s:\n", __FUNCTION__);
+        fprintf(dbgprint_fh, "%s:\n", "dostage_patterns");
         fprintln_str(dbgprint_fh, "    lastend=", lastend);
         fprintln_str(dbgprint_fh, "    pathend=", pathend);
         fprintf(dbgprint_fh, "    stage=%zu\n", stage);
-        fprintf(dbgprint_fh, "    anylev=%d\n", anylev);
+        fprintf(dbgprint_fh, "    anylev=%d\n", wf->wf_anylev);
+        fprintf(dbgprint_fh, "    kernel=%s\n", pmatch_kernel_name(pat->stage_vec[stage].stg_pm));
     }
 
-    ret = 1;
+    wf->wf_phase = WP_LEAVE;
     laststage = (stage + 1 == pat->stage_cnt);
     if (pat->stage_cnt >= 1) {
         lastbkref = mmv_backref(pat->stage_cnt - 1);
@@ -471,16 +550,17 @@ dostage_patterns(mmv_t *mmv, char *lastend, char *pathend, backref_t *bkref, int
     else {
         lastbkref = NULL;
     }
-    wantdirs = !laststage || (mmv->op & (DIRMOVE | SYMLINK)) || lastbkref == NULL;
+    wf->wf_wantdirs = !laststage || (mmv->op & (DIRMOVE | SYMLINK)) || lastbkref == NULL;
 
-    if (!anylev) {
+    if (!wf->wf_anylev) {
         prelen = pat->stage_vec[stage].l - lastend;
-        if (pathend - mmv->pathbuf + prelen >= PATH_MAX) {
+        if (pathend - mmv->pathbuf + prelen >= MMV_PATH_MAX) {
             printf("%s -> %s : search path after '%s' too long.\n",
                 mmv->from, mmv->to, mmv->pathbuf);
             // XXX mmv_abort();
             mmv->paterr = 1;
-            return (1);
+            wf->wf_ret = 1;
+            return;
         }
         memmove(pathend, lastend, prelen);
         pathend += prelen;
@@ -500,75 +580,280 @@ dostage_patterns(mmv_t *mmv, char *lastend, char *pathend, backref_t *bkref, int
             }
             mmv->paterr = 1;
         }
-        return (stage);
+        wf->wf_ret = stage;
+        return;
     }
     di = h->h_di;
+    dir_pin(di);
+    wf->wf_h = h;
+    wf->wf_di = di;
 
     if (*lastend == ';') {
-        anylev = 1;
-        bkref->br_start = pathend;
-        bkref->br_len = 0;
+        wf->wf_walking = true;
+        wf->wf_save_level = walk_level;
+        wf->wf_save_dev = walk_dev;
+        walk_level = 0;
+        walk_dev = di->di_vid;
+        wf->wf_anylev = 1;
+        wf->wf_bkref->br_start = pathend;
+        wf->wf_bkref->br_len = 0;
         ++lastend;
+        wf->wf_prefetching = prefetch_start(mmv, mmv->pathbuf, di);
     }
-
-    nfils = di->di_nfils;
+    wf->wf_lastend = lastend;
+    wf->wf_pathend = pathend;
+    wf->wf_nfils = di->di_nfils;
+    wf->wf_phase = wf->wf_anylev ? WP_SUBDIRS : WP_LEAVE;
+    wf->wf_i = 0;
 
     if ((mmv->op & MOVE) && !dwritable(h)) {
         printf("%s -> %s : directory %s does not allow writes.\n",
             mmv->from, mmv->to, mmv->pathbuf);
         mmv->paterr = 1;
-        goto skiplev;
+        return;
     }
 
     firstesc = strchr(lastend, ESC);
     if (firstesc == NULL || firstesc > firstwild(stage)) {
         firstesc = firstwild(stage);
     }
-    litlen = firstesc - lastend;
-    pf = di->di_fils + (i = ffirst(lastend, litlen, di));
-    if (i < nfils) {
-        do {
-            if ((match_rv = trymatch(mmv, *pf, lastend)) != 0 && (match_rv == 1 || match(lastend + litlen, (*pf)->fi_name + litlen, bkref + anylev)) && keepmatch(mmv, *pf, pathend, &k, 0, wantdirs, laststage)) {
-                if (!laststage) {
-                    ret &= dostage_patterns(mmv, pat->stage_vec[stage].r, pathend + k, bkref + nwilds(stage), stage + 1, 0);
-                }
-                else {
-                    ret = 0;
-                    makerep(mmv);
-                    if (badrep(mmv, h, *pf, &hto, &nto, &fdel, &flags)) {
-                        (*pf)->fi_rep = &mmv->mistake;
-                    }
-                    else {
-                        (*pf)->fi_rep = p = (REP *) challoc(sizeof (REP), 1);
-                        p->r_flags = flags | mmv->patflags;
-                        p->r_hfrom = h;
-                        p->r_ffrom = *pf;
-                        p->r_hto = hto;
-                        p->r_nto = nto;
-                        p->r_fdel = fdel;
-                        p->r_first = p;
-                        p->r_thendo = NULL;
-                        p->r_next = NULL;
-                        mmv->lastrep->r_next = p;
-                        mmv->lastrep = p;
-                        ++mmv->nreps;
-                    }
-                }
-            }
-            ++pf;
-            ++i;
-        } while (i < nfils && strncmp(lastend, (*pf)->fi_name, litlen) == 0);
+    wf->wf_litlen = firstesc - lastend;
+    i = ffirst(lastend, wf->wf_litlen, di, &end);
+    statx_prefetch(mmv, h, i, end, lastend, wf->wf_anylev != 0);
+    if (stage == 0 && laststage && !wf->wf_anylev
+        && (wf->wf_cand = multipat_candidates(di, &ncand)) != NULL) {
+        // One of a batch of pattern lines; see mmv-multipat.c
+        i = 0;
+        end = ncand;
+    }
+    else if (wf->wf_litlen == 0 && pat->stage_vec[stage].stg_pm != NULL
+        && (sfxlen = pmatch_literal_suffix(pat->stage_vec[stage].stg_pm, sfx, sizeof (sfx))) != 0
+        && (wf->wf_candbuf = fsuffix(sfx, sfxlen, di, &ncand)) != NULL) {
+        // No literal prefix, but a literal suffix
+        wf->wf_cand = wf->wf_candbuf;
+        i = 0;
+        end = ncand;
     }
+    if (i < end) {
+        wf->wf_phase = WP_MATCH;
+        wf->wf_i = i;
+        wf->wf_end = end;
+    }
+}
+
+/**
+ * @brief Record a rename for one name that matched the last stage.
+ *
+ */
+
+static void
+walk_addrep(mmv_t *mmv, struct walk_frame *wf, FILEINFO *f)
+{
+    DIRINFO *di;
+    HANDLE *hto;
+    FILEINFO *fdel;
+    uint32_t nto;
+    REP *p;
+    int flags;
 
-  skiplev:
-    if (anylev) {
-        for (pf = di->di_fils, i = 0; i < nfils; ++pf, ++i) {
-            if (*((*pf)->fi_name) != '.' && keepmatch(mmv, *pf, pathend, &k, 1, 1, false)) {
-                bkref->br_len = pathend - bkref->br_start + k;
-                ret &= dostage_patterns(mmv, lastend, pathend + k, bkref, stage, 1);
+    di = wf->wf_di;
+    makerep(mmv);
+    if (badrep(mmv, wf->wf_h, f, &hto, &nto, &fdel, &flags)) {
+        f->fi_rep = &mmv->mistake;
+        di->di_flags |= DI_MARKED;
+    }
+    else {
+        f->fi_rep = p = (REP *) challoc(sizeof (REP), 1);
+        p->r_flags = flags | mmv->patflags;
+        p->r_hfrom = wf->wf_h;
+        p->r_ffrom = f;
+        p->r_hto = hto;
+        p->r_nto = nto;
+        p->r_fdel = fdel;
+        p->r_first = p;
+        p->r_thendo = NULL;
+        p->r_next = NULL;
+        mmv->lastrep->r_next = p;
+        mmv->lastrep = p;
+        ++mmv->nreps;
+        di->di_flags |= DI_MARKED;
+        hto->h_di->di_flags |= DI_MARKED;
+    }
+}
+
+/**
+ * @brief Match one name against the wildcards of a stage.
+ *
+ * @param pat    IN   the 'from' pattern
+ * @param stage  IN   which stage
+ * @param pt     IN   the stage's pattern
+ * @param litlen IN   length of the literal prefix that all names tried have
+ * @param f      IN   the name
+ * @param bkref  OUT  spans of the stage's wildcards
+ * @return 0/1 status: 1 = match, 0 = not match
+ *
+ * The stage was compiled by parse_src_pattern(); match() is used
+ * only if, somehow, it could not be.
+ *
+ */
+
+static inline int
+stage_match(pattern_t *pat, size_t stage, char *pt, int litlen, FILEINFO *f, backref_t *bkref)
+{
+    pmatch_t *pm = pat->stage_vec[stage].stg_pm;
+    const char *send = f->fi_name + f->fi_len;
+
+    if (pm != NULL) {
+        return (pmatch_exec(pm, f->fi_name, send, bkref));
+    }
+    return (match(pt + litlen, f->fi_name + litlen, send, bkref));
+}
+
+/**
+ * @brief Match names of a frame's directory, until one needs the next stage.
+ *
+ * @param mmv
+ * @param wf   INOUT  frame in phase WP_MATCH
+ *
+ * If a matching directory must be searched for the next stage,
+ * a frame for it is pushed, and this returns; matching resumes
+ * with the next name when that frame is done.
+ *
+ */
+
+static void
+walk_match(mmv_t *mmv, struct walk_frame *wf)
+{
+    pattern_t *pat;
+    FILEINFO *f;
+    char *lastend, *pathend;
+    size_t stage;
+    bool laststage;
+    int litlen, match_rv, k;
+
+    pat = mmv->aux;
+    lastend = wf->wf_lastend;
+    pathend = wf->wf_pathend;
+    stage = wf->wf_stage;
+    litlen = wf->wf_litlen;
+    laststage = (stage + 1 == pat->stage_cnt);
+    while (wf->wf_i < wf->wf_end) {
+        f = wf->wf_di->di_fils[wf->wf_cand != NULL ? wf->wf_cand[wf->wf_i] : (unsigned int)wf->wf_i];
+        ++wf->wf_i;
+        if ((match_rv = trymatch(mmv, f, lastend)) != 0 && (match_rv == 1 || stage_match(pat, stage, lastend, litlen, f, wf->wf_bkref + wf->wf_anylev)) && keepmatch(mmv, f, pathend, &k, 0, wf->wf_wantdirs, laststage)) {
+            if (!laststage) {
+                walk_push(pat->stage_vec[stage].r, pathend + k, wf->wf_bkref + nwilds(stage), stage + 1, 0);
+                return;
             }
+            wf->wf_ret = 0;
+            walk_addrep(mmv, wf, f);
         }
     }
+    wf->wf_phase = wf->wf_anylev ? WP_SUBDIRS : WP_LEAVE;
+    wf->wf_i = 0;
+}
 
+/**
+ * @brief Go into the next subdirectory of a frame's directory, for ';'.
+ *
+ * @param mmv
+ * @param wf   INOUT  frame in phase WP_SUBDIRS
+ *
+ */
+
+static void
+walk_subdirs(mmv_t *mmv, struct walk_frame *wf)
+{
+    FILEINFO *f;
+    char *pathend;
+    int k;
+
+    pathend = wf->wf_pathend;
+    while (wf->wf_i < wf->wf_nfils) {
+        f = wf->wf_di->di_fils[wf->wf_i++];
+        if (*(f->fi_name) != '.' && walk_descend(mmv, wf->wf_h, f, pathend, walk_level + 1, walk_dev) && keepmatch(mmv, f, pathend, &k, 1, 1, false)) {
+            wf->wf_bkref->br_len = pathend - wf->wf_bkref->br_start + k;
+            ++walk_level;
+            walk_push(wf->wf_lastend, pathend + k, wf->wf_bkref, wf->wf_stage, 1);
+            return;
+        }
+    }
+    wf->wf_phase = WP_LEAVE;
+}
+
+/**
+ * @brief Release whatever a frame holds.
+ *
+ * @return the result of the frame, as dostage_patterns() would return it
+ *
+ */
+
+static int
+walk_leave(struct walk_frame *wf)
+{
+    if (wf->wf_prefetching) {
+        prefetch_finish();
+    }
+    if (wf->wf_walking) {
+        walk_level = wf->wf_save_level;
+        walk_dev = wf->wf_save_dev;
+    }
+    if (wf->wf_di != NULL) {
+        dir_unpin(wf->wf_di);
+    }
+    free(wf->wf_candbuf);
+    return (wf->wf_ret);
+}
+
+/**
+ * @brief Match one stage of a 'from' pattern, and all stages after it.
+ *
+ * @param mmv
+ * @param lastend  IN  where matching picks up, in mmv->from
+ * @param pathend  IN  end of the directory so far, in mmv->pathbuf
+ * @param bkref    IN  view into a subset of backrefs
+ * @param istage   IN  index of the stage
+ * @param anylev   IN  C-int-bool; already below a ';'
+ * @return 0 if anything matched, or else non-zero
+ *
+ * The walk is iterative; see |walk_stack|.
+ *
+ */
+
+int
+dostage_patterns(mmv_t *mmv, char *lastend, char *pathend, backref_t *bkref, int istage, int anylev)
+{
+    struct walk_frame *wf;
+    size_t base;
+    int ret;
+
+    base = walk_depth;
+    walk_push(lastend, pathend, bkref, (size_t)istage, anylev);
+    ret = 1;
+    while (walk_depth > base) {
+        wf = &walk_stack[walk_depth - 1];
+        switch (wf->wf_phase) {
+        case WP_ENTER:
+            walk_enter(mmv, wf);
+            break;
+        case WP_MATCH:
+            walk_match(mmv, wf);
+            break;
+        case WP_SUBDIRS:
+            walk_subdirs(mmv, wf);
+            break;
+        case WP_LEAVE:
+            ret = walk_leave(wf);
+            --walk_depth;
+            if (walk_depth > base) {
+                wf = &walk_stack[walk_depth - 1];
+                wf->wf_ret &= ret;
+                if (wf->wf_phase == WP_SUBDIRS) {
+                    --walk_level;
+                }
+            }
+            break;
+        }
+    }
     return (ret);
 }
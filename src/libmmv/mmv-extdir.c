@@ -0,0 +1,675 @@
+/*
+ * Filename: src/libmmv/mmv-extdir.c
+ * Library: libmmv
+ * Brief: External-memory listings of directories too big to sort in memory
+ *
+ * Description:
+ *   takedir() reads a whole directory into memory, sorts it, and then
+ *   makes a |FILEINFO| for every entry.  For a directory with tens of
+ *   millions of entries, that does not fit.  When a memory cap is set,
+ *   with mmv_set_dirmem_cap() (the commands take it from the
+ *   environment variable, MMV_DIRMEM_CAP), then a directory is read
+ *   in chunks of a fraction of the cap.  A directory that fits in
+ *   one chunk is handled just as before.  Otherwise, each chunk is
+ *   sorted and spilled, as a run, to a temporary file, and then all
+ *   runs are merged, k ways at once, straight into a shared mapping
+ *   of another temporary file.  If there are too many runs for the
+ *   buffers of all of them to fit in the cap, groups of them are
+ *   first merged into longer runs, at the end of the same spill file,
+ *   until few enough are left.
+ *
+ *   The mapping holds exactly what takedirbuf() would have allocated:
+ *   the vector |di_fils|, the |FILEINFO|s in name order, and the names.
+ *   So, ffirst(), fsearch() and the walks in dostage_patterns() and
+ *   dostage_fnames() work on it, unchanged.  Because the mapping is of
+ *   a file, the kernel can write its pages back and drop them, so
+ *   only the parts in use take up memory.  Such a directory does not
+ *   get a hash index, since that would be another array of the size
+ *   of the whole directory, in memory; fsearch() uses binary search.
+ *
+ *   Both temporary files are unlinked as soon as they are created,
+ *   in $TMPDIR, or /tmp.
+ *
+ * Copyright (C) 2016 Guy Shaw
+ * Written by Guy Shaw <gshaw@acm.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdbool.h>
+#include <stddef.h>         // Import size_t
+#include <stdio.h>          // Import fdopen(), fwrite(), fprintf(), fseeko(), snprintf()
+#include <stdlib.h>         // Import free(), getenv(), mkstemp()
+#include <string.h>         // Import memchr(), memcpy(), memmove(), strcmp(), strlen()
+#include <errno.h>          // Import errno
+#include <unistd.h>         // Import close(), ftruncate(), pread(), unlink()
+#include <sys/mman.h>       // Import mmap()
+#include <linux/limits.h>   // Import PATH_MAX
+
+#define IMPORT_FILEINFO
+#define IMPORT_DIRINFO
+#define IMPORT_DIRBUF
+#include <mmv-impl.h>
+#include <mmv-impl-rep.h>
+
+/*
+ * A chunk is 1/EXT_CHUNK_SHARE of the cap, because sorting a chunk
+ * takes about 3 times its size: the records, a sorted copy of them,
+ * and the sort keys.  During the merge, the buffers of all runs
+ * together take half of the cap, but each run gets at least
+ * EXT_RUNBUF_MIN bytes, which always holds one whole record.
+ * So, at most half of the cap / EXT_RUNBUF_MIN runs, but never
+ * fewer than 2, are merged at once.
+ */
+
+#define EXT_CHUNK_SHARE 4
+#define EXT_RUNBUF_MIN  4096
+
+static size_t ext_cap;
+
+/*
+ * A sorted run, in the spill file.
+ *
+ * Each record is the d_type byte, then the name, with its '\0'.
+ */
+
+struct ext_run {
+    off_t   er_off;
+    off_t   er_end;
+};
+
+struct run_cursor {
+    off_t         rc_off;       // Next offset to read, in the spill file
+    off_t         rc_end;
+    char *        rc_buf;
+    size_t        rc_bufsize;
+    size_t        rc_pos;       // Unread bytes are |rc_buf[rc_pos .. rc_len)|
+    size_t        rc_len;
+    const char *  rc_name;      // Current record
+    size_t        rc_namelen;
+    unsigned char rc_type;
+};
+
+/*
+ * A k-way merge of runs, as a heap of cursors, least name on top.
+ */
+
+struct run_merge {
+    struct run_cursor *  rm_cursors;
+    struct run_cursor ** rm_heap;
+    char *               rm_bufs;
+    size_t               rm_nheap;
+};
+
+struct extdir_stats {
+    size_t dirs;        // Directories that went to external memory
+    size_t small;       // Directories that fit in one chunk
+    size_t runs;
+    size_t passes;      // Merges of groups of runs into longer runs
+    size_t entries;
+    size_t spilled;     // Bytes written to spill files
+};
+
+static struct extdir_stats xstats;
+
+/**
+ * @brief Set the cap on memory used to read one directory.
+ *
+ * @param bytes  IN  cap, in bytes; 0 means no cap
+ *
+ */
+
+void
+extdir_set_cap(size_t bytes)
+{
+    ext_cap = bytes;
+}
+
+/**
+ * @brief Would a listing of the given size fit under the cap?
+ *
+ */
+
+bool
+extdir_fits(size_t bytes)
+{
+    return (ext_cap == 0 || bytes <= ext_cap);
+}
+
+/**
+ * @brief Create an anonymous temporary file.
+ *
+ * @return descriptor, or -1 (with errno set)
+ *
+ */
+
+static int
+ext_tmpfile(void)
+{
+    char tmpname[PATH_MAX];
+    const char *tmpdir;
+    int fd;
+
+    tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL || *tmpdir == '\0') {
+        tmpdir = "/tmp";
+    }
+    if (snprintf(tmpname, sizeof (tmpname), "%s/mmv-XXXXXX", tmpdir) >= (int)sizeof (tmpname)) {
+        errno = ENAMETOOLONG;
+        return (-1);
+    }
+    fd = mkstemp(tmpname);
+    if (fd >= 0) {
+        unlink(tmpname);
+    }
+    return (fd);
+}
+
+/**
+ * @brief Sort one chunk and append it to the spill file, as a run.
+ *
+ * @param db     INOUT  chunk of directory entries
+ * @param fp     IN     spill file
+ * @param run    OUT    where the run went
+ * @param ppool  INOUT  running total of bytes of names, with their '\0'
+ *
+ */
+
+static void
+ext_spill(dirbuf_t *db, FILE *fp, struct ext_run *run, size_t *ppool)
+{
+    struct dirbuf_rec *dp;
+    size_t pos, len;
+
+    dirbuf_sort(db);
+    run->er_off = ftello(fp);
+    for (pos = 0; pos < db->db_len; pos += dp->d_reclen) {
+        dp = (struct dirbuf_rec *)(db->db_buf + pos);
+        len = strlen(dp->d_name);
+        putc(dp->d_type, fp);
+        fwrite(dp->d_name, 1, len + 1, fp);
+        *ppool += len + 1;
+    }
+    run->er_end = ftello(fp);
+    xstats.spilled += run->er_end - run->er_off;
+    ++xstats.runs;
+}
+
+/**
+ * @brief Advance a run cursor to its next record.
+ *
+ * @param fd   IN     spill file
+ * @param rc   INOUT  cursor
+ * @param perr OUT    errno, if reading failed
+ * @return false at the end of the run, or on error
+ *
+ */
+
+static bool
+run_next(int fd, struct run_cursor *rc, int *perr)
+{
+    char *nul;
+    size_t want;
+    ssize_t rlen;
+
+    for (;;) {
+        if (rc->rc_len - rc->rc_pos >= 2) {
+            nul = (char *) memchr(rc->rc_buf + rc->rc_pos + 1, '\0', rc->rc_len - rc->rc_pos - 1);
+            if (nul != NULL) {
+                rc->rc_type = rc->rc_buf[rc->rc_pos];
+                rc->rc_name = rc->rc_buf + rc->rc_pos + 1;
+                rc->rc_namelen = nul - rc->rc_name;
+                rc->rc_pos = nul + 1 - rc->rc_buf;
+                return (true);
+            }
+        }
+        if (rc->rc_off >= rc->rc_end) {
+            return (false);
+        }
+        memmove(rc->rc_buf, rc->rc_buf + rc->rc_pos, rc->rc_len - rc->rc_pos);
+        rc->rc_len -= rc->rc_pos;
+        rc->rc_pos = 0;
+        want = rc->rc_bufsize - rc->rc_len;
+        if ((off_t)want > rc->rc_end - rc->rc_off) {
+            want = rc->rc_end - rc->rc_off;
+        }
+        rlen = pread(fd, rc->rc_buf + rc->rc_len, want, rc->rc_off);
+        if (rlen <= 0) {
+            *perr = rlen < 0 ? errno : EIO;
+            return (false);
+        }
+        rc->rc_len += rlen;
+        rc->rc_off += rlen;
+    }
+}
+
+static inline bool
+run_less(const struct run_cursor *a, const struct run_cursor *b)
+{
+    return (strcmp(a->rc_name, b->rc_name) < 0);
+}
+
+/**
+ * @brief Restore the heap property, from slot |i| down.
+ *
+ */
+
+static void
+heap_down(struct run_cursor **heap, size_t n, size_t i)
+{
+    struct run_cursor *tmp;
+    size_t child;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= n) {
+            return;
+        }
+        if (child + 1 < n && run_less(heap[child + 1], heap[child])) {
+            ++child;
+        }
+        if (!run_less(heap[child], heap[i])) {
+            return;
+        }
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+/**
+ * @brief How many runs can be merged at once, within the cap?
+ *
+ */
+
+static size_t
+ext_fanin(void)
+{
+    size_t fanin;
+
+    fanin = ext_cap / 2 / EXT_RUNBUF_MIN;
+    return (fanin < 2 ? 2 : fanin);
+}
+
+/**
+ * @brief Start a k-way merge of some runs.
+ *
+ * @param sfd    IN   spill file
+ * @param runs   IN   the sorted runs to merge
+ * @param nruns  IN   number of runs
+ * @param rm     OUT  the merge
+ * @param perr   OUT  errno, if reading failed
+ *
+ */
+
+static void
+merge_start(int sfd, struct ext_run *runs, size_t nruns, struct run_merge *rm, int *perr)
+{
+    struct run_cursor *rc;
+    size_t bufsize, i;
+
+    bufsize = ext_cap / 2 / nruns;
+    if (bufsize < EXT_RUNBUF_MIN) {
+        bufsize = EXT_RUNBUF_MIN;
+    }
+    rm->rm_cursors = (struct run_cursor *) mmv_alloc(nruns * sizeof (struct run_cursor));
+    rm->rm_heap = (struct run_cursor **) mmv_alloc(nruns * sizeof (struct run_cursor *));
+    rm->rm_bufs = (char *) mmv_alloc(nruns * bufsize);
+    rm->rm_nheap = 0;
+    for (i = 0; i < nruns; ++i) {
+        rc = &rm->rm_cursors[i];
+        rc->rc_off = runs[i].er_off;
+        rc->rc_end = runs[i].er_end;
+        rc->rc_buf = rm->rm_bufs + i * bufsize;
+        rc->rc_bufsize = bufsize;
+        rc->rc_pos = 0;
+        rc->rc_len = 0;
+        if (run_next(sfd, rc, perr)) {
+            rm->rm_heap[rm->rm_nheap++] = rc;
+        }
+    }
+    for (i = rm->rm_nheap / 2; i > 0; --i) {
+        heap_down(rm->rm_heap, rm->rm_nheap, i - 1);
+    }
+}
+
+/**
+ * @brief Move past the least record, on top of the heap.
+ *
+ */
+
+static void
+merge_next(int sfd, struct run_merge *rm, int *perr)
+{
+    struct run_cursor **heap = rm->rm_heap;
+
+    if (!run_next(sfd, heap[0], perr)) {
+        heap[0] = heap[--rm->rm_nheap];
+    }
+    heap_down(heap, rm->rm_nheap, 0);
+}
+
+static void
+merge_end(struct run_merge *rm)
+{
+    free(rm->rm_bufs);
+    free(rm->rm_heap);
+    free(rm->rm_cursors);
+}
+
+/**
+ * @brief Merge groups of runs into longer runs, until few enough are left.
+ *
+ * @param fp      IN     spill file; the new runs are appended to it
+ * @param runs    INOUT  the sorted runs
+ * @param pnruns  INOUT  number of runs
+ * @return errno-style status
+ *
+ * Each pass merges groups of ext_fanin() runs, so that the final
+ * merge, in ext_merge(), stays within the cap.  The old runs are
+ * left in the spill file; it is unlinked, anyway.
+ *
+ */
+
+static int
+ext_premerge(FILE *fp, struct ext_run *runs, size_t *pnruns)
+{
+    struct run_merge rm;
+    struct run_cursor *rc;
+    struct ext_run out;
+    size_t fanin, nruns, nout, n, i;
+    int sfd, err;
+
+    sfd = fileno(fp);
+    fanin = ext_fanin();
+    nruns = *pnruns;
+    err = 0;
+    while (nruns > fanin && err == 0) {
+        nout = 0;
+        for (i = 0; i < nruns && err == 0; i += n) {
+            n = nruns - i < fanin ? nruns - i : fanin;
+            if (n == 1) {
+                runs[nout++] = runs[i];
+                continue;
+            }
+            if (fseeko(fp, 0, SEEK_END) != 0) {
+                err = errno;
+                break;
+            }
+            out.er_off = ftello(fp);
+            merge_start(sfd, &runs[i], n, &rm, &err);
+            while (rm.rm_nheap != 0 && err == 0) {
+                rc = rm.rm_heap[0];
+                putc(rc->rc_type, fp);
+                fwrite(rc->rc_name, 1, rc->rc_namelen + 1, fp);
+                merge_next(sfd, &rm, &err);
+            }
+            merge_end(&rm);
+            if (err == 0 && (fflush(fp) != 0 || ferror(fp))) {
+                err = errno ? errno : EIO;
+            }
+            out.er_end = ftello(fp);
+            xstats.spilled += out.er_end - out.er_off;
+            // Groups go in order, so this never overwrites an unmerged run.
+            runs[nout++] = out;
+        }
+        nruns = nout;
+        ++xstats.passes;
+    }
+    *pnruns = nruns;
+    return (err);
+}
+
+/**
+ * @brief Merge all runs into a shared mapping laid out like takedirbuf().
+ *
+ * @param sfd     IN   spill file
+ * @param runs    IN   the sorted runs in it
+ * @param nruns   IN   number of runs
+ * @param count   IN   total number of entries
+ * @param poolsize IN  total bytes of names, with their '\0'
+ * @param di      OUT  Directory information to be populated
+ * @param sticky  IN   FI_INSTICKY, if the directory is sticky and not ours
+ * @return errno-style status
+ *
+ */
+
+static int
+ext_merge(int sfd, struct ext_run *runs, size_t nruns, size_t count, size_t poolsize,
+    DIRINFO *di, int sticky)
+{
+    struct run_merge rm;
+    struct run_cursor *rc;
+    FILEINFO **fils, *recs, *f;
+    char *map, *pool;
+    size_t size, i;
+    unsigned int nuntyped;
+    int ofd, err;
+
+    size = (count + 1) * sizeof (FILEINFO *) + count * sizeof (FILEINFO) + poolsize;
+    ofd = ext_tmpfile();
+    if (ofd < 0) {
+        return (errno);
+    }
+    if (ftruncate(ofd, size) != 0) {
+        err = errno;
+        close(ofd);
+        return (err);
+    }
+    map = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ofd, 0);
+    err = errno;
+    close(ofd);
+    if (map == MAP_FAILED) {
+        return (err);
+    }
+    fils = (FILEINFO **) map;
+    recs = (FILEINFO *) (fils + count + 1);
+    pool = (char *) (recs + count);
+
+    err = 0;
+    merge_start(sfd, runs, nruns, &rm, &err);
+
+    nuntyped = 0;
+    for (i = 0; rm.rm_nheap != 0 && i < count && err == 0; ++i) {
+        rc = rm.rm_heap[0];
+        memcpy(pool, rc->rc_name, rc->rc_namelen + 1);
+        fils[i] = f = &recs[i];
+        f->fi_name = pool;
+        f->fi_len = rc->rc_namelen;
+        f->fi_mode = 0;
+        f->fi_stflags = sticky | dtype_flags(rc->rc_type);
+        f->fi_rep = NULL;
+        if (!(f->fi_stflags & FI_TYPEKNOWN)) {
+            ++nuntyped;
+        }
+        pool += rc->rc_namelen + 1;
+        merge_next(sfd, &rm, &err);
+    }
+
+    merge_end(&rm);
+    if (err == 0 && i != count) {
+        err = EIO;
+    }
+    if (err) {
+        munmap(map, size);
+        return (err);
+    }
+
+    di->di_fils = fils;
+    di->di_recs = NULL;
+    di->di_pool = map;
+    di->di_poolsize = size;
+    di->di_nfils = count;
+    di->di_nuntyped = nuntyped;
+    di->di_index = NULL;
+    di->di_indexsize = 0;
+    di->di_flags |= DI_EXTERNAL;
+    xstats.entries += count;
+    ++xstats.dirs;
+    return (0);
+}
+
+/**
+ * @brief Read the next chunk of a directory, or quit.
+ *
+ * For the main thread; see dirbuf_read_chunk().
+ *
+ */
+
+static int
+ext_read_chunk(int fd, dirbuf_t *db, bool *peof)
+{
+    int err;
+
+    err = dirbuf_read_chunk(fd, db, ext_cap / EXT_CHUNK_SHARE, peof);
+    if (err == ENOMEM) {
+        mmv_nomem();
+    }
+    return (err);
+}
+
+/**
+ * @brief Read a directory, in external memory, if it is too big for the cap.
+ *
+ * @param fd      IN   Descriptor of a directory, open for reading
+ * @param di      OUT  Directory information, if it went to external memory
+ * @param sticky  IN   FI_INSTICKY, if the directory is sticky and not ours
+ * @param db      OUT  Buffer of all directory entries, otherwise
+ * @param pdone   OUT  true if |di| was populated, false if |db| was
+ * @return errno-style status
+ *
+ * With no cap, this is just dirbuf_read_fd().
+ * In any case, |fd| is closed.
+ *
+ */
+
+int
+extdir_read(int fd, DIRINFO *di, int sticky, dirbuf_t *db, bool *pdone)
+{
+    struct ext_run *runs;
+    size_t nruns, runroom, count, poolsize;
+    FILE *fp;
+    bool eof;
+    int sfd, err;
+
+    *pdone = false;
+    if (ext_cap == 0) {
+        return (dirbuf_read_fd(fd, db));
+    }
+
+    err = ext_read_chunk(fd, db, &eof);
+    if (err || eof) {
+        close(fd);
+        if (!err) {
+            ++xstats.small;
+        }
+        return (err);
+    }
+
+    sfd = ext_tmpfile();
+    if (sfd < 0 || (fp = fdopen(sfd, "w+")) == NULL) {
+        err = errno;
+        if (sfd >= 0) {
+            close(sfd);
+        }
+        dirbuf_free(db);
+        close(fd);
+        return (err);
+    }
+
+    runroom = 16;
+    runs = (struct ext_run *) mmv_alloc(runroom * sizeof (struct ext_run));
+    nruns = 0;
+    count = 0;
+    poolsize = 0;
+    for (;;) {
+        if (db->db_count != 0) {
+            if (nruns == runroom) {
+                runroom *= 2;
+                runs = (struct ext_run *) mmv_realloc(runs, runroom * sizeof (struct ext_run));
+            }
+            count += db->db_count;
+            ext_spill(db, fp, &runs[nruns++], &poolsize);
+        }
+        dirbuf_free(db);
+        if (eof) {
+            break;
+        }
+        err = ext_read_chunk(fd, db, &eof);
+        if (err) {
+            break;
+        }
+    }
+    close(fd);
+
+    if (err == 0 && (fflush(fp) != 0 || ferror(fp))) {
+        err = errno ? errno : EIO;
+    }
+    if (err == 0) {
+        err = ext_premerge(fp, runs, &nruns);
+    }
+    if (err == 0 && nruns != 0) {
+        err = ext_merge(fileno(fp), runs, nruns, count, poolsize, di, sticky);
+        *pdone = (err == 0);
+    }
+    fclose(fp);
+    free(runs);
+    return (err);
+}
+
+/**
+ * @brief Read a directory, only if it fits under the cap.
+ *
+ * @param fd  IN   Descriptor of a directory, open for reading
+ * @param db  OUT  Buffer of all directory entries
+ * @return errno-style status; EFBIG if the directory is too big
+ *
+ * This is for prefetch worker threads.  A directory that
+ * extdir_read() would send to external memory is not read, here;
+ * takedir() reads it, itself.  Running out of memory is returned
+ * as ENOMEM.  In any case, |fd| is closed.
+ *
+ */
+
+int
+extdir_read_small(int fd, dirbuf_t *db)
+{
+    bool eof;
+    int err;
+
+    if (ext_cap == 0) {
+        return (dirbuf_read_fd(fd, db));
+    }
+    err = dirbuf_read_chunk(fd, db, ext_cap / EXT_CHUNK_SHARE, &eof);
+    close(fd);
+    if (err == 0 && !eof) {
+        dirbuf_free(db);
+        err = EFBIG;
+    }
+    return (err);
+}
+
+void
+fdump_extdir_stats(FILE *f)
+{
+    if (ext_cap == 0) {
+        return;
+    }
+    fprintf(f, "extdir:\n");
+    fprintf(f, "    cap=%zu, dirs=%zu, small=%zu, runs=%zu, passes=%zu, entries=%zu, spilled=%zu\n",
+        ext_cap, xstats.dirs, xstats.small, xstats.runs, xstats.passes, xstats.entries, xstats.spilled);
+}
@@ -0,0 +1,227 @@
+/*
+ * Filename: src/libmmv/mmv-fsort.c
+ * Library: libmmv
+ * Brief: Sort filenames in strcmp() order, using inline prefix keys
+ *
+ * Description:
+ *   Sorting a directory with qsort() and a strcmp() callback costs
+ *   an indirect call and two pointer hops for every comparison.
+ *   Here, each name carries its first 8 bytes, as a big-endian
+ *   integer, right next to the name pointer.  Comparing two keys
+ *   gives the same answer as strcmp() on those 8 bytes, because
+ *   strcmp() compares unsigned bytes, and a name that ends early
+ *   is padded with 0 bytes, which sort lowest, just like the '\0'.
+ *
+ *   The keys are sorted with an MSD radix sort, one byte at a time.
+ *   Small groups, and groups of names that share all 8 bytes of
+ *   their key, are finished with a comparison sort that looks
+ *   at the rest of the name only when the keys are equal.
+ *
+ * Copyright (C) 2016 Guy Shaw
+ * Written by Guy Shaw <gshaw@acm.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>          // Import ENOMEM
+#include <stddef.h>         // Import size_t
+#include <stdio.h>          // Import type FILE
+#include <stdlib.h>         // Import free(), qsort()
+#include <string.h>         // Import memcpy(), memset(), strcmp()
+
+#define IMPORT_NAMEKEY
+#include <mmv-impl.h>
+
+/*
+ * Groups smaller than this are not worth a 256-way distribution.
+ */
+
+#define NAMEKEY_SMALL 32
+
+#define NAMEKEY_BYTES 8
+
+/**
+ * @brief Compute the key of at most the first |n| bytes of a name.
+ *
+ * @param name  IN  filename, or a literal prefix of one
+ * @param n     IN  number of bytes to use; more than 8 is the same as 8
+ * @return big-endian key, 0-padded
+ *
+ */
+
+uint64_t
+namekey_prefix(const char *name, size_t n)
+{
+    uint64_t key;
+    unsigned int i;
+
+    key = 0;
+    for (i = 0; i < NAMEKEY_BYTES && i < n && name[i] != '\0'; ++i) {
+        key |= (uint64_t)(unsigned char)name[i] << (56 - 8 * i);
+    }
+    return (key);
+}
+
+/**
+ * @brief Initialize a |namekey_t| for the given name.
+ *
+ * @param nk    OUT  key to set
+ * @param name  IN   filename; it must outlive the key
+ *
+ */
+
+void
+namekey_set(namekey_t *nk, const char *name)
+{
+    nk->nk_key = namekey_prefix(name, NAMEKEY_BYTES);
+    nk->nk_name = name;
+}
+
+/**
+ * @brief Compare two |namekey_t|s, with the same result as strcmp().
+ *
+ * The names themselves are looked at only if the keys are equal,
+ * and only if both names are longer than the key.
+ *
+ */
+
+static inline int
+nkcmp(const namekey_t *nk1, const namekey_t *nk2)
+{
+    if (nk1->nk_key != nk2->nk_key) {
+        return (nk1->nk_key < nk2->nk_key ? -1 : 1);
+    }
+    if ((nk1->nk_key & 0xff) == 0) {
+        return (0);
+    }
+    return (strcmp(nk1->nk_name + NAMEKEY_BYTES, nk2->nk_name + NAMEKEY_BYTES));
+}
+
+static int
+nkcmp_qsort(const void *vp1, const void *vp2)
+{
+    return (nkcmp((const namekey_t *)vp1, (const namekey_t *)vp2));
+}
+
+static void
+namekey_isort(namekey_t *vec, size_t n)
+{
+    namekey_t tmp;
+    size_t i, j;
+
+    for (i = 1; i < n; ++i) {
+        tmp = vec[i];
+        for (j = i; j > 0 && nkcmp(&tmp, &vec[j - 1]) < 0; --j) {
+            vec[j] = vec[j - 1];
+        }
+        vec[j] = tmp;
+    }
+}
+
+/**
+ * @brief MSD radix sort on byte |byte| of the key, and the bytes after it.
+ *
+ * @param vec   INOUT  keys to sort; they all agree on bytes before |byte|
+ * @param tmp   IN     scratch space for |n| keys
+ * @param n     IN     number of keys
+ * @param byte  IN     which byte of the key to distribute on, 0..7
+ *
+ * Recursion is at most |NAMEKEY_BYTES| deep.
+ *
+ */
+
+static void
+namekey_radix(namekey_t *vec, namekey_t *tmp, size_t n, unsigned int byte)
+{
+    size_t count[256];
+    size_t pos, i;
+    unsigned int shift, b;
+
+    if (n < NAMEKEY_SMALL) {
+        namekey_isort(vec, n);
+        return;
+    }
+
+    if (byte == NAMEKEY_BYTES) {
+        // All keys are equal, and all names go on past the key.
+        qsort(vec, n, sizeof (namekey_t), nkcmp_qsort);
+        return;
+    }
+
+    shift = 56 - 8 * byte;
+    memset(count, 0, sizeof (count));
+    for (i = 0; i < n; ++i) {
+        ++count[(vec[i].nk_key >> shift) & 0xff];
+    }
+
+    b = (vec[0].nk_key >> shift) & 0xff;
+    if (count[b] == n) {
+        // Common prefix; no need to move anything
+        if (b != 0) {
+            namekey_radix(vec, tmp, n, byte + 1);
+        }
+        return;
+    }
+
+    for (pos = 0, b = 0; b < 256; ++b) {
+        size_t c = count[b];
+        count[b] = pos;
+        pos += c;
+    }
+    for (i = 0; i < n; ++i) {
+        tmp[count[(vec[i].nk_key >> shift) & 0xff]++] = vec[i];
+    }
+    memcpy(vec, tmp, n * sizeof (namekey_t));
+
+    // Now, count[b] is the end of bucket b.
+    // Bucket 0 holds names that have already ended, so they are equal.
+    pos = count[0];
+    for (b = 1; b < 256; ++b) {
+        if (count[b] - pos > 1) {
+            namekey_radix(vec + pos, tmp + pos, count[b] - pos, byte + 1);
+        }
+        pos = count[b];
+    }
+}
+
+/**
+ * @brief Sort a vector of |namekey_t| in strcmp() order of name.
+ *
+ * @param vec  INOUT  keys to be sorted
+ * @param n    IN     number of keys
+ * @return 0, or ENOMEM, in which case |vec| is left as it was
+ *
+ * This may run in a prefetch worker thread, so running out of memory
+ * is left to the caller.
+ *
+ */
+
+int
+namekey_sort(namekey_t *vec, size_t n)
+{
+    namekey_t *tmp;
+
+    if (n < NAMEKEY_SMALL) {
+        namekey_isort(vec, n);
+        return (0);
+    }
+
+    tmp = (namekey_t *) mmv_try_alloc(n * sizeof (namekey_t));
+    if (tmp == NULL) {
+        return (ENOMEM);
+    }
+    namekey_radix(vec, tmp, n, 0);
+    free(tmp);
+    return (0);
+}
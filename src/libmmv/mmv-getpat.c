@@ -117,6 +117,13 @@ is_rescan(char *s, size_t sz)
     return (sz == 2 && (s[0] == '-' || s[0] == '=') && (s[1] == '>' || s[1] == '^'));
 }
 
+static void
+print_missing(mmv_t *mmv, void *arg)
+{
+    (void)arg;
+    printf("%s -> ? : missing replacement pattern.\n", mmv->from);
+}
+
 /**
  * @brief Get a { from->to } pair of patterns from stdin
  *
@@ -124,6 +131,27 @@ is_rescan(char *s, size_t sz)
 
 int
 getpat(mmv_t *mmv)
+{
+    return (getpat_cb(mmv, print_missing, NULL));
+}
+
+/**
+ * @brief Get a { from->to } pair of patterns from stdin; report bad lines.
+ *
+ * @param mmv
+ * @param missing  IN  called for each line that has a 'from' pattern,
+ *                     but no replacement pattern, while mmv->from
+ *                     still holds that 'from' pattern
+ * @param arg      IN  passed on to |missing|
+ * @return 1 if a pair was read, 0 at end of file
+ *
+ * This lets a caller that reads ahead, such as the parallel
+ * matching of pattern lists, say so in the right place.
+ *
+ */
+
+int
+getpat_cb(mmv_t *mmv, void (*missing)(mmv_t *mmv, void *arg), void *arg)
 {
     int c;
     bool gotit;
@@ -138,7 +166,7 @@ getpat(mmv_t *mmv)
 
         do {
             if ((mmv->tolen = getword(mmv->to, mmv->tosz)) == 0) {
-                printf("%s -> ? : missing replacement pattern.\n", mmv->from);
+                missing(mmv, arg);
                 goto nextline;
             }
             if (mmv->tolen >= mmv->tosz) {
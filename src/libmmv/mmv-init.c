@@ -69,8 +69,8 @@ mmv_state_init(mmv_t *mmv)
     mmv->to       = (char *)guard_malloc(MAXPATLEN);
     mmv->tosz     = MAXPATLEN;
 
-    mmv->pathbuf  = (char *)guard_malloc(PATH_MAX);
-    mmv->fullrep  = (char *)guard_malloc(PATH_MAX + 1);
+    mmv->pathbuf  = (char *)guard_malloc(MMV_PATH_MAX);
+    mmv->fullrep  = (char *)guard_malloc(MMV_PATH_MAX + 1);
 
     mmv->lastrep  = &mmv->hrep;
     mmv->aux      = NULL;
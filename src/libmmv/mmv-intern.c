@@ -0,0 +1,406 @@
+/*
+ * Filename: src/libmmv/mmv-intern.c
+ * Library: libmmv
+ * Brief: Intern filenames, and directory paths as chains of them
+ *
+ * Description:
+ *   Every |HANDLE| used to keep its own copy of the full path
+ *   of its directory, and every new target name was copied, too.
+ *   In a deep tree, or one with the same names over and over,
+ *   most of those bytes are the same few names, again and again.
+ *
+ *   Here, each distinct string is kept only once, in a table of
+ *   strings, with its length and hash, and is known by a 32-bit id.
+ *   A path is kept as a chain of { parent path, component } nodes,
+ *   also known by a 32-bit id, where a component is one name,
+ *   with the slashes that follow it.  So, "a/b/" is the node
+ *   { "a/", "b/" }, and "a/" is { "", "a/" }.  Joining the components
+ *   gives back exactly the same string, extra slashes and all.
+ *
+ *   Equal strings have equal ids, and equal paths have equal ids,
+ *   so comparing them is comparing two integers.
+ *
+ *   Id 0 is the empty string, and the empty path.
+ *   Entries are never removed.
+ *
+ *   Only the main thread uses these tables.
+ *
+ * Copyright (C) 2016 Guy Shaw
+ * Written by Guy Shaw <gshaw@acm.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>         // Import size_t
+#include <stdint.h>         // Import uint32_t, uint64_t
+#include <stdio.h>          // Import type FILE
+#include <stdlib.h>         // Import free()
+#include <string.h>         // Import memcmp(), memcpy(), memset(), strchr()
+
+#define IMPORT_PATTERN
+#define IMPORT_ALLOC
+#include <mmv-impl.h>
+
+#define INTERN_INITSIZE 256
+
+struct str_rec {
+    const char * s_name;    // nul-terminated copy
+    uint32_t     s_len;
+    uint32_t     s_hash;
+};
+
+struct path_rec {
+    uint32_t p_parent;      // Path id
+    uint32_t p_comp;        // String id
+    uint32_t p_len;         // Length of the whole path
+    uint32_t p_hash;        // Hash of { p_parent, p_comp }
+};
+
+/*
+ * Each table is an open-addressing hash table, with linear probing,
+ * of ids into the vector of records.  Slot value 0 means empty;
+ * id 0 is never put in a table, since "" is known without looking.
+ * A table is doubled before it gets more than half full.
+ */
+
+static struct str_rec *strs;
+static uint32_t nstrs;
+static uint32_t strs_room;
+static uint32_t *stab;
+static size_t stab_size;
+
+static struct path_rec *paths;
+static uint32_t npaths;
+static uint32_t paths_room;
+static uint32_t *ptab;
+static size_t ptab_size;
+
+struct intern_stats {
+    size_t s_lookups;
+    size_t s_bytes;         // Bytes of all distinct strings
+    size_t p_lookups;
+    size_t p_bytes;         // Bytes of all paths, if each were kept whole
+};
+
+static struct intern_stats istats;
+
+/**
+ * @brief Hash a string of known length (FNV-1a).
+ *
+ */
+
+static inline uint32_t
+str_hash(const char *s, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return ((uint32_t)(h ^ (h >> 32)));
+}
+
+/**
+ * @brief Hash a { parent, component } pair of ids.
+ *
+ */
+
+static inline uint32_t
+path_hash(uint32_t parent, uint32_t comp)
+{
+    uint64_t h;
+
+    h = (((uint64_t)parent << 32) | comp) * 0x9e3779b97f4a7c15ULL;
+    return ((uint32_t)(h >> 32));
+}
+
+static uint32_t *
+itab_new(size_t size)
+{
+    uint32_t *tab;
+
+    tab = (uint32_t *) mmv_alloc(size * sizeof (uint32_t));
+    memset(tab, 0, size * sizeof (uint32_t));
+    return (tab);
+}
+
+static void
+intern_init(void)
+{
+    strs_room = paths_room = INTERN_INITSIZE;
+    strs = (struct str_rec *) mmv_alloc(strs_room * sizeof (struct str_rec));
+    paths = (struct path_rec *) mmv_alloc(paths_room * sizeof (struct path_rec));
+    strs[0].s_name = "";
+    strs[0].s_len = 0;
+    strs[0].s_hash = 0;
+    paths[0].p_parent = 0;
+    paths[0].p_comp = 0;
+    paths[0].p_len = 0;
+    paths[0].p_hash = 0;
+    nstrs = npaths = 1;
+    stab_size = ptab_size = 2 * INTERN_INITSIZE;
+    stab = itab_new(stab_size);
+    ptab = itab_new(ptab_size);
+}
+
+/**
+ * @brief Double an id table, and re-insert every id but 0.
+ *
+ * @param ptab_   INOUT  the table
+ * @param psize   INOUT  its size
+ * @param n       IN     number of ids in use
+ * @param hashes  IN     hash of each id, |stride| bytes apart
+ *
+ */
+
+static void
+itab_grow(uint32_t **ptab_, size_t *psize, uint32_t n, const uint32_t *hashes, size_t stride)
+{
+    uint32_t *tab;
+    size_t size, mask, slot;
+    uint32_t id;
+
+    free(*ptab_);
+    size = *psize * 2;
+    tab = itab_new(size);
+    mask = size - 1;
+    for (id = 1; id < n; ++id) {
+        uint32_t h = *(const uint32_t *)((const char *)hashes + id * stride);
+
+        for (slot = h & mask; tab[slot] != 0; slot = (slot + 1) & mask) {
+            continue;
+        }
+        tab[slot] = id;
+    }
+    *ptab_ = tab;
+    *psize = size;
+}
+
+/**
+ * @brief Get the id of a string, adding it if it is new.
+ *
+ * @param s    IN  the string; it need not be nul-terminated
+ * @param len  IN  its length
+ * @return string id
+ *
+ */
+
+uint32_t
+str_intern(const char *s, size_t len)
+{
+    struct str_rec *sr;
+    size_t mask, slot;
+    uint32_t hash, id;
+    char *copy;
+
+    if (strs == NULL) {
+        intern_init();
+    }
+    if (len == 0) {
+        return (0);
+    }
+
+    ++istats.s_lookups;
+    hash = str_hash(s, len);
+    mask = stab_size - 1;
+    for (slot = hash & mask; (id = stab[slot]) != 0; slot = (slot + 1) & mask) {
+        sr = &strs[id];
+        if (sr->s_hash == hash && sr->s_len == len && memcmp(sr->s_name, s, len) == 0) {
+            return (id);
+        }
+    }
+
+    if (nstrs == strs_room) {
+        strs_room *= 2;
+        strs = (struct str_rec *) mmv_realloc(strs, strs_room * sizeof (struct str_rec));
+    }
+    copy = (char *) challoc(len + 1, 0);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    id = nstrs++;
+    sr = &strs[id];
+    sr->s_name = copy;
+    sr->s_len = len;
+    sr->s_hash = hash;
+    istats.s_bytes += len + 1;
+
+    stab[slot] = id;
+    if ((size_t)nstrs * 2 > stab_size) {
+        itab_grow(&stab, &stab_size, nstrs, &strs[0].s_hash, sizeof (struct str_rec));
+    }
+    return (id);
+}
+
+/**
+ * @brief Get the nul-terminated string with the given id.
+ *
+ */
+
+const char *
+str_name(uint32_t id)
+{
+    return (id == 0 ? "" : strs[id].s_name);
+}
+
+/**
+ * @brief Get the id of the path |parent| followed by string |comp|.
+ *
+ */
+
+static uint32_t
+path_child(uint32_t parent, uint32_t comp)
+{
+    struct path_rec *pr;
+    size_t mask, slot;
+    uint32_t hash, id;
+
+    hash = path_hash(parent, comp);
+    mask = ptab_size - 1;
+    for (slot = hash & mask; (id = ptab[slot]) != 0; slot = (slot + 1) & mask) {
+        pr = &paths[id];
+        if (pr->p_parent == parent && pr->p_comp == comp) {
+            return (id);
+        }
+    }
+
+    if (npaths == paths_room) {
+        paths_room *= 2;
+        paths = (struct path_rec *) mmv_realloc(paths, paths_room * sizeof (struct path_rec));
+    }
+    id = npaths++;
+    pr = &paths[id];
+    pr->p_parent = parent;
+    pr->p_comp = comp;
+    pr->p_len = paths[parent].p_len + strs[comp].s_len;
+    pr->p_hash = hash;
+    istats.p_bytes += pr->p_len + 1;
+
+    ptab[slot] = id;
+    if ((size_t)npaths * 2 > ptab_size) {
+        itab_grow(&ptab, &ptab_size, npaths, &paths[0].p_hash, sizeof (struct path_rec));
+    }
+    return (id);
+}
+
+/**
+ * @brief Get the id of a path, adding it, and any of its prefixes, if new.
+ *
+ * @param path  IN  nul-terminated path, spelled as |HANDLE| names are
+ * @return path id
+ *
+ */
+
+uint32_t
+path_intern(const char *path)
+{
+    const char *s, *e;
+    uint32_t id;
+
+    if (strs == NULL) {
+        intern_init();
+    }
+
+    ++istats.p_lookups;
+    id = 0;
+    for (s = path; *s != '\0'; s = e) {
+        e = strchr(s, SLASH);
+        if (e == NULL) {
+            e = s + strlen(s);
+        }
+        while (*e == SLASH) {
+            ++e;
+        }
+        id = path_child(id, str_intern(s, e - s));
+    }
+    return (id);
+}
+
+/**
+ * @brief Get the length of the path with the given id.
+ *
+ */
+
+size_t
+path_len(uint32_t id)
+{
+    return (id == 0 ? 0 : paths[id].p_len);
+}
+
+/**
+ * @brief Copy out a path, like memcpy(); no '\0' is added.
+ *
+ * @param id   IN   path id
+ * @param buf  OUT  where to copy it; it must have room for path_len(id)
+ * @return path_len(id)
+ *
+ */
+
+size_t
+path_copy(uint32_t id, char *buf)
+{
+    const struct str_rec *sr;
+    size_t len, pos;
+
+    if (id == 0) {
+        return (0);
+    }
+    len = pos = paths[id].p_len;
+    while (id != 0) {
+        sr = &strs[paths[id].p_comp];
+        pos -= sr->s_len;
+        memcpy(buf + pos, sr->s_name, sr->s_len);
+        id = paths[id].p_parent;
+    }
+    return (len);
+}
+
+/**
+ * @brief Copy out a path, as a nul-terminated string.
+ *
+ * @param id   IN   path id
+ * @param buf  OUT  where to copy it; it must have room for path_len(id) + 1
+ * @return |buf|
+ *
+ */
+
+char *
+path_str(uint32_t id, char *buf)
+{
+    buf[path_copy(id, buf)] = '\0';
+    return (buf);
+}
+
+/**
+ * @brief Print how many strings and paths there are, and what they cost.
+ *
+ * @param f  IN  Where to print
+ *
+ * text-bytes is the characters of the distinct strings, rec-bytes is
+ * the path records, and whole-bytes is what the same paths would take,
+ * if each were kept whole.
+ *
+ */
+
+void
+fdump_intern_stats(FILE *f)
+{
+    fprintf(f, "intern:\n");
+    fprintf(f, "    strings: n=%u, text-bytes=%zu, table=%zu, lookups=%zu\n",
+        nstrs, istats.s_bytes, stab_size, istats.s_lookups);
+    fprintf(f, "    paths:   n=%u, rec-bytes=%zu, table=%zu, lookups=%zu, whole-bytes=%zu\n",
+        npaths, npaths * sizeof (struct path_rec), ptab_size,
+        istats.p_lookups, istats.p_bytes);
+}
@@ -99,11 +99,21 @@ static char LINKNAME[]   = "mln";
 #if 0
 extern void mmv_set_default_options(mmv_t *mmv);
 extern int mmv_setopt(mmv_t *mmv, int opt);
+extern int mmv_setopt_arg(mmv_t *mmv, int opt, const char *arg);
 extern int getpat(mmv_t *mmv);
 #endif
 
 char USAGE[] =
-    "Usage: %s [-m|x|r|c|o|a|l] [-h] [-d|p] [-g|t] [-v|n] [from to]\n"
+    "Usage: %s [-m|x|r|c|o|a|l] [-h] [-d|p] [-g|t] [-v|n] [-P] [-O]\n"
+    "       [-E glob]... [-W depth] [from to]\n"
+    "\n"
+    "-P reads directory trees under a ``;'', and the starting directories\n"
+    "of patterns read from stdin, in parallel.\n"
+    "\n"
+    "-O keeps a ``;'' from descending into other filesystems.\n"
+    "-E glob keeps a ``;'' from descending into subdirectories whose\n"
+    "names match the glob; $MMV_PRUNE is a colon-separated list of more.\n"
+    "-W depth, or $MMV_WALK_MAXDEPTH, limits how many levels a ``;'' descends.\n"
     "\n"
     "Use =[l|u]N in the ``to'' pattern to get the [lowercase|uppercase of the]\n"
     "string matched by the N'th ``from'' pattern wildcard.\n"
@@ -122,6 +132,9 @@ extern uid_t uid, euid;
  * @param  ptopat    OUT  Set to the 'to'   pattern, if any
  * @return errno-style -- 0 == success, non-zero is some type of error
  *
+ * Options are set on top of whatever the caller has already set,
+ * starting from mmv_set_default_options().
+ *
  */
 
 int
@@ -130,8 +143,6 @@ procargs(mmv_t *mmv, int argc, char *const *argv, char **pfrompat, char **ptopat
     char *p;
     char *cmdname = argv[0];
 
-    mmv_set_default_options(mmv);
-
     // XXX Use GNU getopt() or getopt_long()
 
     for (--argc, ++argv; argc > 0 && **argv == '-'; --argc, ++argv) {
@@ -140,6 +151,25 @@ procargs(mmv_t *mmv, int argc, char *const *argv, char **pfrompat, char **ptopat
             int c;
 
             c = *p;
+            if (c == 'E' || c == 'W') {
+                // The argument is the rest of this word, or the next one
+                if (p[1] != '\0') {
+                    err = mmv_setopt_arg(mmv, c, p + 1);
+                }
+                else if (argc > 1) {
+                    --argc;
+                    ++argv;
+                    err = mmv_setopt_arg(mmv, c, *argv);
+                }
+                else {
+                    fprintf(stderr, "Option -%c needs an argument.\n", c);
+                    err = EINVAL;
+                }
+                if (err) {
+                    return (err);
+                }
+                break;
+            }
             err = mmv_setopt(mmv, c);
             if (err) {
                 return ((EINVAL << 8) + c);
@@ -0,0 +1,446 @@
+/*
+ * Filename: src/libmmv/mmv-multipat.c
+ * Library: libmmv
+ * Brief: Match a run of pattern lines against one directory, in one pass
+ *
+ * Description:
+ *   A pattern list often has many lines that all look in the same
+ *   directory, like  *.jpeg -> #1.jpg  then  *.tiff -> #1.tif,  and
+ *   so on.  Each line is matched on its own, in input order, so
+ *   each line scans the whole directory again, and tries every name.
+ *
+ *   Here, a run of such lines, all of one stage, with no ';',
+ *   in the same directory, is taken as a batch.  When the first line
+ *   of the batch gets to the directory, every name is scanned once,
+ *   and is handed to the first line, in input order, whose wildcards
+ *   it matches.  Each line then looks only at the names handed to it.
+ *   Only lines that start with a wildcard are worth batching;
+ *   a line with a literal prefix already looks at just the names
+ *   with that prefix, found by ffirst().
+ *
+ *   To keep that scan from trying every line on every name,
+ *   the lines are indexed by the last byte a name can have,
+ *   so a name ending in 'g' is not tried against *.tiff, and each
+ *   line also keeps a map of the first bytes it can take;
+ *   only the lines that pass both are given to pmatch_exec().
+ *
+ *   A name still goes to the first line that takes it, just as before.
+ *   If a line turns a name down, for a reason that is not in its
+ *   wildcards (because it is a directory, for example), the name is
+ *   handed on to the next line that matches it, before that line
+ *   gets its turn.  The names a line looks at are in directory order,
+ *   so the |REP| list comes out the same.
+ *
+ *   If the directory changes under the batch, by having an entry
+ *   added, the rest of the batch just goes back to scanning.
+ *
+ *   Only the main thread uses a batch.
+ *
+ * Copyright (C) 2016 Guy Shaw
+ * Written by Guy Shaw <gshaw@acm.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>         // Import size_t
+#include <stdint.h>         // Import uint64_t
+#include <stdio.h>          // Import type FILE
+#include <stdlib.h>         // Import free(), qsort()
+#include <string.h>         // Import memset(), strchr(), strcmp(), strrchr()
+#include <eprint.h>
+
+#define IMPORT_FILEINFO
+#define IMPORT_DIRINFO
+#define IMPORT_PATTERN
+#define IMPORT_ALLOC
+#define IMPORT_BACKREFS
+#include <mmv-impl.h>
+#include <mmv-impl-rep.h>
+#include <mmv-state.h>
+
+struct mp_line {
+    const char *   ml_stage;    // The wildcard component of 'from'
+    pmatch_t *     ml_pm;
+    uint64_t       ml_first[4]; // Bytes a matching name can start with
+    unsigned int * ml_cand;     // Indexes into |di_fils| handed to this line
+    size_t         ml_ncand;
+    size_t         ml_room;
+};
+
+struct multipat {
+    mmv_t *          mp_mmv;
+    struct mp_line * mp_lines;
+    size_t           mp_nlines;
+    size_t           mp_cur;        // Line being matched
+    size_t           mp_settled;    // Lines before this one have had their turn
+    unsigned int **  mp_bylast;     // By last byte: lines, in order, ending in mp_nlines
+    backref_t *      mp_bkref;      // Scratch, for pmatch_exec()
+    DIRINFO *        mp_di;         // Pinned, once scanned
+    FILEINFO **      mp_fils;
+    unsigned int     mp_nfils;
+    bool             mp_stale;      // The directory has changed; give up
+};
+
+struct multipat_stats {
+    size_t batches;
+    size_t lines;
+    size_t scanned;             // Names scanned, once for a whole batch
+    size_t tried;               // Calls to pmatch_exec() while scanning
+    size_t handed_on;           // Names turned down, and handed on
+    size_t stale;
+};
+
+static struct multipat_stats mstats;
+
+static multipat_t *cur_batch;
+
+static inline bool
+map_test(const uint64_t *map, unsigned char c)
+{
+    return ((map[c >> 6] >> (c & 63)) & 1);
+}
+
+/**
+ * @brief Can a 'from' pattern be part of a batch, and where does it look?
+ *
+ * @param from  IN   'from' pattern, as read
+ * @param dir   OUT  directory it starts in, as from pattern_start_dir()
+ * @return true if it can
+ *
+ * It must have one stage, in its last component, that starts
+ * with a wildcard, and has no ';', '!' or escapes, in a directory
+ * known without ~-expansion.
+ *
+ */
+
+bool
+multipat_batchable(const char *from, char *dir)
+{
+    const char *stage;
+    unsigned int depth;
+    bool walk;
+
+    if (!pattern_start_dir(from, dir, &depth, &walk) || depth != 0 || walk) {
+        return (false);
+    }
+    stage = strrchr(from, SLASH);
+    stage = (stage == NULL) ? from : stage + 1;
+    if (*stage == '\0' || strchr("*?[", *stage) == NULL) {
+        return (false);
+    }
+    if (strchr(stage, ';') != NULL || strchr(stage, '!') != NULL || strchr(stage, ESC) != NULL) {
+        return (false);
+    }
+    return (true);
+}
+
+/**
+ * @brief Compile a batch of pattern lines.
+ *
+ * @param mmv
+ * @param froms  IN  'from' patterns, in input order, all batchable,
+ *                   all in the same directory; they must outlive the batch
+ * @param n      IN  number of them
+ * @return the batch, or NULL if any of them does not compile
+ *
+ */
+
+multipat_t *
+multipat_new(mmv_t *mmv, char *const *froms, size_t n)
+{
+    multipat_t *mp;
+    struct mp_line *ml;
+    uint64_t first[4], last[4];
+    size_t counts[256];
+    size_t i, maxlen;
+    unsigned int b;
+
+    mp = (multipat_t *) mmv_alloc(sizeof (multipat_t));
+    memset(mp, 0, sizeof (multipat_t));
+    mp->mp_mmv = mmv;
+    mp->mp_lines = (struct mp_line *) mmv_alloc(n * sizeof (struct mp_line));
+    memset(mp->mp_lines, 0, n * sizeof (struct mp_line));
+    mp->mp_nlines = n;
+
+    memset(counts, 0, sizeof (counts));
+    maxlen = 0;
+    for (i = 0; i < n; ++i) {
+        ml = &mp->mp_lines[i];
+        ml->ml_stage = strrchr(froms[i], SLASH);
+        ml->ml_stage = (ml->ml_stage == NULL) ? froms[i] : ml->ml_stage + 1;
+        ml->ml_pm = pmatch_compile(ml->ml_stage);
+        if (ml->ml_pm == NULL) {
+            multipat_free(mp);
+            return (NULL);
+        }
+        if (strlen(ml->ml_stage) > maxlen) {
+            maxlen = strlen(ml->ml_stage);
+        }
+        pmatch_end_bytes(ml->ml_pm, ml->ml_first, last);
+        for (b = 0; b < 256; ++b) {
+            counts[b] += map_test(last, b);
+        }
+    }
+
+    mp->mp_bylast = (unsigned int **) mmv_alloc(256 * sizeof (unsigned int *));
+    for (b = 0; b < 256; ++b) {
+        mp->mp_bylast[b] = (unsigned int *) mmv_alloc((counts[b] + 1) * sizeof (unsigned int));
+        counts[b] = 0;
+    }
+    for (i = 0; i < n; ++i) {
+        pmatch_end_bytes(mp->mp_lines[i].ml_pm, first, last);
+        for (b = 0; b < 256; ++b) {
+            if (map_test(last, b)) {
+                mp->mp_bylast[b][counts[b]++] = i;
+            }
+        }
+    }
+    for (b = 0; b < 256; ++b) {
+        mp->mp_bylast[b][counts[b]] = n;
+    }
+
+    mp->mp_bkref = (backref_t *) mmv_alloc((maxlen + 1) * sizeof (backref_t));
+    ++mstats.batches;
+    mstats.lines += n;
+    return (mp);
+}
+
+/**
+ * @brief Release a batch, and the directory it holds.
+ *
+ */
+
+void
+multipat_free(multipat_t *mp)
+{
+    size_t i;
+    unsigned int b;
+
+    if (mp == NULL) {
+        return;
+    }
+    if (cur_batch == mp) {
+        cur_batch = NULL;
+    }
+    if (mp->mp_di != NULL) {
+        dir_unpin(mp->mp_di);
+    }
+    for (i = 0; i < mp->mp_nlines; ++i) {
+        pmatch_free(mp->mp_lines[i].ml_pm);
+        free(mp->mp_lines[i].ml_cand);
+    }
+    if (mp->mp_bylast != NULL) {
+        for (b = 0; b < 256; ++b) {
+            free(mp->mp_bylast[b]);
+        }
+        free(mp->mp_bylast);
+    }
+    free(mp->mp_bkref);
+    free(mp->mp_lines);
+    free(mp);
+}
+
+/**
+ * @brief Say which line of a batch is about to be matched by matchpat().
+ *
+ * @param mp  IN  the batch, or NULL for none
+ * @param k   IN  index of the line, in the batch
+ *
+ */
+
+void
+multipat_select(multipat_t *mp, size_t k)
+{
+    cur_batch = mp;
+    if (mp != NULL) {
+        mp->mp_cur = k;
+    }
+}
+
+/**
+ * @brief Does a name match line |k|, as trymatch() and stage_match() would?
+ *
+ * Whether the name has been taken already is not looked at.
+ *
+ */
+
+static bool
+line_matches(multipat_t *mp, size_t k, FILEINFO *f)
+{
+    struct mp_line *ml = &mp->mp_lines[k];
+    char *p = f->fi_name;
+
+    if (*p == '.') {
+        if (p[1] == '\0' || (p[1] == '.' && p[2] == '\0')) {
+            return (strcmp(ml->ml_stage, p) == 0);
+        }
+        else if (!mp->mp_mmv->matchall && *ml->ml_stage != '.') {
+            return (false);
+        }
+    }
+    if (!map_test(ml->ml_first, (unsigned char)p[0])) {
+        return (false);
+    }
+    ++mstats.tried;
+    return (pmatch_exec(ml->ml_pm, p, p + f->fi_len, mp->mp_bkref));
+}
+
+/**
+ * @brief Find the first line, at or after |from|, that a name matches.
+ *
+ * @return index of the line, or mp_nlines if none
+ *
+ */
+
+static size_t
+first_line(multipat_t *mp, size_t from, FILEINFO *f)
+{
+    const unsigned int *lp;
+
+    if (f->fi_len == 0) {
+        return (mp->mp_nlines);
+    }
+    for (lp = mp->mp_bylast[(unsigned char)f->fi_name[f->fi_len - 1]]; *lp < mp->mp_nlines; ++lp) {
+        if (*lp >= from && line_matches(mp, *lp, f)) {
+            return (*lp);
+        }
+    }
+    return (mp->mp_nlines);
+}
+
+static void
+hand_to(multipat_t *mp, size_t k, unsigned int idx)
+{
+    struct mp_line *ml = &mp->mp_lines[k];
+
+    if (ml->ml_ncand == ml->ml_room) {
+        ml->ml_room = ml->ml_room ? ml->ml_room * 2 : 16;
+        ml->ml_cand = (unsigned int *) mmv_realloc(ml->ml_cand, ml->ml_room * sizeof (unsigned int));
+    }
+    ml->ml_cand[ml->ml_ncand++] = idx;
+}
+
+static int
+idxcmp(const void *vp1, const void *vp2)
+{
+    unsigned int i1 = *(const unsigned int *)vp1;
+    unsigned int i2 = *(const unsigned int *)vp2;
+
+    return (i1 < i2 ? -1 : i1 > i2);
+}
+
+/**
+ * @brief Scan a directory once, and hand each name to its first line.
+ *
+ */
+
+static void
+batch_scan(multipat_t *mp, DIRINFO *di)
+{
+    FILEINFO *f;
+    unsigned int i;
+    size_t k;
+
+    dir_pin(di);
+    mp->mp_di = di;
+    mp->mp_fils = di->di_fils;
+    mp->mp_nfils = di->di_nfils;
+    for (i = 0; i < di->di_nfils; ++i) {
+        f = di->di_fils[i];
+        if (f->fi_rep != NULL) {
+            continue;
+        }
+        ++mstats.scanned;
+        k = first_line(mp, mp->mp_cur, f);
+        if (k < mp->mp_nlines) {
+            hand_to(mp, k, i);
+        }
+    }
+    mp->mp_settled = mp->mp_cur;
+}
+
+/**
+ * @brief Get the names that the line being matched should look at.
+ *
+ * @param di   IN   the directory the line is about to be matched in
+ * @param pn   OUT  number of names
+ * @return indexes into |di->di_fils|, in directory order,
+ *         or NULL if the line must look at every name, as usual
+ *
+ * The names that earlier lines had, and did not take,
+ * are handed on to the next line that matches them, first.
+ *
+ */
+
+const unsigned int *
+multipat_candidates(DIRINFO *di, size_t *pn)
+{
+    multipat_t *mp = cur_batch;
+    struct mp_line *ml;
+    FILEINFO *f;
+    size_t j, i, k;
+
+    if (mp == NULL || mp->mp_stale) {
+        return (NULL);
+    }
+    if (mp->mp_di == NULL) {
+        batch_scan(mp, di);
+    }
+    else if (mp->mp_di != di || mp->mp_fils != di->di_fils || mp->mp_nfils != di->di_nfils) {
+        mp->mp_stale = true;
+        ++mstats.stale;
+        return (NULL);
+    }
+
+    for (j = mp->mp_settled; j < mp->mp_cur; ++j) {
+        ml = &mp->mp_lines[j];
+        for (i = 0; i < ml->ml_ncand; ++i) {
+            f = di->di_fils[ml->ml_cand[i]];
+            if (f->fi_rep != NULL) {
+                continue;
+            }
+            k = first_line(mp, j + 1, f);
+            if (k < mp->mp_nlines) {
+                hand_to(mp, k, ml->ml_cand[i]);
+                ++mstats.handed_on;
+            }
+        }
+        ml->ml_ncand = 0;
+    }
+    mp->mp_settled = mp->mp_cur;
+
+    ml = &mp->mp_lines[mp->mp_cur];
+    if (ml->ml_ncand > 1) {
+        qsort(ml->ml_cand, ml->ml_ncand, sizeof (unsigned int), idxcmp);
+    }
+    *pn = ml->ml_ncand;
+    return (ml->ml_cand);
+}
+
+/**
+ * @brief Print how much batching of pattern lines there was.
+ *
+ * @param f  IN  Where to print
+ *
+ */
+
+void
+fdump_multipat_stats(FILE *f)
+{
+    fprintf(f, "multipat:\n");
+    fprintf(f, "    batches=%zu, lines=%zu, scanned=%zu, tried=%zu, handed-on=%zu, stale=%zu\n",
+        mstats.batches, mstats.lines, mstats.scanned, mstats.tried,
+        mstats.handed_on, mstats.stale);
+}
@@ -72,16 +72,11 @@ typedef struct dirent DIRENTRY;
 #define even(n) (((n) & 1) == 0)
 #define odd(n)  (((n) & 1) != 0)
 
-static inline bool
-streq(const char *s1, const char *s2)
-{
-    return (strcmp(s1, s2) == 0);
-}
-
 extern char *ask_string(const char *prompt, char *buf, size_t bufsz);
 extern int ask_yesno(const char *prompt, int failact);
 extern int mmv_copy(mmv_t *mmv, FILEINFO *f, size_t len);
 extern int mmv_unlink(char *fname);
+extern int mmv_unlinkat(int dfd, const char *name, const char *fname);
 extern void eprint_filename(char *fname);
 extern void eexplain_err(int err);
 
@@ -97,6 +92,7 @@ static char TEMP[] = "$$mmvtmp.";
  *  @return  { negative , 0 , positive } int, suitable for qsort().
  *
  *  Comparison is by dto, then nto, then by rd_i.
+ *  Names are interned, so nto is compared by id, not spelling.
  */
 
 static int
@@ -106,10 +102,36 @@ rdcmp(const void *vp1, const void *vp2)
     const REPDICT *rd2 = (const REPDICT *)vp2;
     int ret;
 
-    ret = rd1->rd_dto - rd2->rd_dto;
+    // Pointer difference does not fit in an int, in general.
+    ret = (rd1->rd_dto > rd2->rd_dto) - (rd1->rd_dto < rd2->rd_dto);
+
+    if (ret == 0) {
+        ret = (rd1->rd_nto > rd2->rd_nto) - (rd1->rd_nto < rd2->rd_nto);
+    }
+    if (ret == 0) {
+        ret = rd1->rd_i - rd2->rd_i;
+    }
+    return (ret);
+}
+
+/**
+ * @brief Compare 2 REPDICT structures, as rdcmp(), but nto by spelling.
+ *
+ * Collisions are reported in this order.
+ *
+ */
+
+static int
+rdcmp_name(const void *vp1, const void *vp2)
+{
+    const REPDICT *rd1 = (const REPDICT *)vp1;
+    const REPDICT *rd2 = (const REPDICT *)vp2;
+    int ret;
+
+    ret = (rd1->rd_dto > rd2->rd_dto) - (rd1->rd_dto < rd2->rd_dto);
 
     if (ret == 0) {
-        ret = strcmp(rd1->rd_nto, rd2->rd_nto);
+        ret = strcmp(str_name(rd1->rd_nto), str_name(rd2->rd_nto));
     }
     if (ret == 0) {
         ret = rd1->rd_i - rd2->rd_i;
@@ -124,7 +146,7 @@ rdcmp(const void *vp1, const void *vp2)
 static bool
 rd_same_target(const REPDICT *rd1, const REPDICT *rd2)
 {
-    return (rd1->rd_dto == rd2->rd_dto && streq(rd1->rd_nto, rd2->rd_nto));
+    return (rd1->rd_dto == rd2->rd_dto && rd1->rd_nto == rd2->rd_nto);
 }
 
 /**
@@ -194,23 +216,51 @@ mark_collision(mmv_t *mmv, REPDICT *rd)
  * Sort the array so that checking for duplicates is as easy
  * as comparing two consecutive array elements.
  *
+ * The sort compares only integers.  Collisions are rare, so only
+ * the entries that do collide are sorted again by name, so that
+ * they are reported in order of the spelling of their targets.
+ *
  */
 
 static void
 check_duplicates(mmv_t *mmv, REPDICT *rd)
 {
-    REPDICT *prd;
+    char hnf[MMV_PATH_MAX + 1];
+    char hnt[MMV_PATH_MAX + 1];
+    REPDICT *coll, *prd;
+    size_t coll_size;
     int oldnreps;
+    int ncoll;
     int mult;
     int i;
 
     qsort(rd, mmv->nreps, sizeof (REPDICT), rdcmp);
 
+    ncoll = 0;
+    for (i = 0; i < mmv->nreps - 1; ++i) {
+        if (rd_same_target(&rd[i], &rd[i + 1])) {
+            ncoll += (i == 0 || !rd_same_target(&rd[i - 1], &rd[i])) ? 2 : 1;
+        }
+    }
+    if (ncoll == 0) {
+        return;
+    }
+    coll_size = ncoll * sizeof (REPDICT);
+    coll = (REPDICT *) mmv_alloc(coll_size);
+    for (i = 0, prd = coll; i < mmv->nreps; ++i) {
+        if ((i > 0 && rd_same_target(&rd[i - 1], &rd[i]))
+            || (i < mmv->nreps - 1 && rd_same_target(&rd[i], &rd[i + 1]))) {
+            *prd++ = rd[i];
+        }
+    }
+    qsort(coll, ncoll, sizeof (REPDICT), rdcmp_name);
+
     /*
      * nreps can change while we are checking for collisions,
-     * so keep the old value to tell how many elements to visit.
+     * so keep the count of colliding entries to tell how many
+     * elements to visit.
      */
-    oldnreps = mmv->nreps;
+    oldnreps = ncoll;
 
     /*
      * Scan the entire sorted REPDICT array, visiting and comparing each pair.
@@ -224,7 +274,7 @@ check_duplicates(mmv_t *mmv, REPDICT *rd)
      * to visit the last element in the array.
      */
     mult = 0;
-    for (i = 0, prd = rd; i < oldnreps; ++prd, ++i) {
+    for (i = 0, prd = coll; i < oldnreps; ++prd, ++i) {
         if (i < oldnreps - 1 && rd_same_target(prd, prd + 1)) {
             /*
              * A pair have the same target
@@ -238,7 +288,7 @@ check_duplicates(mmv_t *mmv, REPDICT *rd)
                 printf(" , ");
             }
             printf("%s%s",
-                prd->rd_p->r_hfrom->h_name,
+                path_str(prd->rd_p->r_hfrom->h_path, hnf),
                 prd->rd_p->r_ffrom->fi_name);
             mark_collision(mmv, prd);
         } else if (mult) {
@@ -252,14 +302,15 @@ check_duplicates(mmv_t *mmv, REPDICT *rd)
              * to all the { source name , target name } pairs.
              */
             printf(" , %s%s -> %s%s : collision.\n",
-                   prd->rd_p->r_hfrom->h_name,
+                   path_str(prd->rd_p->r_hfrom->h_path, hnf),
                    prd->rd_p->r_ffrom->fi_name,
-                   prd->rd_p->r_hto->h_name,
-                   prd->rd_nto);
+                   path_str(prd->rd_p->r_hto->h_path, hnt),
+                   str_name(prd->rd_nto));
             mark_collision(mmv, prd);
             mult = 0;
         }
     }
+    chgive(coll, coll_size);
 }
 
 /**
@@ -345,10 +396,12 @@ findorder(mmv_t *mmv)
 static void
 printchain(mmv_t *mmv, REP *p)
 {
+    char hnf[MMV_PATH_MAX + 1];
+
     if (p->r_thendo != NULL) {
         printchain(mmv, p->r_thendo);
     }
-    printf("%s%s -> ", p->r_hfrom->h_name, p->r_ffrom->fi_name);
+    printf("%s%s -> ", path_str(p->r_hfrom->h_path, hnf), p->r_ffrom->fi_name);
     ++mmv->badreps;
     --mmv->nreps;
     p->r_ffrom->fi_rep = &mmv->mistake;
@@ -362,13 +415,14 @@ printchain(mmv_t *mmv, REP *p)
 static void
 nochains(mmv_t *mmv)
 {
+    char hnt[MMV_PATH_MAX + 1];
     REP *p, *q;
 
     for (q = &mmv->hrep, p = q->r_next; p != NULL; q = p, p = p->r_next) {
         if (p->r_flags & R_ISCYCLE || p->r_thendo != NULL) {
             printchain(mmv, p);
             printf("%s%s : no chain copies allowed.\n",
-                p->r_hto->h_name, p->r_nto);
+                path_str(p->r_hto->h_path, hnt), str_name(p->r_nto));
             q->r_next = p->r_next;
             p = q;
         }
@@ -422,17 +476,23 @@ scandeletes(mmv_t *mmv, int (*pkilldel) (mmv_t *, REP *))
  */
 
 static int
-fwritable(mmv_t *mmv, const char *hname, FILEINFO *f)
+fwritable(mmv_t *mmv, HANDLE *h, FILEINFO *f)
 {
     unsigned int r;
+    int dfd;
 
     if (f->fi_stflags & FI_KNOWWRITE) {
         return ((f->fi_stflags & FI_CANWRITE) != 0);
     }
 
-    strcpy(mmv->fullrep, hname);
-    strcat(mmv->fullrep, f->fi_name);
-    r = !access(mmv->fullrep, W_OK) ? FI_CANWRITE : 0;
+    dfd = handle_fd(h);
+    if (dfd >= 0) {
+        r = !faccessat(dfd, f->fi_name, W_OK, 0) ? FI_CANWRITE : 0;
+    }
+    else {
+        strcpy(mmv->fullrep + path_copy(h->h_path, mmv->fullrep), f->fi_name);
+        r = !access(mmv->fullrep, W_OK) ? FI_CANWRITE : 0;
+    }
     f->fi_stflags |= FI_KNOWWRITE | r;
     return (r != 0);
 }
@@ -451,7 +511,11 @@ baddel(mmv_t *mmv, REP *p)
     HANDLE *hfrom = p->r_hfrom, *hto = p->r_hto;
     FILEINFO *fto = p->r_fdel;
     char *t = fto->fi_name, *f = p->r_ffrom->fi_name;
-    char *hnf = hfrom->h_name, *hnt = hto->h_name;
+    char hnf[MMV_PATH_MAX + 1];
+    char hnt[MMV_PATH_MAX + 1];
+
+    path_str(hfrom->h_path, hnf);
+    path_str(hto->h_path, hnt);
 
     if (mmv->delstyle == NODEL && !(p->r_flags & R_DELOK) && !(mmv->op & APPEND)) {
         printf("%s%s -> %s%s : old %s%s would have to be %s.\n",
@@ -470,7 +534,7 @@ baddel(mmv_t *mmv, REP *p)
         printf("%s%s -> %s%s : old %s%s lacks delete permission.\n",
             hnf, f, hnt, t, hnt, t);
     }
-    else if ((mmv->op & (APPEND | OVERWRITE)) && !fwritable(mmv, hnt, fto)) {
+    else if ((mmv->op & (APPEND | OVERWRITE)) && !fwritable(mmv, hto, fto)) {
         printf("%s%s -> %s%s : %s%s %s.\n",
             hnf, f, hnt, t, hnt, t, "lacks write permission");
     }
@@ -494,22 +558,27 @@ baddel(mmv_t *mmv, REP *p)
 static int
 skipdel(mmv_t *mmv, REP *p)
 {
+    char hnf[MMV_PATH_MAX + 1];
+    char hnt[MMV_PATH_MAX + 1];
+
     if (p->r_flags & R_DELOK) {
         return (0);
     }
 
+    path_str(p->r_hfrom->h_path, hnf);
+    path_str(p->r_hto->h_path, hnt);
     eprintf("%s%s -> %s%s : ",
-        p->r_hfrom->h_name, p->r_ffrom->fi_name, p->r_hto->h_name, p->r_nto);
+        hnf, p->r_ffrom->fi_name, hnt, str_name(p->r_nto));
 
-    if (!fwritable(mmv, p->r_hto->h_name, p->r_fdel)) {
+    if (!fwritable(mmv, p->r_hto, p->r_fdel)) {
         eprintf("old %s%s lacks write permission. delete it",
-            p->r_hto->h_name, p->r_nto);
+            hnt, str_name(p->r_nto));
     }
     else {
         eprintf("%s old %s%s",
             (mmv->op & OVERWRITE) ? "overwrite" : "delete",
-            p->r_hto->h_name,
-            p->r_nto);
+            hnt,
+            str_name(p->r_nto));
     }
     return (!ask_yesno("? ", -1));
 }
@@ -552,14 +621,16 @@ goonordie(mmv_t *mmv)
 static void
 fshow_done_rep(FILE *f, mmv_t *mmv, REP *p)
 {
-    fprint_filename(f, p->r_hfrom->h_name);
+    char hn[MMV_PATH_MAX + 1];
+
+    fprint_filename(f, path_str(p->r_hfrom->h_path, hn));
     fprint_filename(f, p->r_ffrom->fi_name);
 
     fprintf(f, " %c%c ",
         p->r_flags & R_ISALIASED ? '=' : '-',
         p->r_flags & R_ISCYCLE ? '^' : '>');
-    fprint_filename(f, p->r_hto->h_name);
-    fprintf(f, "%s : done", p->r_nto);
+    fprint_filename(f, path_str(p->r_hto->h_path, hn));
+    fprintf(f, "%s : done", str_name(p->r_nto));
     if (p->r_fdel != NULL && !(mmv->op & APPEND)) {
         fputs(" (*)", f);
     }
@@ -648,43 +719,6 @@ snap(mmv_t *mmv, REP *first, REP *p)
     return (first != p);
 }
 
-/**
- * @brief Search for a given simple filename in a directory of |FILEINFO|s.
- *
- * @param s  IN   filename to find
- * @param d  IN   directory of |FILEINFO|
- * @return  FILEINFO of found filename, or NULL if not found
- *
- * Method:
- *   |FILEINFO| structures in a |DIRINFO| are sorted by name,
- *   so we can do a binary search, not just a linear search.
- *
- */
-
-static FILEINFO *
-fsearch(const char *s, DIRINFO *d)
-{
-    FILEINFO **fils = d->di_fils;
-    int nfils = d->di_nfils;
-    int first, k, last, res;
-
-    for (first = 0, last = nfils - 1; ; ) {
-        if (last < first) {
-            return (NULL);
-        }
-        k = (first + last) >> 1;
-        if ((res = strcmp(s, fils[k]->fi_name)) == 0) {
-            return (fils[k]);
-        }
-        if (res < 0) {
-            last = k - 1;
-        }
-        else {
-            first = k + 1;
-        }
-    }
-}
-
 /**
  * @brief Construct a unique (not existing) temporary filename
  *
@@ -731,14 +765,24 @@ make_alias_fname(mmv_t *mmv, REP *p)
 static int
 movealias(mmv_t *mmv, REP *first, REP *p, int *pprintaliased)
 {
+    const char *from;
+    const char *to;
+    size_t hlen;
+    int dfd;
     int seq;
     int rv;
     int err;
 
-    strcpy(mmv->pathbuf, p->r_hto->h_name);
+    path_str(p->r_hto->h_path, mmv->pathbuf);
+    hlen = path_len(p->r_hto->h_path);
     seq = make_alias_fname(mmv, p);
-    rv = rename(mmv->fullrep, mmv->pathbuf);
-    if (rv) {
+    dfd = handle_at(p->r_hto, str_name(p->r_nto), mmv->fullrep, &from);
+    to = (dfd == AT_FDCWD) ? mmv->pathbuf : mmv->pathbuf + hlen;
+    rv = renameat(dfd, from, dfd, to);
+    if (rv == 0) {
+        dirfd_moved(p->r_fdel);
+    }
+    else {
         err = errno;
         eprint_filename(mmv->fullrep);
         fputs(" -> ", stderr);
@@ -765,9 +809,12 @@ static size_t
 appendalias(mmv_t *mmv, REP *first, REP *p, int *pprintaliased)
 {
     struct stat fstat;
+    const char *name;
     size_t ret = SIZE_UNLIMITED;
+    int dfd;
 
-    if (stat(mmv->fullrep, &fstat)) {
+    dfd = handle_at(p->r_hto, str_name(p->r_nto), mmv->fullrep, &name);
+    if (fstatat(dfd, name, &fstat, 0)) {
         eprintf("append cycle stat on '%s' has failed.\n", mmv->fullrep);
         *pprintaliased = snap(mmv, first, p);
     }
@@ -782,7 +829,9 @@ appendalias(mmv_t *mmv, REP *first, REP *p, int *pprintaliased)
  * @brief Copy one file to another, and if successful, remove the original.
  *
  * @param mmv
- * @param p   IN |REP| specifying source and destination
+ * @param p      IN |REP| specifying source and destination
+ * @param ffd    IN descriptor of the source directory, or AT_FDCWD
+ * @param fname  IN source, relative to |ffd|
  * @return status
  *
  * This copy-then-move is needed in cases where rename() does not work,
@@ -791,9 +840,9 @@ appendalias(mmv_t *mmv, REP *first, REP *p, int *pprintaliased)
  */
 
 static int
-copymove(mmv_t *mmv, REP *p)
+copymove(mmv_t *mmv, REP *p, int ffd, const char *fname)
 {
-    return (mmv_copy(mmv, p->r_ffrom, -1) || mmv_unlink(mmv->pathbuf));
+    return (mmv_copy(mmv, p->r_ffrom, -1) || mmv_unlinkat(ffd, fname, mmv->pathbuf));
 }
 
 
@@ -837,16 +886,27 @@ typedef struct syscall_status sc_status_t;
  * @param stp       OUT  ^{ return-value, errno, name } returned by system call
  * @param aliaslen  IN   Needed only for copy or append with an aliased file
  *
+ * The source is |mmv->pathbuf| and the destination is |mmv->fullrep|,
+ * but the system calls are made relative to the directory descriptors
+ * of |r_hfrom| and |r_hto|, when they can be had.
+ *
  */
 
 void
 do_move_pair(mmv_t *mmv, REP *p, sc_status_t *stp, size_t aliaslen)
 {
+    const char *fname;
+    const char *tname;
+    int ffd, tfd;
     int rv;
 
     if (p->r_fdel != NULL && !(mmv->op & (APPEND | OVERWRITE))) {
         stp->sc_name = "unlink";
-        rv = mmv_unlink(mmv->fullrep);
+        tfd = handle_at(p->r_hto, str_name(p->r_nto), mmv->fullrep, &tname);
+        rv = mmv_unlinkat(tfd, tname, mmv->fullrep);
+        if (rv == 0) {
+            dirfd_moved(p->r_fdel);
+        }
         if (rv) {
             stp->err = errno;
             fputs("unlink('", stderr);
@@ -858,6 +918,10 @@ do_move_pair(mmv_t *mmv, REP *p, sc_status_t *stp, size_t aliaslen)
         }
     }
 
+    // Look up descriptors only after the unlink, which may flush them.
+    ffd = handle_at(p->r_hfrom, mmv->pathbuf + path_len(p->r_hfrom->h_path), mmv->pathbuf, &fname);
+    tfd = handle_at(p->r_hto, str_name(p->r_nto), mmv->fullrep, &tname);
+
     if (mmv->op & (COPY | APPEND)) {
         size_t copy_len;
 
@@ -867,19 +931,22 @@ do_move_pair(mmv_t *mmv, REP *p, sc_status_t *stp, size_t aliaslen)
     }
     else if (mmv->op & HARDLINK) {
         stp->sc_name = "link";
-        rv = link(mmv->pathbuf, mmv->fullrep);
+        rv = linkat(ffd, fname, tfd, tname, 0);
     }
     else if (mmv->op & SYMLINK) {
         stp->sc_name = "symlink";
-        rv = symlink(mmv->pathbuf, mmv->fullrep);
+        rv = symlinkat(mmv->pathbuf, tfd, tname);
     }
     else if (p->r_flags & R_ISX) {
         stp->sc_name = "copymove";
-        rv = copymove(mmv, p);
+        rv = copymove(mmv, p, ffd, fname);
     }
     else {
         stp->sc_name = "rename";
-        rv = rename(mmv->pathbuf, mmv->fullrep);
+        rv = renameat(ffd, fname, tfd, tname);
+        if (rv == 0) {
+            dirfd_moved(p->r_ffrom);
+        }
     }
 
     stp->err = rv ? errno : 0;
@@ -919,8 +986,7 @@ doreps(mmv_t *mmv)
                 printaliased = snap(mmv, first, p);
                 gotsig = 0;
             }
-            strcpy(mmv->fullrep, p->r_hto->h_name);
-            strcat(mmv->fullrep, p->r_nto);
+            strcpy(mmv->fullrep + path_copy(p->r_hto->h_path, mmv->fullrep), str_name(p->r_nto));
             if (!mmv->noex && (p->r_flags & R_ISCYCLE)) {
                 if (mmv->op & APPEND) {
                     aliaslen = appendalias(mmv, first, p, &printaliased);
@@ -929,8 +995,7 @@ doreps(mmv_t *mmv)
                     alias = movealias(mmv, first, p, &printaliased);
                 }
             }
-            strcpy(mmv->pathbuf, p->r_hfrom->h_name);
-            fstart = mmv->pathbuf + strlen(mmv->pathbuf);
+            fstart = mmv->pathbuf + path_copy(p->r_hfrom->h_path, mmv->pathbuf);
             if ((p->r_flags & R_ISALIASED) && !(mmv->op & APPEND)) {
                 sprintf(fstart, "%s%03d", TEMP, alias);
             }
@@ -997,6 +1062,18 @@ doreps(mmv_t *mmv)
 int
 mmv_execute(mmv_t *mmv)
 {
+    if (dbgprint_fh) {
+        fdump_dircache_stats(dbgprint_fh);
+        fdump_intern_stats(dbgprint_fh);
+        fdump_pmatch_stats(dbgprint_fh);
+        fdump_multipat_stats(dbgprint_fh);
+        fdump_prefetch_stats(dbgprint_fh);
+        fdump_statx_stats(dbgprint_fh);
+        fdump_snapcache_stats(dbgprint_fh);
+        fdump_extdir_stats(dbgprint_fh);
+        fdump_perm_stats(dbgprint_fh);
+    }
+
     if (!(mmv->op & APPEND)) {
         check_collisions(mmv);
     }
@@ -1011,13 +1088,18 @@ mmv_execute(mmv_t *mmv)
         scandeletes(mmv, skipdel);
     }
     doreps(mmv);
+    dirfd_flush();
+    dircache_release(mmv);
+    if (dbgprint_fh) {
+        fdump_dirfd_stats(dbgprint_fh);
+    }
     return (mmv->failed ? 2 : mmv->nreps == 0 && (mmv->paterr || mmv->badreps));
 }
 
 int
 mmv_compile(mmv_t *mmv)
 {
-    if (dostage_fnames(mmv, mmv->from, mmv->pathbuf, 0, 0)) {
+    if (dostage_fnames(mmv, mmv->from, mmv->pathbuf, 0)) {
         printf("%s -> %s : no match.\n", mmv->from, mmv->to);
         mmv->paterr = 1;
     }
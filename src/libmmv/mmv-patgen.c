@@ -102,6 +102,30 @@ extern char USAGE[];
 
 static char TRAILESC[] = "%s -> %s : trailing %c is superfluous.\n";
 
+/**
+ * @brief Make sure that a vector has room for element [idx].
+ *
+ * @param vec     IN     vector, allocated with mmv_alloc()
+ * @param psiz    INOUT  its size, in bytes
+ * @param idx     IN     index of the element about to be written
+ * @param elsize  IN     size of one element
+ * @return the vector, possibly moved
+ *
+ * There is no limit on the number of stages, nor on the number
+ * of wildcards, other than MAXPATLEN.
+ *
+ */
+
+static void *
+vec_room(void *vec, size_t *psiz, size_t idx, size_t elsize)
+{
+    if ((idx + 1) * elsize > *psiz) {
+        *psiz = (*psiz * 16) / 10 + elsize;
+        vec = mmv_realloc(vec, *psiz);
+    }
+    return (vec);
+}
+
 /**
  * @brief Parse 'from' pattern; record substrings for back-references, etc.
  *
@@ -152,6 +176,10 @@ parse_src_pattern(mmv_t *mmv)
      */
 
     pattern_t *pat = mmv->aux;
+    while (pat->pm_cnt > 0) {
+        --pat->pm_cnt;
+        pmatch_free(pat->stage_vec[pat->pm_cnt].stg_pm);
+    }
     pat->bkref_cnt = 0;
     pat->stage_cnt = 0;
     instage = 0;
@@ -163,16 +191,11 @@ parse_src_pattern(mmv_t *mmv)
                 if (firstwild(pat->stage_cnt) == NULL) {
                     firstwild(pat->stage_cnt) = p;
                 }
-                if (pat->stage_cnt == pat->stage_siz) {
-                    // Grow the array of descriptors
-                    // for wildcards within each stage
-                    void *vec = (void *) pat->stage_vec;
-                    size_t old_size = pat->stage_siz;
-                    size_t new_size = (old_size * 16) / 10;
-                    pat->stage_vec = (stage_t *) mmv_realloc(vec, new_size);
-                }
                 pat->stage_vec[pat->stage_cnt].r = p;
                 ++pat->stage_cnt;
+                // Grow the array of descriptors
+                // for wildcards within each stage
+                pat->stage_vec = (stage_t *) vec_room(pat->stage_vec, &pat->stage_siz, pat->stage_cnt, sizeof (stage_t));
                 instage = 0;
             }
             break;
@@ -187,13 +210,8 @@ parse_src_pattern(mmv_t *mmv)
         case '*':
         case '?':
         case '[':
-            if (pat->bkref_cnt == pat->bkref_siz) {
-                // Grow the vector of backref descriptors
-                void *vec = (void *) pat->bkref_vec;
-                size_t old_size = pat->bkref_siz;
-                size_t new_size = (old_size * 16) / 10;
-                pat->bkref_vec = (backref_t *) mmv_realloc(vec, new_size);
-            }
+            // Grow the vector of backref descriptors
+            pat->bkref_vec = (backref_t *) vec_room(pat->bkref_vec, &pat->bkref_siz, pat->bkref_cnt, sizeof (backref_t));
             ++pat->bkref_cnt;
             if (instage) {
                 ++nwilds(pat->stage_cnt);
@@ -249,21 +267,61 @@ parse_src_pattern(mmv_t *mmv)
     }
     pat->stage_vec[pat->stage_cnt].r = p;
     ++pat->stage_cnt;
+    pat->stage_vec = (stage_t *) vec_room(pat->stage_vec, &pat->stage_siz, pat->stage_cnt, sizeof (stage_t));
+
+    /*
+     * Compile the wildcards of each stage, once, for pmatch_exec().
+     */
+    for (pat->pm_cnt = 0; pat->pm_cnt < pat->stage_cnt; ++pat->pm_cnt) {
+        stage_t *stg = &pat->stage_vec[pat->pm_cnt];
+
+        stg->stg_pm = pmatch_compile(*stg->l == ';' ? stg->l + 1 : stg->l);
+    }
 
     return (0);
 }
 
+/**
+ * @brief Add one operation to the compiled 'to' pattern.
+ *
+ */
+
+static repop_t *
+rop_new(pattern_t *pat, enum repop_kind kind)
+{
+    repop_t *op;
+
+    pat->rop_vec = (repop_t *) vec_room(pat->rop_vec, &pat->rop_siz, pat->rop_cnt, sizeof (repop_t));
+    op = &pat->rop_vec[pat->rop_cnt++];
+    op->ro_kind = kind;
+    op->ro_cnv = '=';
+    op->ro_slash = false;
+    op->ro_empty = false;
+    op->ro_off = 0;
+    op->ro_len = 0;
+    return (op);
+}
+
 /**
  * @brief Parse 'to' pattern; do ~-expansion, validate back references, etc.
  *
  * @param mmv
  * @return (-1/0) style status
  *
+ * The pattern is also compiled, in the same scan, into the list of
+ * operations that makerep() runs for every match: runs of literal
+ * bytes, with escapes removed, and backreferences.  Whether a literal
+ * '/' makes the target bad is decided here, except for a '/' right
+ * after a backreference, which depends on what the backreference
+ * matched.
+ *
  */
 
 int
 parse_dst_pattern(mmv_t *mmv)
 {
+    pattern_t *pat = mmv->aux;
+    repop_t *lit;
     char *p, *lastname;
     int c;
 
@@ -285,26 +343,22 @@ parse_dst_pattern(mmv_t *mmv)
     }
 
     /*
-     * Scan 'to' path -- record the positions of any backreferences
-     * (e.g. '#1') in the replacement pattern.
+     * Scan 'to' path -- check and compile any backreferences
+     * (e.g. '#1') and runs of literal bytes.
      */
-    for (p = lastname; (c = *p) != '\0'; ++p) {
-        size_t backref_nr;
+    pat->rop_cnt = 0;
+    pat->rop_litlen = 0;
+    lit = NULL;
+    for (p = mmv->to; (c = *p) != '\0'; ++p) {
+        if (c == BACKREF) {
+            repop_t *op;
+            size_t backref_nr;
+            int cnv;
 
-        switch (c) {
-        default:
-            break;
-        case SLASH:
-            if (mmv->op & DIRMOVE) {
-                printf("%s -> %s : no path allowed in target under -r.\n",
-                    mmv->from, mmv->to);
-                return (-1);
-            }
-            // XXX NOT USED; lastname = p + 1;
-            break;
-        case BACKREF:
             c = *(++p);
+            cnv = '=';
             if (c == 'l' || c == 'u') {
+                cnv = c;
                 c = *(++p);
             }
             if (!isdigit(c)) {
@@ -320,19 +374,50 @@ parse_dst_pattern(mmv_t *mmv)
                 }
                 ++p;
             }
-            pattern_t *pat = mmv->aux;
             if (backref_nr > pat->bkref_cnt) {
                 printf("%s -> %s : wildcard #%zu does not exist.\n",
                     mmv->from, mmv->to, backref_nr);
                 return (-1);
             }
-            break;
-        case ESC:
+            op = rop_new(pat, RO_BACKREF);
+            op->ro_cnv = cnv;
+            op->ro_off = backref_nr;
+            lit = NULL;
+            continue;
+        }
+
+        if (c == ESC) {
             if ((c = *(++p)) == '\0') {
                 printf(TRAILESC, mmv->from, mmv->to, ESC);
                 return (-1);
             }
         }
+        else if (c == SLASH && p >= lastname && (mmv->op & DIRMOVE)) {
+            printf("%s -> %s : no path allowed in target under -r.\n",
+                mmv->from, mmv->to);
+            return (-1);
+        }
+
+        /*
+         * A '/' that would make an empty component, or an absolute
+         * path out of a relative one, starts a new run, marked bad.
+         */
+        if (c == SLASH && lit == NULL && pat->rop_cnt != 0) {
+            lit = rop_new(pat, RO_LIT);
+            lit->ro_off = pat->rop_litlen;
+            lit->ro_slash = true;
+        }
+        else if (c == SLASH && (lit == NULL ? p != mmv->to : (pat->rop_lit[pat->rop_litlen - 1] == SLASH && *(p - 1) != SLASH))) {
+            lit = rop_new(pat, RO_LIT);
+            lit->ro_off = pat->rop_litlen;
+            lit->ro_empty = true;
+        }
+        else if (lit == NULL) {
+            lit = rop_new(pat, RO_LIT);
+            lit->ro_off = pat->rop_litlen;
+        }
+        pat->rop_lit[pat->rop_litlen++] = c;
+        ++lit->ro_len;
     }
 
     return (0);
@@ -406,12 +491,314 @@ matchpats_from_argv(mmv_t *mmv, const char *cfrom, const char *cto)
  *
  */
 
+/*
+ * A { from->to } pair, as read from a pattern list, kept until
+ * its turn to be matched.
+ */
+
+struct patpair {
+    char *pp_from;
+    char *pp_to;        // NULL if the line had no replacement pattern
+    int   pp_flags;     // mmv->patflags, as set by getpat()
+};
+
+struct patlist {
+    struct patpair *pl_vec;
+    size_t pl_count;
+    size_t pl_size;
+};
+
+static char *
+patdup(const char *s, size_t len)
+{
+    char *d;
+
+    d = (char *) mmv_alloc(len + 1);
+    memcpy(d, s, len + 1);
+    return (d);
+}
+
+static void
+patlist_add(struct patlist *pl, mmv_t *mmv, bool missing)
+{
+    struct patpair *pp;
+
+    if (pl->pl_count == pl->pl_size) {
+        pl->pl_size = pl->pl_size ? pl->pl_size * 2 : 64;
+        pl->pl_vec = (struct patpair *) mmv_realloc(pl->pl_vec, pl->pl_size * sizeof (struct patpair));
+    }
+    pp = &pl->pl_vec[pl->pl_count++];
+    pp->pp_from = patdup(mmv->from, strlen(mmv->from));
+    pp->pp_to = missing ? NULL : patdup(mmv->to, mmv->tolen);
+    pp->pp_flags = mmv->patflags;
+}
+
+static void
+defer_missing(mmv_t *mmv, void *arg)
+{
+    patlist_add((struct patlist *)arg, mmv, true);
+}
+
+/**
+ * @brief Find the directory where matching a 'from' pattern starts.
+ *
+ * @param from    IN   'from' pattern, as read
+ * @param dir     OUT  that directory, spelled the way checkdir()
+ *                     hands it to takedir(); at least |strlen(from) + 2| bytes
+ * @param pdepth  OUT  how many levels of subdirectories below |dir|
+ *                     the match will go through, one wildcard
+ *                     component each, before any ';'
+ * @param pwalk   OUT  true if the pattern then has a ';', which walks
+ *                     the whole tree, down to mmv_set_walk_maxdepth()
+ * @return true if the directory is known
+ *
+ * Patterns that need ~-expansion, or that escape any character
+ * before their first wildcard, are left alone; their directories
+ * are just read when they are reached, as always.
+ *
+ */
+
+bool
+pattern_start_dir(const char *from, char *dir, unsigned int *pdepth, bool *pwalk)
+{
+    const char *p, *comp, *dirend;
+    unsigned int depth;
+    bool wild;
+    int c;
+
+    if (from[0] == '~' && from[1] == SLASH) {
+        return (false);
+    }
+
+    dirend = from;
+    for (p = from; (c = *p) != '\0' && strchr("*?[!;", c) == NULL; ++p) {
+        if (c == ESC) {
+            return (false);
+        }
+        if (c == SLASH) {
+            dirend = p + 1;
+        }
+    }
+
+    /*
+     * Count the wildcard components that are directories,
+     * from the first one, until there is one without a wildcard.
+     */
+    depth = 0;
+    *pwalk = false;
+    for (comp = dirend; *comp != '\0'; comp = p + 1) {
+        if (*comp == ';') {
+            *pwalk = true;
+            break;
+        }
+        wild = false;
+        for (p = comp; (c = *p) != '\0' && c != SLASH; ++p) {
+            if (c == ESC) {
+                break;
+            }
+            if (strchr("*?[!", c) != NULL) {
+                wild = true;
+            }
+        }
+        if (c != SLASH || !wild) {
+            break;
+        }
+        ++depth;
+    }
+    *pdepth = depth;
+
+    if (dirend == from) {
+        strcpy(dir, ".");
+    }
+    else if (dirend == from + 1) {
+        dir[0] = SLASH;
+        dir[1] = '\0';
+    }
+    else {
+        memcpy(dir, from, dirend - from - 1);
+        dir[dirend - from - 1] = '\0';
+    }
+    return (true);
+}
+
+/**
+ * @brief Match one pattern from a pattern list.
+ *
+ */
+
+static void
+patlist_match_one(mmv_t *mmv, struct patpair *pp)
+{
+    if (pp->pp_to == NULL) {
+        printf("%s -> ? : missing replacement pattern.\n", pp->pp_from);
+        return;
+    }
+    mmv->fromlen = strlen(pp->pp_from);
+    mmv->tolen = strlen(pp->pp_to);
+    strcpy(mmv->from, pp->pp_from);
+    strcpy(mmv->to, pp->pp_to);
+    mmv->patflags = pp->pp_flags;
+    matchpat(mmv);
+}
+
+/**
+ * @brief Find the end of a run of patterns that can be matched as a batch.
+ *
+ * @return index just past the last pattern of the run starting at |i|
+ *
+ * See mmv-multipat.c.
+ *
+ */
+
+static size_t
+patlist_batch_end(struct patlist *pl, size_t i)
+{
+    char dir[MAXPATLEN + 2];
+    char next[MAXPATLEN + 2];
+    struct patpair *pp;
+    size_t j;
+
+    pp = &pl->pl_vec[i];
+    if (pp->pp_to == NULL || !multipat_batchable(pp->pp_from, dir)) {
+        return (i + 1);
+    }
+    for (j = i + 1; j < pl->pl_count; ++j) {
+        pp = &pl->pl_vec[j];
+        if (pp->pp_to == NULL || !multipat_batchable(pp->pp_from, next) || strcmp(dir, next) != 0) {
+            break;
+        }
+    }
+    return (j);
+}
+
+/**
+ * @brief Match every pattern of a pattern list, in input order.
+ *
+ * A run of patterns that all look in the same directory
+ * is matched as a batch, with one scan of that directory.
+ *
+ */
+
+static void
+patlist_match(mmv_t *mmv, struct patlist *pl)
+{
+    multipat_t *mp;
+    char **froms;
+    size_t i, j, k;
+
+    froms = (char **) mmv_alloc((pl->pl_count + 1) * sizeof (char *));
+    for (i = 0; i < pl->pl_count; i = j) {
+        j = patlist_batch_end(pl, i);
+        mp = NULL;
+        if (j - i >= 2) {
+            for (k = i; k < j; ++k) {
+                froms[k - i] = pl->pl_vec[k].pp_from;
+            }
+            mp = multipat_new(mmv, froms, j - i);
+        }
+        for (k = i; k < j; ++k) {
+            multipat_select(mp, k - i);
+            patlist_match_one(mmv, &pl->pl_vec[k]);
+        }
+        multipat_select(NULL, 0);
+        multipat_free(mp);
+    }
+    free(froms);
+}
+
+static void
+patlist_free(struct patlist *pl)
+{
+    size_t i;
+
+    for (i = 0; i < pl->pl_count; ++i) {
+        free(pl->pl_vec[i].pp_from);
+        free(pl->pl_vec[i].pp_to);
+    }
+    free(pl->pl_vec);
+}
+
+/**
+ * @brief Match a pattern list that has been read, with parallel prefetch.
+ *
+ * Matching each pattern must stay serial, and in input order,
+ * because a file that is matched by one pattern is not matched
+ * again by a later one, and the |REP| list must be in input order.
+ * But the directories where the patterns start can all be read
+ * and sorted ahead of time, by the worker threads of mmv-prefetch.c.
+ * Complaints about bad lines are kept in their place in the list,
+ * so the output is just as it would be without the read-ahead.
+ *
+ */
+
+static int
+matchpats_from_file_parallel(mmv_t *mmv, struct patlist *pl)
+{
+    struct patpair *pp;
+    char **dirs;
+    unsigned int *depths;
+    bool *walks;
+    size_t ndirs, i;
+    bool prefetching;
+
+    dirs = (char **) mmv_alloc((pl->pl_count + 1) * sizeof (char *));
+    depths = (unsigned int *) mmv_alloc((pl->pl_count + 1) * sizeof (unsigned int));
+    walks = (bool *) mmv_alloc((pl->pl_count + 1) * sizeof (bool));
+    ndirs = 0;
+    for (i = 0; i < pl->pl_count; ++i) {
+        pp = &pl->pl_vec[i];
+        if (pp->pp_to == NULL) {
+            continue;
+        }
+        dirs[ndirs] = (char *) mmv_alloc(strlen(pp->pp_from) + 2);
+        if (pattern_start_dir(pp->pp_from, dirs[ndirs], &depths[ndirs], &walks[ndirs])) {
+            ++ndirs;
+        }
+        else {
+            free(dirs[ndirs]);
+        }
+    }
+    prefetching = prefetch_start_dirs(mmv, dirs, depths, walks, ndirs);
+
+    patlist_match(mmv, pl);
+
+    if (prefetching) {
+        prefetch_finish();
+    }
+    for (i = 0; i < ndirs; ++i) {
+        free(dirs[i]);
+    }
+    free(dirs);
+    free(depths);
+    free(walks);
+    return (mmv->paterr);
+}
+
+/**
+ * @brief Read a whole pattern list, then match it.
+ *
+ * The whole list is read first, so that runs of patterns
+ * in the same directory can be seen, and matched as a batch.
+ *
+ */
+
 static int
 matchpats_from_file(mmv_t *mmv)
 {
-    while (getpat(mmv)) {
-        matchpat(mmv);
+    struct patlist pl;
+
+    memset(&pl, 0, sizeof (pl));
+    while (getpat_cb(mmv, defer_missing, &pl)) {
+        patlist_add(&pl, mmv, false);
+    }
+
+    if (mmv->scan_threads != 0) {
+        matchpats_from_file_parallel(mmv, &pl);
+    }
+    else {
+        patlist_match(mmv, &pl);
     }
+    patlist_free(&pl);
     return (mmv->paterr);
 }
 
@@ -0,0 +1,785 @@
+/*
+ * Filename: src/libmmv/mmv-pmatch.c
+ * Library: libmmv
+ * Brief: Compiled, non-backtracking matcher for one stage of a 'from' pattern
+ *
+ * Description:
+ *   match() tries every length for a '*', shortest first, and calls
+ *   itself on the rest of the pattern for each one.  That is
+ *   exponential in the number of stars; a pattern like *a*a*a*a*b
+ *   against a long name can stall a whole run.  It also parses
+ *   each [...] class again, for every name.
+ *
+ *   Here, each stage is compiled once, when the 'from' pattern
+ *   is parsed.  Every item that stands for one byte ( a literal,
+ *   '?' or [...] ) becomes a 256-bit map of the bytes it accepts.
+ *   The stars cut the items into segments.
+ *
+ *   match() takes the shortest span for each star, in turn, that
+ *   lets the rest match.  Whatever follows a star can only match
+ *   more easily if it starts earlier, so that is the same as:
+ *     - the first segment is anchored at the start of the name;
+ *     - the last segment is anchored at the end of the name;
+ *     - each segment in between is put at the earliest place
+ *       it matches, after the one before it.
+ *   So the spans of the stars come out the same as from match().
+ *
+ *   The earliest place of a middle segment is found with
+ *   a bit-parallel simulation of its NFA (shift-and), one step
+ *   per byte of the name, so a stage matches in time linear
+ *   in the length of the name, no matter how many stars it has.
+ *   Segments of more than 64 items, which can hardly happen
+ *   in a filename, are searched for one place at a time.
+ *
+ *   Most stages are one of a few simple shapes, though:
+ *   a plain name, prefix*suffix (which covers prefix*, *suffix,
+ *   *.ext and *), or ?...?*.  Those are recognized when the stage
+ *   is compiled, and are matched by kernels of their own, with
+ *   memcmp() against the ends of the name, whose length is known.
+ *   The kernels fill in the backrefs directly.  Anything else
+ *   goes through the general matcher.
+ *
+ *   Before the general matcher runs, a name must contain the
+ *   anchor of the stage: the longest run of plain bytes in any
+ *   segment between two stars, such as ".tar." in *.tar.*.
+ *   Every match has to have it, somewhere between the first
+ *   and last segments, so a name without it is rejected by one
+ *   substring search.  With SSE2, that search tests 16 places
+ *   at a time, for the first and last byte of the anchor.
+ *
+ * Copyright (C) 2016 Guy Shaw
+ * Written by Guy Shaw <gshaw@acm.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>         // Import size_t
+#include <stdint.h>         // Import uint64_t
+#include <stdio.h>          // Import type FILE
+#include <stdlib.h>         // Import free()
+#include <string.h>         // Import memchr(), memcmp(), memcpy(), memset()
+#include <eprint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define IMPORT_PATTERN
+#define IMPORT_ALLOC
+#define IMPORT_BACKREFS
+#include <mmv-impl.h>
+
+/*
+ * Longest segment searched with a single 64-bit state word.
+ */
+
+#define PM_WORD 64
+
+enum pi_kind {
+    PI_LIT,                 // One given byte
+    PI_ANY,                 // '?'; it fills a backref
+    PI_CLASS,               // [...]; it fills a backref
+};
+
+struct pm_item {
+    uint64_t      pi_map[4];    // Bytes accepted, as a 256-bit map
+    enum pi_kind  pi_kind;
+    unsigned char pi_byte;      // The byte, if PI_LIT
+};
+
+struct pm_seg {
+    unsigned int ps_first;  // Index of first item in |pm_items|
+    unsigned int ps_len;    // Number of items; each matches one byte
+    uint64_t *   ps_mask;   // Shift-and masks by byte, or NULL
+};
+
+/*
+ * Kernels, by the shape of the stage.
+ */
+
+enum pm_kernel {
+    PK_GENERAL,             // Anything
+    PK_EXACT,               // No wildcards
+    PK_STAR,                // prefix*suffix; both literal, either may be ""
+    PK_QSTAR,               // One or more '?', then '*'
+    PK_NKERNELS
+};
+
+static const char *pm_kernel_names[PK_NKERNELS] = {
+    "general", "exact", "prefix-star-suffix", "any-star"
+};
+
+struct pmatch {
+    struct pm_item * pm_items;
+    unsigned int     pm_nitems;
+    struct pm_seg *  pm_segs;   // One more than the number of stars
+    unsigned int     pm_nsegs;
+
+    enum pm_kernel   pm_kernel;
+    char *           pm_pre;    // PK_EXACT, PK_STAR: literal before any '*'
+    size_t           pm_prelen; // PK_QSTAR: number of '?'
+    char *           pm_suf;    // PK_STAR: literal after the '*'
+    size_t           pm_suflen;
+    char *           pm_anchor; // PK_GENERAL: literal every match contains,
+    size_t           pm_anchorlen;  // or NULL
+};
+
+static size_t pm_calls[PK_NKERNELS];    // pmatch_exec() calls, by kernel
+static size_t pm_anchor_rejects;        // ... of those, rejected by anchor
+
+static inline bool
+map_test(const uint64_t *map, unsigned char c)
+{
+    return ((map[c >> 6] >> (c & 63)) & 1);
+}
+
+static inline void
+map_set(uint64_t *map, unsigned char c)
+{
+    map[c >> 6] |= (uint64_t)1 << (c & 63);
+}
+
+/**
+ * @brief Does the [...] class at |pat| accept the byte |sc|?
+ *
+ * @param pat   IN   just past the '['
+ * @param sc    IN   the byte, as match() sees it, through a plain char
+ * @param pend  OUT  the closing ']'
+ *
+ * This is the same loop as in match(), so ranges compare
+ * the same way, signed chars and all.
+ *
+ */
+
+static bool
+class_accepts(const char *pat, char sc, const char **pend)
+{
+    int matched = 0, notin = 0, inrange = 0;
+    char prevc = '\0';
+    char c;
+
+    if ((c = *pat) == '^') {
+        notin = 1;
+        c = *(++pat);
+    }
+    while (c != ']') {
+        if (c == '\0') {
+            *pend = NULL;
+            return (false);
+        }
+        if (c == '-' && !inrange) {
+            inrange = 1;
+        }
+        else {
+            if (c == ESC) {
+                c = *(++pat);
+            }
+            if (inrange) {
+                if (sc >= prevc && sc <= c) {
+                    matched = 1;
+                }
+                inrange = 0;
+            }
+            else if (c == sc) {
+                matched = 1;
+            }
+            prevc = c;
+        }
+        c = *(++pat);
+    }
+    if (inrange && sc >= prevc) {
+        matched = 1;
+    }
+    *pend = pat;
+    return ((matched ^ notin) != 0);
+}
+
+/**
+ * @brief Free a compiled stage.
+ *
+ */
+
+void
+pmatch_free(pmatch_t *pm)
+{
+    unsigned int i;
+
+    if (pm == NULL) {
+        return;
+    }
+    for (i = 0; i < pm->pm_nsegs; ++i) {
+        free(pm->pm_segs[i].ps_mask);
+    }
+    free(pm->pm_segs);
+    free(pm->pm_items);
+    free(pm->pm_pre);
+    free(pm->pm_suf);
+    free(pm->pm_anchor);
+    free(pm);
+}
+
+/**
+ * @brief Are all items of a segment of the given kind?
+ *
+ */
+
+static bool
+seg_all(const pmatch_t *pm, const struct pm_seg *sg, enum pi_kind kind)
+{
+    unsigned int j;
+
+    for (j = 0; j < sg->ps_len; ++j) {
+        if (pm->pm_items[sg->ps_first + j].pi_kind != kind) {
+            return (false);
+        }
+    }
+    return (true);
+}
+
+/**
+ * @brief Copy out the bytes of an all-literal segment.
+ *
+ */
+
+static char *
+seg_literal(const pmatch_t *pm, const struct pm_seg *sg)
+{
+    char *lit;
+    unsigned int j;
+
+    lit = (char *) mmv_alloc(sg->ps_len + 1);
+    for (j = 0; j < sg->ps_len; ++j) {
+        lit[j] = pm->pm_items[sg->ps_first + j].pi_byte;
+    }
+    lit[j] = '\0';
+    return (lit);
+}
+
+/**
+ * @brief Choose the longest run of literals in a middle segment.
+ *
+ * The first and last segments are anchored at the ends of the name,
+ * and are checked directly, so only the segments between stars
+ * are of any use.
+ *
+ */
+
+static void
+pm_choose_anchor(pmatch_t *pm)
+{
+    const struct pm_item *items;
+    const struct pm_seg *sg;
+    unsigned int i, j, run, best, best_first;
+
+    pm->pm_anchor = NULL;
+    pm->pm_anchorlen = 0;
+    items = pm->pm_items;
+    best = best_first = 0;
+    for (i = 1; i + 1 < pm->pm_nsegs; ++i) {
+        sg = &pm->pm_segs[i];
+        run = 0;
+        for (j = 0; j < sg->ps_len; ++j) {
+            if (items[sg->ps_first + j].pi_kind != PI_LIT) {
+                run = 0;
+                continue;
+            }
+            ++run;
+            if (run > best) {
+                best = run;
+                best_first = sg->ps_first + j + 1 - run;
+            }
+        }
+    }
+    if (best == 0) {
+        return;
+    }
+
+    pm->pm_anchor = (char *) mmv_alloc(best + 1);
+    for (j = 0; j < best; ++j) {
+        pm->pm_anchor[j] = items[best_first + j].pi_byte;
+    }
+    pm->pm_anchor[best] = '\0';
+    pm->pm_anchorlen = best;
+}
+
+/**
+ * @brief Choose the kernel for a compiled stage.
+ *
+ */
+
+static void
+pm_classify(pmatch_t *pm)
+{
+    struct pm_seg *first, *last;
+
+    pm->pm_kernel = PK_GENERAL;
+    pm->pm_pre = pm->pm_suf = pm->pm_anchor = NULL;
+    pm->pm_prelen = pm->pm_suflen = pm->pm_anchorlen = 0;
+    first = &pm->pm_segs[0];
+    last = &pm->pm_segs[pm->pm_nsegs - 1];
+
+    if (pm->pm_nsegs == 1 && seg_all(pm, first, PI_LIT)) {
+        pm->pm_kernel = PK_EXACT;
+        pm->pm_pre = seg_literal(pm, first);
+        pm->pm_prelen = first->ps_len;
+    }
+    else if (pm->pm_nsegs == 2 && seg_all(pm, first, PI_LIT) && seg_all(pm, last, PI_LIT)) {
+        pm->pm_kernel = PK_STAR;
+        pm->pm_pre = seg_literal(pm, first);
+        pm->pm_prelen = first->ps_len;
+        pm->pm_suf = seg_literal(pm, last);
+        pm->pm_suflen = last->ps_len;
+    }
+    else if (pm->pm_nsegs == 2 && first->ps_len != 0 && seg_all(pm, first, PI_ANY) && last->ps_len == 0) {
+        pm->pm_kernel = PK_QSTAR;
+        pm->pm_prelen = first->ps_len;
+    }
+    else {
+        pm_choose_anchor(pm);
+    }
+}
+
+/**
+ * @brief Name of the kernel chosen for a compiled stage, for debug output.
+ *
+ */
+
+const char *
+pmatch_kernel_name(const pmatch_t *pm)
+{
+    return (pm == NULL ? "(none)" : pm_kernel_names[pm->pm_kernel]);
+}
+
+/**
+ * @brief Which bytes can a matching name start with, and end with?
+ *
+ * @param pm     IN   compiled stage
+ * @param first  OUT  256-bit map of possible first bytes
+ * @param last   OUT  256-bit map of possible last bytes
+ *
+ * A segment next to a '*' says nothing about that end of the name.
+ *
+ */
+
+void
+pmatch_end_bytes(const pmatch_t *pm, uint64_t *first, uint64_t *last)
+{
+    const struct pm_seg *fs, *ls;
+
+    fs = &pm->pm_segs[0];
+    ls = &pm->pm_segs[pm->pm_nsegs - 1];
+    if (fs->ps_len != 0) {
+        memcpy(first, pm->pm_items[fs->ps_first].pi_map, 4 * sizeof (uint64_t));
+    }
+    else {
+        memset(first, pm->pm_nsegs == 1 ? 0 : 0xff, 4 * sizeof (uint64_t));
+    }
+    if (ls->ps_len != 0) {
+        memcpy(last, pm->pm_items[ls->ps_first + ls->ps_len - 1].pi_map, 4 * sizeof (uint64_t));
+    }
+    else {
+        memset(last, pm->pm_nsegs == 1 ? 0 : 0xff, 4 * sizeof (uint64_t));
+    }
+}
+
+/**
+ * @brief Get the literal that every matching name must end with.
+ *
+ * @param pm    IN   compiled stage
+ * @param buf   OUT  the literal; not nul-terminated
+ * @param size  IN   room in |buf|; a longer literal is cut to its end
+ * @return length of the literal put in |buf|; 0 if there is none
+ *
+ */
+
+size_t
+pmatch_literal_suffix(const pmatch_t *pm, char *buf, size_t size)
+{
+    const struct pm_seg *ls;
+    size_t len, j;
+
+    ls = &pm->pm_segs[pm->pm_nsegs - 1];
+    for (len = 0; len < ls->ps_len && len < size; ++len) {
+        if (pm->pm_items[ls->ps_first + ls->ps_len - 1 - len].pi_kind != PI_LIT) {
+            break;
+        }
+    }
+    for (j = 0; j < len; ++j) {
+        buf[j] = pm->pm_items[ls->ps_first + ls->ps_len - len + j].pi_byte;
+    }
+    return (len);
+}
+
+/**
+ * @brief Print how many names each kernel was asked to match.
+ *
+ * @param f  IN  Where to print
+ *
+ */
+
+void
+fdump_pmatch_stats(FILE *f)
+{
+    fprintf(f, "pmatch:\n");
+    fprintf(f, "    calls: exact=%zu, prefix-star-suffix=%zu, any-star=%zu, general=%zu\n",
+        pm_calls[PK_EXACT], pm_calls[PK_STAR], pm_calls[PK_QSTAR], pm_calls[PK_GENERAL]);
+    fprintf(f, "    anchor-rejects=%zu\n", pm_anchor_rejects);
+}
+
+/**
+ * @brief Compile one stage of a 'from' pattern.
+ *
+ * @param pat  IN  the stage, after any ';'; it ends at '/' or '\0'
+ * @return compiled stage, or NULL if the pattern is malformed
+ *
+ * The pattern has already been checked by parse_src_pattern(),
+ * so NULL is not expected.
+ *
+ */
+
+pmatch_t *
+pmatch_compile(const char *pat)
+{
+    pmatch_t *pm;
+    struct pm_item *it;
+    struct pm_seg *sg;
+    const char *p, *end;
+    unsigned int nitems, nstars, i, j;
+    unsigned int b;
+
+    nitems = nstars = 0;
+    for (p = pat; *p != '\0' && *p != SLASH; ++p) {
+        if (*p == '*') {
+            ++nstars;
+            continue;
+        }
+        if (*p == '[') {
+            class_accepts(p + 1, 'a', &end);
+            if (end == NULL) {
+                return (NULL);
+            }
+            p = end;
+        }
+        else if (*p == ESC && p[1] != '\0') {
+            ++p;
+        }
+        ++nitems;
+    }
+
+    pm = (pmatch_t *) mmv_alloc(sizeof (pmatch_t));
+    pm->pm_nitems = nitems;
+    pm->pm_items = (struct pm_item *) mmv_alloc((nitems + 1) * sizeof (struct pm_item));
+    pm->pm_nsegs = nstars + 1;
+    pm->pm_segs = (struct pm_seg *) mmv_alloc(pm->pm_nsegs * sizeof (struct pm_seg));
+    memset(pm->pm_items, 0, (nitems + 1) * sizeof (struct pm_item));
+
+    sg = pm->pm_segs;
+    sg->ps_first = 0;
+    sg->ps_len = 0;
+    sg->ps_mask = NULL;
+    it = pm->pm_items;
+    for (p = pat; *p != '\0' && *p != SLASH; ++p) {
+        switch (*p) {
+        case '*':
+            ++sg;
+            sg->ps_first = it - pm->pm_items;
+            sg->ps_len = 0;
+            sg->ps_mask = NULL;
+            continue;
+        case '?':
+            for (b = 1; b < 256; ++b) {
+                map_set(it->pi_map, b);
+            }
+            it->pi_kind = PI_ANY;
+            break;
+        case '[':
+            for (b = 1; b < 256; ++b) {
+                if (class_accepts(p + 1, (char)b, &end)) {
+                    map_set(it->pi_map, b);
+                }
+            }
+            it->pi_kind = PI_CLASS;
+            p = end;
+            break;
+        case ESC:
+            if (p[1] != '\0') {
+                ++p;
+            }
+            __attribute__ ((fallthrough));
+        default:
+            map_set(it->pi_map, (unsigned char)*p);
+            it->pi_kind = PI_LIT;
+            it->pi_byte = (unsigned char)*p;
+            break;
+        }
+        ++it;
+        ++sg->ps_len;
+    }
+
+    // Shift-and masks, for the segments that are searched for
+    for (i = 1; i + 1 < pm->pm_nsegs; ++i) {
+        sg = &pm->pm_segs[i];
+        if (sg->ps_len == 0 || sg->ps_len > PM_WORD) {
+            continue;
+        }
+        sg->ps_mask = (uint64_t *) mmv_alloc(256 * sizeof (uint64_t));
+        memset(sg->ps_mask, 0, 256 * sizeof (uint64_t));
+        for (j = 0; j < sg->ps_len; ++j) {
+            it = &pm->pm_items[sg->ps_first + j];
+            for (b = 0; b < 256; ++b) {
+                if (map_test(it->pi_map, b)) {
+                    sg->ps_mask[b] |= (uint64_t)1 << j;
+                }
+            }
+        }
+    }
+
+    pm_classify(pm);
+    return (pm);
+}
+
+/**
+ * @brief Does segment |sg| match at |s|, which has room for it?
+ *
+ */
+
+static bool
+seg_at(const pmatch_t *pm, const struct pm_seg *sg, const unsigned char *s)
+{
+    const struct pm_item *it;
+    unsigned int j;
+
+    it = &pm->pm_items[sg->ps_first];
+    for (j = 0; j < sg->ps_len; ++j, ++it) {
+        if (!map_test(it->pi_map, s[j])) {
+            return (false);
+        }
+    }
+    return (true);
+}
+
+/**
+ * @brief Find the earliest place of segment |sg| in |s|[pos..lim).
+ *
+ * @return offset where it starts, or (size_t)-1
+ *
+ */
+
+static size_t
+seg_find(const pmatch_t *pm, const struct pm_seg *sg, const unsigned char *s, size_t pos, size_t lim)
+{
+    uint64_t d, hit;
+    size_t i;
+
+    if (sg->ps_len == 0) {
+        return (pos);
+    }
+    if (lim < pos || lim - pos < sg->ps_len) {
+        return ((size_t)-1);
+    }
+
+    if (sg->ps_mask != NULL) {
+        hit = (uint64_t)1 << (sg->ps_len - 1);
+        d = 0;
+        for (i = pos; i < lim; ++i) {
+            d = ((d << 1) | 1) & sg->ps_mask[s[i]];
+            if (d & hit) {
+                return (i + 1 - sg->ps_len);
+            }
+        }
+        return ((size_t)-1);
+    }
+
+    for (i = pos; i + sg->ps_len <= lim; ++i) {
+        if (seg_at(pm, sg, s + i)) {
+            return (i);
+        }
+    }
+    return ((size_t)-1);
+}
+
+/**
+ * @brief Record the backrefs of the items of a segment placed at |at|.
+ *
+ */
+
+static backref_t *
+seg_capture(const pmatch_t *pm, const struct pm_seg *sg, char *s, size_t at, backref_t *bkref)
+{
+    const struct pm_item *it;
+    unsigned int j;
+
+    it = &pm->pm_items[sg->ps_first];
+    for (j = 0; j < sg->ps_len; ++j, ++it) {
+        if (it->pi_kind != PI_LIT) {
+            bkref->br_start = s + at + j;
+            bkref->br_len = 1;
+            ++bkref;
+        }
+    }
+    return (bkref);
+}
+
+/**
+ * @brief Does |hay| contain |needle|?
+ *
+ * @param hay     IN  bytes to search
+ * @param n       IN  number of bytes in |hay|
+ * @param needle  IN  bytes to look for
+ * @param m       IN  number of bytes in |needle|; at least 1
+ *
+ */
+
+static bool
+mem_contains(const char *hay, size_t n, const char *needle, size_t m)
+{
+    const char *p, *end;
+    size_t i;
+
+    if (m > n) {
+        return (false);
+    }
+    i = 0;
+
+#if defined(__SSE2__)
+    // Test 16 places at once, for the first and last byte of |needle|;
+    // compare the rest only where both of those are right.
+    if (m >= 2) {
+        __m128i vfirst = _mm_set1_epi8(needle[0]);
+        __m128i vlast = _mm_set1_epi8(needle[m - 1]);
+
+        for (; i + m - 1 + 16 <= n; i += 16) {
+            __m128i bf = _mm_loadu_si128((const __m128i *)(hay + i));
+            __m128i bl = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+            unsigned int bits = _mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(bf, vfirst), _mm_cmpeq_epi8(bl, vlast)));
+
+            while (bits != 0) {
+                unsigned int b = __builtin_ctz(bits);
+
+                if (memcmp(hay + i + b + 1, needle + 1, m - 2) == 0) {
+                    return (true);
+                }
+                bits &= bits - 1;
+            }
+        }
+    }
+#endif
+
+    end = hay + n - m + 1;
+    for (p = hay + i; p < end; ++p) {
+        p = (const char *) memchr(p, needle[0], end - p);
+        if (p == NULL) {
+            return (false);
+        }
+        if (memcmp(p + 1, needle + 1, m - 1) == 0) {
+            return (true);
+        }
+    }
+    return (false);
+}
+
+/**
+ * @brief Match a name against a compiled stage.
+ *
+ * @param pm     IN   compiled stage
+ * @param s      IN   the whole name
+ * @param send   IN   end of |s|
+ * @param bkref  OUT  one descriptor for each '*', '?' and [...], in order
+ * @return 0/1 status: 1 = match, 0 = not match
+ *
+ * The spans recorded are the same as match() records.
+ * As with match(), |bkref| may have been written to, even if
+ * there is no match.
+ *
+ */
+
+int
+pmatch_exec(const pmatch_t *pm, char *s, const char *send, backref_t *bkref)
+{
+    const unsigned char *us = (const unsigned char *)s;
+    const struct pm_seg *first, *last, *sg;
+    size_t n, pos, lim, at;
+    unsigned int k;
+
+    n = send - s;
+    ++pm_calls[pm->pm_kernel];
+    switch (pm->pm_kernel) {
+    case PK_EXACT:
+        return (n == pm->pm_prelen && memcmp(s, pm->pm_pre, n) == 0);
+    case PK_STAR:
+        if (n < pm->pm_prelen + pm->pm_suflen
+            || memcmp(s, pm->pm_pre, pm->pm_prelen) != 0
+            || memcmp(send - pm->pm_suflen, pm->pm_suf, pm->pm_suflen) != 0) {
+            return (0);
+        }
+        bkref->br_start = s + pm->pm_prelen;
+        bkref->br_len = n - pm->pm_prelen - pm->pm_suflen;
+        return (1);
+    case PK_QSTAR:
+        if (n < pm->pm_prelen) {
+            return (0);
+        }
+        for (pos = 0; pos < pm->pm_prelen; ++pos, ++bkref) {
+            bkref->br_start = s + pos;
+            bkref->br_len = 1;
+        }
+        bkref->br_start = s + pos;
+        bkref->br_len = n - pos;
+        return (1);
+    default:
+        break;
+    }
+
+    first = &pm->pm_segs[0];
+    last = &pm->pm_segs[pm->pm_nsegs - 1];
+
+    if (pm->pm_nsegs == 1) {
+        if (n != first->ps_len || !seg_at(pm, first, us)) {
+            return (0);
+        }
+        seg_capture(pm, first, s, 0, bkref);
+        return (1);
+    }
+
+    if (n < (size_t)first->ps_len + last->ps_len) {
+        return (0);
+    }
+    lim = n - last->ps_len;
+    if (pm->pm_anchor != NULL
+        && !mem_contains(s + first->ps_len, lim - first->ps_len, pm->pm_anchor, pm->pm_anchorlen)) {
+        ++pm_anchor_rejects;
+        return (0);
+    }
+    if (!seg_at(pm, first, us) || !seg_at(pm, last, us + lim)) {
+        return (0);
+    }
+
+    bkref = seg_capture(pm, first, s, 0, bkref);
+    pos = first->ps_len;
+    for (k = 1; k < pm->pm_nsegs; ++k) {
+        sg = &pm->pm_segs[k];
+        at = (sg == last) ? lim : seg_find(pm, sg, us, pos, lim);
+        if (at == (size_t)-1) {
+            return (0);
+        }
+        bkref->br_start = s + pos;
+        bkref->br_len = at - pos;
+        ++bkref;
+        bkref = seg_capture(pm, sg, s, at, bkref);
+        pos = at + sg->ps_len;
+    }
+    return (1);
+}
@@ -0,0 +1,1203 @@
+/*
+ * Filename: src/libmmv/mmv-prefetch.c
+ * Library: libmmv
+ * Brief: Read and sort directory trees in parallel, ahead of the serial walk
+ *
+ * Description:
+ *   A ';' in a 'from' pattern means "at any level", and dostage_patterns()
+ *   walks the whole tree below that point, one directory at a time.
+ *   The walk itself must stay serial, so that matches are found
+ *   in the same order as always.  But, the expensive part of each step,
+ *   reading the directory and sorting it, does not depend on the walk.
+ *
+ *   So, when a ';' is reached, and mmv->scan_threads is not 0,
+ *   a pool of worker threads reads and sorts every directory in the
+ *   tree below it, ahead of the walk.  Each worker has its own deque
+ *   of directories to read.  A worker takes work from the tail of its
+ *   own deque, and pushes the subdirectories it discovers back onto it,
+ *   so that it goes depth-first, like the walk.  An idle worker steals
+ *   from the head of some other worker's deque.
+ *
+ *   Listings are kept in a table, keyed by the directory path,
+ *   exactly as checkdir() passes it to takedir().  takedir() asks
+ *   for each directory by that key.  If a listing is ready, it is adopted.
+ *   If the directory has not been started, yet, the main thread reads
+ *   it right away, itself.  If some worker is reading it, the main
+ *   thread waits for it.  If the directory is not in the table at all
+ *   (for example, it was reached through a symbolic link), takedir()
+ *   just reads it, as before.
+ *
+ *   A list of patterns, read from stdin, is matched one pattern
+ *   at a time, and each pattern starts with a directory of its own.
+ *   So, before the first pattern of a list is matched, all of those
+ *   starting directories are queued at once, with prefetch_start_dirs(),
+ *   and the pool stays up until the whole list is done.  While it is up,
+ *   a ';' in any pattern just queues more work for the same pool.
+ *   Matching, and so the order of the |REP| list, stays serial,
+ *   in input order.
+ *
+ *   The table is split into shards, each with its own lock, so that
+ *   workers registering the subdirectories they find do not contend
+ *   with each other, nor with takedir() looking up its next listing.
+ *   Each directory is read at most once: whoever moves an entry from
+ *   PF_QUEUED to PF_RUNNING reads it, and anybody else who wants it waits.
+ *
+ *   Filename pairs, read by mmv_get_pairs_*(), are handled the same way:
+ *   the reader decodes pairs a window ahead, and queues the source
+ *   and target directories of each pair with prefetch_queue_dir().
+ *   A target directory that checkdir() would only probe lazily,
+ *   because it is so big, is not read ahead; see takedir_lazy().
+ *   Nor is any directory too big for the memory cap; takedir()
+ *   reads that in external memory, itself; see mmv-extdir.c.
+ *
+ *   Below a ';', workers follow the same prune rules as the walk
+ *   itself (mmv_add_prune(), mmv_set_walk_maxdepth(),
+ *   mmv_set_walk_onefs()), so they do not read subtrees that
+ *   the walk will never enter.
+ *
+ *   Workers never touch |FILEINFO|, |DIRINFO| or any other libmmv data;
+ *   they only produce sorted |dirbuf_t| listings.
+ *
+ *   Nothing here ever quits on running out of memory, since a worker
+ *   must not end the process while the main thread is in the middle
+ *   of something.  An entry that could not be read, or queued, for
+ *   lack of memory, is marked PF_FAILED, and |pf_nomem| tells the pool
+ *   to stop reading ahead.  The main thread then reads what it needs,
+ *   itself, in takedir(), where running out of memory is reported
+ *   as it always has been.
+ *
+ * Copyright (C) 2016 Guy Shaw
+ * Written by Guy Shaw <gshaw@acm.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdbool.h>
+#include <stdint.h>         // Import SIZE_MAX
+#include <stdio.h>          // Import fprintf()
+#include <stdlib.h>         // Import free()
+#include <string.h>         // Import memcpy(), strcmp(), strlen(), strrchr()
+#include <errno.h>          // Import errno
+#include <limits.h>         // Import UINT_MAX
+#include <fcntl.h>          // Import open()
+#include <dirent.h>         // Import DT_DIR
+#include <pthread.h>
+#include <unistd.h>         // Import close()
+#include <sys/stat.h>       // Import fstat()
+#include <linux/limits.h>   // Import PATH_MAX
+
+#define IMPORT_DIRBUF
+#define IMPORT_DIRINFO
+#define IMPORT_FILEINFO
+#include <mmv-impl.h>
+#include <mmv-impl-rep.h>
+#include <mmv-state.h>
+
+/*
+ * Workers stop reading ahead while more than PF_MAXBYTES
+ * of listings are waiting to be taken.
+ */
+
+#define PF_MAXBYTES    (256 * 1024 * 1024)
+#define PF_NSHARDS      16
+#define PF_TAB_INITSIZE 32
+#define PF_DQ_INITSIZE  64
+
+/*
+ * Subdirectories are queued below an entry to this many levels.
+ * PF_DEPTH_ALL means the whole tree, as for ';'.
+ */
+
+#define PF_DEPTH_ALL    UINT_MAX
+
+enum pf_state {
+    PF_QUEUED,          // In some deque; nobody has started on it
+    PF_RUNNING,         // Being read, by a worker or by the main thread
+    PF_READY,           // Listing is in |pe_db|
+    PF_FAILED,          // Could not be read; takedir() will try, itself
+    PF_TAKEN,           // Listing was handed to takedir()
+};
+
+struct pf_entry {
+    char *        pe_path;      // Directory, as checkdir() spells it
+    size_t        pe_hash;
+    unsigned int  pe_depth;     // Levels of subdirectories to queue
+    bool          pe_target;    // Needed only as a target of a rename
+    bool          pe_walk;      // Part of a ';' walk; subject to prune rules
+    DEVID         pe_dev;       // Device where the walk started; 0 = this one
+    enum pf_state pe_state;
+    dirbuf_t      pe_db;
+};
+
+struct pf_shard {
+    pthread_mutex_t    sh_lock;
+    struct pf_entry ** sh_tab;
+    size_t             sh_size;
+    size_t             sh_count;
+};
+
+struct pf_deque {
+    pthread_mutex_t    dq_lock;
+    struct pf_entry ** dq_vec;
+    size_t             dq_head;     // Thieves take from here
+    size_t             dq_tail;     // The owner pushes and pops here
+    size_t             dq_size;
+};
+
+struct pf_stats {
+    size_t worker_reads;    // Directories read by workers
+    size_t main_reads;      // ... read by the main thread, on demand
+    size_t steals;          // Entries taken from another worker's deque
+    size_t takes;           // Listings adopted by takedir()
+    size_t waits;           // Times takedir() had to wait for a worker
+    size_t misses;          // takedir() asked for a directory not in the table
+    size_t unused;          // Listings never asked for
+    size_t seeded;          // Starting directories of pattern lists
+    size_t queued;          // Directories of pairs, read ahead
+    size_t lazy;            // ... not read, because they would be lazy
+    size_t overcap;         // Directories not read, over the memory cap
+    size_t pruned;          // Subdirectories not queued, by prune rules
+    size_t toolong;         // Subdirectories left to the walk, paths too long
+    size_t nomem;           // Entries not read, or not queued, for lack of memory
+};
+
+/*
+ * Each shard of the table has its own lock, which protects only
+ * that shard's vector of entries.  |pf_lock| protects all entry
+ * states, the counters, and the statistics.  Each deque has its own lock.
+ * No two of these locks are ever held at the same time.
+ * |pf_cond| is broadcast on any change that someone might wait for.
+ */
+
+static pthread_mutex_t pf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pf_cond = PTHREAD_COND_INITIALIZER;
+
+static const mmv_t *pf_mmv;     // Prune rules; read-only while active
+static bool pf_active;          // Only the main thread changes this
+static bool pf_hold;            // Keep the pool up until prefetch_finish()
+static bool pf_stop;
+static bool pf_nomem;           // Some allocation failed; stop reading ahead
+static unsigned int pf_nthreads;
+static unsigned int pf_nrunning;
+static pthread_t *pf_threads;
+static struct pf_deque *pf_deques;
+static unsigned int pf_rr;      // Next deque for pushes by the main thread
+
+static struct pf_shard pf_shards[PF_NSHARDS];
+
+static size_t pf_pending;       // Entries QUEUED or RUNNING, plus reservations
+static size_t pf_bytes;         // Bytes held in READY listings
+static unsigned long pf_gen;    // Bumped whenever work is pushed
+
+static struct pf_stats pf_stats;
+
+/**
+ * @brief Hash a path (FNV-1a).
+ *
+ */
+
+static inline size_t
+pf_hash(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*s) {
+        h ^= (unsigned char)*s;
+        h *= 0x100000001b3ULL;
+        ++s;
+    }
+    return ((size_t)h);
+}
+
+/*
+ * The shard is chosen by the high bits of the hash;
+ * the slot within a shard, by the low bits.
+ */
+
+static inline struct pf_shard *
+pf_shard_of(size_t hash)
+{
+    return (&pf_shards[hash / (SIZE_MAX / PF_NSHARDS + 1)]);
+}
+
+/**
+ * @brief Find the entry for a path.  Call with the shard's lock held.
+ *
+ * @param sh      IN  pf_shard_of(hash)
+ * @param path    IN  key
+ * @param hash    IN  pf_hash(path)
+ * @param pslot   OUT slot where the entry is, or where it would go
+ * @return the entry, or NULL
+ *
+ */
+
+static struct pf_entry *
+pf_lookup(struct pf_shard *sh, const char *path, size_t hash, size_t *pslot)
+{
+    struct pf_entry *e;
+    size_t mask, slot;
+
+    mask = sh->sh_size - 1;
+    for (slot = hash & mask; (e = sh->sh_tab[slot]) != NULL; slot = (slot + 1) & mask) {
+        if (e->pe_hash == hash && strcmp(e->pe_path, path) == 0) {
+            break;
+        }
+    }
+    *pslot = slot;
+    return (e);
+}
+
+/**
+ * @brief Note that some allocation failed; the pool stops reading ahead.
+ *
+ * Call with none of the locks held.
+ *
+ */
+
+static void
+pf_out_of_memory(void)
+{
+    pthread_mutex_lock(&pf_lock);
+    pf_nomem = true;
+    ++pf_stats.nomem;
+    ++pf_gen;
+    pthread_cond_broadcast(&pf_cond);
+    pthread_mutex_unlock(&pf_lock);
+}
+
+/**
+ * @brief Double the size of a shard.  Call with the shard's lock held.
+ *
+ * If there is not enough memory, the shard is left as it was.
+ *
+ */
+
+static void
+pf_grow(struct pf_shard *sh)
+{
+    struct pf_entry **old_tab, **new_tab;
+    size_t old_size, i, mask, slot;
+
+    new_tab = (struct pf_entry **) mmv_try_alloc(2 * sh->sh_size * sizeof (struct pf_entry *));
+    if (new_tab == NULL) {
+        return;
+    }
+    old_tab = sh->sh_tab;
+    old_size = sh->sh_size;
+    sh->sh_size *= 2;
+    sh->sh_tab = new_tab;
+    memset(sh->sh_tab, 0, sh->sh_size * sizeof (struct pf_entry *));
+    mask = sh->sh_size - 1;
+    for (i = 0; i < old_size; ++i) {
+        if (old_tab[i] == NULL) {
+            continue;
+        }
+        slot = old_tab[i]->pe_hash & mask;
+        while (sh->sh_tab[slot] != NULL) {
+            slot = (slot + 1) & mask;
+        }
+        sh->sh_tab[slot] = old_tab[i];
+    }
+    free(old_tab);
+}
+
+/**
+ * @brief Add a new QUEUED entry to the table.
+ *
+ * @param path   IN  key; it is copied
+ * @param len    IN  strlen(path)
+ * @param proto  IN  depth, target, walk and device for the new entry
+ * @return the new entry, or NULL if there already is one,
+ *         or if there is not enough memory for it
+ *
+ * The caller must already have counted the entry in |pf_pending|,
+ * so that no worker can see the count drop to 0 while the entry
+ * is on its way to a deque.
+ *
+ */
+
+static struct pf_entry *
+pf_register(const char *path, size_t len, const struct pf_entry *proto)
+{
+    struct pf_shard *sh;
+    struct pf_entry *e;
+    size_t hash, slot;
+
+    hash = pf_hash(path);
+    sh = pf_shard_of(hash);
+    pthread_mutex_lock(&sh->sh_lock);
+    if (pf_lookup(sh, path, hash, &slot) != NULL) {
+        pthread_mutex_unlock(&sh->sh_lock);
+        return (NULL);
+    }
+    // A shard that could not grow must still keep one slot empty.
+    e = NULL;
+    if (sh->sh_count + 2 <= sh->sh_size) {
+        e = (struct pf_entry *) mmv_try_alloc(sizeof (struct pf_entry));
+    }
+    if (e != NULL && (e->pe_path = (char *) mmv_try_alloc(len + 1)) == NULL) {
+        free(e);
+        e = NULL;
+    }
+    if (e == NULL) {
+        pthread_mutex_unlock(&sh->sh_lock);
+        pf_out_of_memory();
+        return (NULL);
+    }
+    memcpy(e->pe_path, path, len + 1);
+    e->pe_hash = hash;
+    e->pe_depth = proto->pe_depth;
+    e->pe_target = proto->pe_target;
+    e->pe_walk = proto->pe_walk;
+    e->pe_dev = proto->pe_dev;
+    e->pe_state = PF_QUEUED;
+    memset(&e->pe_db, 0, sizeof (dirbuf_t));
+    sh->sh_tab[slot] = e;
+    if (++sh->sh_count * 2 > sh->sh_size) {
+        pf_grow(sh);
+    }
+    pthread_mutex_unlock(&sh->sh_lock);
+    return (e);
+}
+
+/**
+ * @brief Add to, and then take back from, the count of pending entries.
+ *
+ * Workers waiting for work are woken up.
+ *
+ */
+
+static void
+pf_pending_adjust(size_t nadd, size_t nsub)
+{
+    pthread_mutex_lock(&pf_lock);
+    pf_pending += nadd;
+    pf_pending -= nsub;
+    ++pf_gen;
+    pthread_cond_broadcast(&pf_cond);
+    pthread_mutex_unlock(&pf_lock);
+}
+
+/**
+ * @brief Push an entry onto the owner's end of a deque.
+ *
+ * @return false if there is not enough memory; see pf_drop()
+ *
+ */
+
+static bool
+dq_push(struct pf_deque *dq, struct pf_entry *e)
+{
+    struct pf_entry **new_vec;
+
+    pthread_mutex_lock(&dq->dq_lock);
+    if (dq->dq_tail == dq->dq_size) {
+        if (dq->dq_head != 0) {
+            memmove(dq->dq_vec, dq->dq_vec + dq->dq_head,
+                (dq->dq_tail - dq->dq_head) * sizeof (struct pf_entry *));
+            dq->dq_tail -= dq->dq_head;
+            dq->dq_head = 0;
+        }
+        if (dq->dq_tail == dq->dq_size) {
+            new_vec = (struct pf_entry **) mmv_try_realloc(dq->dq_vec, 2 * dq->dq_size * sizeof (struct pf_entry *));
+            if (new_vec == NULL) {
+                pthread_mutex_unlock(&dq->dq_lock);
+                pf_out_of_memory();
+                return (false);
+            }
+            dq->dq_vec = new_vec;
+            dq->dq_size *= 2;
+        }
+    }
+    dq->dq_vec[dq->dq_tail++] = e;
+    pthread_mutex_unlock(&dq->dq_lock);
+    return (true);
+}
+
+/**
+ * @brief Give up on an entry that is in the table, but could not be queued.
+ *
+ * No worker will ever find it, so takedir() reads it, itself.
+ * The caller still owes |pf_pending| for it.
+ *
+ */
+
+static void
+pf_drop(struct pf_entry *e)
+{
+    pthread_mutex_lock(&pf_lock);
+    e->pe_state = PF_FAILED;
+    pthread_mutex_unlock(&pf_lock);
+}
+
+/**
+ * @brief Take an entry from the owner's end (newest) or the thief's end (oldest).
+ *
+ */
+
+static struct pf_entry *
+dq_take(struct pf_deque *dq, bool steal)
+{
+    struct pf_entry *e;
+
+    e = NULL;
+    pthread_mutex_lock(&dq->dq_lock);
+    if (dq->dq_head < dq->dq_tail) {
+        e = steal ? dq->dq_vec[dq->dq_head++] : dq->dq_vec[--dq->dq_tail];
+        if (dq->dq_head == dq->dq_tail) {
+            dq->dq_head = dq->dq_tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&dq->dq_lock);
+    return (e);
+}
+
+/**
+ * @brief Tell whether a walk would not enter this directory, because of -O.
+ *
+ * @param e   INOUT  entry being read; the first directory of a walk
+ *                   sets |pe_dev|, for its subdirectories to inherit
+ * @param fd  IN     open directory
+ * @return true if it is on another filesystem than where the walk started
+ *
+ */
+
+static bool
+pf_crosses_fs(struct pf_entry *e, int fd)
+{
+    struct stat dstat;
+
+    if (!e->pe_walk || !pf_mmv->walk_onefs || fstat(fd, &dstat) != 0) {
+        return (false);
+    }
+    if (e->pe_dev == 0) {
+        e->pe_dev = dstat.st_dev;
+        return (false);
+    }
+    return (dstat.st_dev != e->pe_dev);
+}
+
+/**
+ * @brief Read and sort one directory; queue up its subdirectories.
+ *
+ * @param e     INOUT  entry, already in state PF_RUNNING
+ * @param self  IN     index of the deque to push subdirectories onto
+ *
+ * Only subdirectories that the walk in dostage_patterns() would
+ * descend into are queued: names that do not start with '.',
+ * that are known from d_type to be directories, and that
+ * no prune rule excludes, if the entry is part of a walk.
+ * Nothing is queued below an entry of depth 0.
+ * A target directory big enough to be probed lazily is not read;
+ * the entry just fails, and takedir() reads it, if it ever must.
+ *
+ */
+
+static void
+pf_scan(struct pf_entry *e, unsigned int self)
+{
+    char path[PATH_MAX];
+    dirbuf_t db;
+    struct dirbuf_rec *rec;
+    struct pf_entry *child;
+    struct pf_entry **kids;
+    struct pf_entry proto;
+    struct stat dstat;
+    size_t ncand, nkids, npushed, npruned, ntoolong, pos, plen, nlen, i;
+    bool lazy;
+    int fd;
+    int err;
+
+    memset(&db, 0, sizeof (dirbuf_t));
+    lazy = false;
+    fd = open(e->pe_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0 && e->pe_target && fstat(fd, &dstat) == 0 && dir_lazy_candidate(&dstat)) {
+        close(fd);
+        lazy = true;
+        err = EFBIG;
+    }
+    else if (fd >= 0 && pf_crosses_fs(e, fd)) {
+        close(fd);
+        err = EXDEV;
+    }
+    else {
+        err = (fd < 0) ? errno : extdir_read_small(fd, &db);
+    }
+
+    kids = NULL;
+    ncand = 0;
+    nkids = 0;
+    npushed = 0;
+    npruned = 0;
+    ntoolong = 0;
+    if (err == 0 && (err = dirbuf_try_sort(&db)) != 0) {
+        dirbuf_free(&db);
+    }
+    if (err == ENOMEM) {
+        pf_out_of_memory();
+    }
+    if (err == 0 && e->pe_depth != 0) {
+        proto.pe_depth = (e->pe_depth == PF_DEPTH_ALL) ? PF_DEPTH_ALL : e->pe_depth - 1;
+        proto.pe_target = false;
+        proto.pe_walk = e->pe_walk;
+        proto.pe_dev = e->pe_dev;
+        for (pos = 0; pos < db.db_len; pos += rec->d_reclen) {
+            rec = (struct dirbuf_rec *)(db.db_buf + pos);
+            if (rec->d_type == DT_DIR && rec->d_name[0] != '.') {
+                ++ncand;
+            }
+        }
+    }
+    if (ncand != 0) {
+        pf_pending_adjust(ncand, 0);
+        kids = (struct pf_entry **) mmv_try_alloc(ncand * sizeof (struct pf_entry *));
+        if (kids == NULL) {
+            // takedir() reads each of them, itself, when it gets there.
+            pf_out_of_memory();
+        }
+    }
+    if (kids != NULL) {
+        plen = strlen(e->pe_path);
+        if (plen == 1 && e->pe_path[0] == '.') {
+            // checkdir() says "." for what pathbuf spells as ""
+            plen = 0;
+        }
+        else {
+            memcpy(path, e->pe_path, plen);
+            if (path[plen - 1] != '/') {
+                path[plen++] = '/';
+            }
+        }
+
+        for (pos = 0; pos < db.db_len; pos += rec->d_reclen) {
+            rec = (struct dirbuf_rec *)(db.db_buf + pos);
+            if (rec->d_type != DT_DIR || rec->d_name[0] == '.') {
+                continue;
+            }
+            nlen = strlen(rec->d_name);
+            if (plen + nlen + 1 >= PATH_MAX) {
+                // The walk reads it, piece by piece; see long_path_at().
+                ++ntoolong;
+                continue;
+            }
+            if (e->pe_walk && walk_pruned(pf_mmv, rec->d_name)) {
+                ++npruned;
+                continue;
+            }
+            memcpy(path + plen, rec->d_name, nlen + 1);
+            child = pf_register(path, plen + nlen, &proto);
+            if (child != NULL) {
+                kids[nkids++] = child;
+            }
+        }
+    }
+
+    // Push in reverse, so that the owner pops them in order of name.
+    for (i = nkids; i > 0; --i) {
+        if (dq_push(&pf_deques[self], kids[i - 1])) {
+            ++npushed;
+        }
+        else {
+            pf_drop(kids[i - 1]);
+        }
+    }
+    free(kids);
+
+    pthread_mutex_lock(&pf_lock);
+    if (err == 0) {
+        e->pe_db = db;
+        e->pe_state = PF_READY;
+        pf_bytes += db.db_size;
+    }
+    else {
+        e->pe_state = PF_FAILED;
+        if (lazy) {
+            ++pf_stats.lazy;
+        }
+        else if (err == EXDEV) {
+            ++pf_stats.pruned;
+        }
+        else if (err == EFBIG) {
+            ++pf_stats.overcap;
+        }
+    }
+    pf_stats.pruned += npruned;
+    pf_stats.toolong += ntoolong;
+    // This entry, and the reservations for subdirectories not queued.
+    pf_pending -= 1 + (ncand - npushed);
+    ++pf_gen;
+    pthread_cond_broadcast(&pf_cond);
+    pthread_mutex_unlock(&pf_lock);
+}
+
+/**
+ * @brief Find work for a worker: own deque first, then steal.
+ *
+ */
+
+static struct pf_entry *
+pf_find_work(unsigned int self)
+{
+    struct pf_entry *e;
+    unsigned int i;
+
+    e = dq_take(&pf_deques[self], false);
+    for (i = 1; e == NULL && i < pf_nthreads; ++i) {
+        e = dq_take(&pf_deques[(self + i) % pf_nthreads], true);
+        if (e != NULL) {
+            pthread_mutex_lock(&pf_lock);
+            ++pf_stats.steals;
+            pthread_mutex_unlock(&pf_lock);
+        }
+    }
+    return (e);
+}
+
+static void *
+pf_worker(void *arg)
+{
+    unsigned int self = (unsigned int)(uintptr_t)arg;
+    struct pf_entry *e;
+    unsigned long gen;
+
+    for (;;) {
+        pthread_mutex_lock(&pf_lock);
+        while (!pf_stop && !pf_nomem && pf_bytes > PF_MAXBYTES) {
+            pthread_cond_wait(&pf_cond, &pf_lock);
+        }
+        if (pf_stop || pf_nomem || (pf_pending == 0 && !pf_hold)) {
+            pthread_mutex_unlock(&pf_lock);
+            break;
+        }
+        gen = pf_gen;
+        pthread_mutex_unlock(&pf_lock);
+
+        e = pf_find_work(self);
+        if (e == NULL) {
+            pthread_mutex_lock(&pf_lock);
+            while (!pf_stop && (pf_pending != 0 || pf_hold) && pf_gen == gen) {
+                pthread_cond_wait(&pf_cond, &pf_lock);
+            }
+            pthread_mutex_unlock(&pf_lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&pf_lock);
+        if (e->pe_state != PF_QUEUED) {
+            // The main thread got to it first.
+            pthread_mutex_unlock(&pf_lock);
+            continue;
+        }
+        e->pe_state = PF_RUNNING;
+        ++pf_stats.worker_reads;
+        pthread_mutex_unlock(&pf_lock);
+
+        pf_scan(e, self);
+    }
+    return (NULL);
+}
+
+/**
+ * @brief Set up an empty table and |n| empty deques.
+ *
+ */
+
+static void
+pf_setup(const mmv_t *mmv, unsigned int n)
+{
+    struct pf_shard *sh;
+    unsigned int i;
+
+    for (i = 0; i < PF_NSHARDS; ++i) {
+        sh = &pf_shards[i];
+        pthread_mutex_init(&sh->sh_lock, NULL);
+        sh->sh_size = PF_TAB_INITSIZE;
+        sh->sh_tab = (struct pf_entry **) mmv_alloc(sh->sh_size * sizeof (struct pf_entry *));
+        memset(sh->sh_tab, 0, sh->sh_size * sizeof (struct pf_entry *));
+        sh->sh_count = 0;
+    }
+    pf_pending = 0;
+    pf_bytes = 0;
+    pf_stop = false;
+    pf_nomem = false;
+    pf_hold = false;
+    pf_rr = 0;
+    pf_deques = (struct pf_deque *) mmv_alloc(n * sizeof (struct pf_deque));
+    for (i = 0; i < n; ++i) {
+        pthread_mutex_init(&pf_deques[i].dq_lock, NULL);
+        pf_deques[i].dq_size = PF_DQ_INITSIZE;
+        pf_deques[i].dq_vec = (struct pf_entry **) mmv_alloc(PF_DQ_INITSIZE * sizeof (struct pf_entry *));
+        pf_deques[i].dq_head = 0;
+        pf_deques[i].dq_tail = 0;
+    }
+    pf_nthreads = n;
+    pf_mmv = mmv;
+    pf_active = true;
+}
+
+static void
+pf_launch(void)
+{
+    unsigned int i;
+
+    pf_threads = (pthread_t *) mmv_alloc(pf_nthreads * sizeof (pthread_t));
+    pf_nrunning = 0;
+    for (i = 0; i < pf_nthreads; ++i) {
+        if (pthread_create(&pf_threads[pf_nrunning], NULL, pf_worker, (void *)(uintptr_t)i) == 0) {
+            ++pf_nrunning;
+        }
+    }
+    // Even with no threads at all, takedir() reads queued
+    // directories itself, so the results are the same.
+}
+
+/**
+ * @brief Queue the subdirectories of a directory that has already been read.
+ *
+ * @param prefix  IN  path of the directory, as in pathbuf:
+ *                    empty, or with a trailing slash
+ * @param di      IN  that directory
+ * @return number of entries queued
+ *
+ * Subdirectories are dealt to the deques round-robin, in reverse,
+ * so that each worker starts on the first of its share.
+ * Subdirectories the walk would prune are not queued.
+ *
+ */
+
+static size_t
+pf_seed_tree(const char *prefix, DIRINFO *di)
+{
+    char path[PATH_MAX];
+    FILEINFO *f;
+    struct pf_entry *e;
+    struct pf_entry proto;
+    unsigned int i;
+    size_t plen, nlen, nseeds, npruned, ntoolong;
+
+    if (pf_mmv->walk_maxdepth == 0) {
+        proto.pe_depth = PF_DEPTH_ALL;
+    }
+    else {
+        proto.pe_depth = pf_mmv->walk_maxdepth - 1;
+    }
+    proto.pe_target = false;
+    proto.pe_walk = true;
+    proto.pe_dev = di->di_vid;
+
+    plen = strlen(prefix);
+    memcpy(path, prefix, plen);
+    pf_pending_adjust(di->di_nfils, 0);
+    nseeds = 0;
+    npruned = 0;
+    ntoolong = 0;
+    for (i = di->di_nfils; i > 0; --i) {
+        f = di->di_fils[i - 1];
+        if (f->fi_name[0] == '.' || (f->fi_stflags & (FI_TYPEKNOWN | FI_ISDIR)) != (FI_TYPEKNOWN | FI_ISDIR)) {
+            continue;
+        }
+        nlen = f->fi_len;
+        if (plen + nlen + 1 >= PATH_MAX) {
+            // The walk reads it, piece by piece; see long_path_at().
+            ++ntoolong;
+            continue;
+        }
+        if (walk_pruned(pf_mmv, f->fi_name)) {
+            ++npruned;
+            continue;
+        }
+        memcpy(path + plen, f->fi_name, nlen + 1);
+        e = pf_register(path, plen + nlen, &proto);
+        if (e == NULL) {
+            continue;
+        }
+        if (dq_push(&pf_deques[pf_rr++ % pf_nthreads], e)) {
+            ++nseeds;
+        }
+        else {
+            pf_drop(e);
+        }
+    }
+    pthread_mutex_lock(&pf_lock);
+    pf_stats.pruned += npruned;
+    pf_stats.toolong += ntoolong;
+    pthread_mutex_unlock(&pf_lock);
+    pf_pending_adjust(0, di->di_nfils - nseeds);
+    return (nseeds);
+}
+
+/**
+ * @brief Start reading the tree below a ';', in parallel.
+ *
+ * @param mmv
+ * @param prefix  IN  directory where ';' applies, as in pathbuf:
+ *                    empty, or with a trailing slash
+ * @param di      IN  that directory, already read
+ * @return true if the worker threads were started
+ *
+ * Nothing is done if prefetch is turned off, if it is already
+ * running for some enclosing ';', or if there are no subdirectories.
+ * If the pool is being held up for a list of patterns, then the tree
+ * is queued for that pool, but false is returned, because the pool
+ * belongs to the list.
+ * The caller must call prefetch_finish() if, and only if,
+ * prefetch_start() returned true.
+ *
+ */
+
+bool
+prefetch_start(mmv_t *mmv, const char *prefix, DIRINFO *di)
+{
+    if (pf_active) {
+        if (pf_hold) {
+            pf_seed_tree(prefix, di);
+        }
+        return (false);
+    }
+    if (mmv->scan_threads == 0) {
+        return (false);
+    }
+
+    pf_setup(mmv, mmv->scan_threads);
+    if (pf_seed_tree(prefix, di) == 0) {
+        prefetch_finish();
+        return (false);
+    }
+    pf_launch();
+    return (true);
+}
+
+/**
+ * @brief Start an idle pool, which stays up until prefetch_finish().
+ *
+ * @param mmv
+ * @return true if the pool was started
+ *
+ * Work is given to the pool with prefetch_queue_dir(), and a ';'
+ * in any pattern adds its tree to the same pool.
+ * The caller must call prefetch_finish() if, and only if,
+ * prefetch_hold() returned true.
+ *
+ */
+
+bool
+prefetch_hold(mmv_t *mmv)
+{
+    if (pf_active || mmv->scan_threads == 0) {
+        return (false);
+    }
+
+    pf_setup(mmv, mmv->scan_threads);
+    pf_hold = true;
+    pf_launch();
+    return (true);
+}
+
+/**
+ * @brief Queue one directory to be read by the pool started by prefetch_hold().
+ *
+ * @param path    IN  directory, as checkdir() passes it to takedir()
+ * @param depth   IN  how many levels of subdirectories below it
+ *                    to read, as well
+ * @param walk    IN  true if a ';' walk starts |depth| levels below it
+ * @param target  IN  true if it is needed only as the target of a rename
+ * @return true if it was queued; false if there is no such pool,
+ *         or if the directory was queued before
+ *
+ * Directories are dealt round-robin, so they are read in about
+ * the order in which they are queued.
+ * Below a ';', the prune rules apply, and the walk goes no deeper
+ * than mmv_set_walk_maxdepth() allows, just as in pf_seed_tree().
+ *
+ */
+
+bool
+prefetch_queue_dir(const char *path, unsigned int depth, bool walk, bool target)
+{
+    struct pf_entry *e;
+    struct pf_entry proto;
+
+    if (!pf_hold) {
+        return (false);
+    }
+
+    if (walk && pf_mmv->walk_maxdepth == 0) {
+        proto.pe_depth = PF_DEPTH_ALL;
+    }
+    else if (walk && pf_mmv->walk_maxdepth < PF_DEPTH_ALL - depth) {
+        proto.pe_depth = depth + pf_mmv->walk_maxdepth;
+    }
+    else if (walk) {
+        proto.pe_depth = PF_DEPTH_ALL - 1;
+    }
+    else {
+        proto.pe_depth = depth;
+    }
+    proto.pe_target = target;
+    proto.pe_walk = walk;
+    proto.pe_dev = 0;
+    pf_pending_adjust(1, 0);
+    e = pf_register(path, strlen(path), &proto);
+    if (e != NULL && dq_push(&pf_deques[pf_rr++ % pf_nthreads], e)) {
+        pf_pending_adjust(0, 0);
+        return (true);
+    }
+    if (e != NULL) {
+        pf_drop(e);
+    }
+    pf_pending_adjust(0, 1);
+    return (false);
+}
+
+/**
+ * @brief Start reading the starting directories of a list of patterns.
+ *
+ * @param mmv
+ * @param paths   IN  directories, as checkdir() passes them to takedir()
+ * @param depths  IN  for each directory, how many levels of subdirectories
+ *                    below it to read, as well
+ * @param walks   IN  for each directory, whether a ';' walk follows;
+ *                    see prefetch_queue_dir()
+ * @param n       IN  number of directories
+ * @return true if the worker threads were started
+ *
+ * The caller must call prefetch_finish() if, and only if,
+ * prefetch_start_dirs() returned true.
+ *
+ */
+
+bool
+prefetch_start_dirs(mmv_t *mmv, char *const *paths, const unsigned int *depths, const bool *walks, size_t n)
+{
+    size_t i;
+
+    if (n == 0 || !prefetch_hold(mmv)) {
+        return (false);
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (prefetch_queue_dir(paths[i], depths[i], walks[i], false)) {
+            ++pf_stats.seeded;
+        }
+    }
+    return (true);
+}
+
+/**
+ * @brief Get the directory part of a filename, as checkdir() spells it.
+ *
+ * @param fname  IN   filename, with no wildcards
+ * @param dir    OUT  directory
+ * @param sz     IN   capacity of |dir|
+ * @return true if |dir| was filled in
+ *
+ */
+
+static bool
+fname_dir(const char *fname, char *dir, size_t sz)
+{
+    const char *slash;
+    size_t len;
+
+    if (fname[0] == '~' && fname[1] == '/') {
+        return (false);
+    }
+    slash = strrchr(fname, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+        return (true);
+    }
+    if (slash == fname) {
+        strcpy(dir, "/");
+        return (true);
+    }
+    len = slash - fname;
+    if (len >= sz) {
+        return (false);
+    }
+    memcpy(dir, fname, len);
+    dir[len] = '\0';
+    return (true);
+}
+
+/**
+ * @brief Queue the directories of a { from->to } pair of filenames.
+ *
+ * @param from  IN  'from' filename, as read
+ * @param to    IN  'to' filename, as read
+ *
+ * Does nothing unless a pool was started by prefetch_hold().
+ * Names that need ~-expansion are left alone.
+ *
+ */
+
+void
+prefetch_queue_pair(const char *from, const char *to)
+{
+    char dir[PATH_MAX];
+
+    if (!pf_hold) {
+        return;
+    }
+    if (fname_dir(from, dir, sizeof (dir)) && prefetch_queue_dir(dir, 0, false, false)) {
+        ++pf_stats.queued;
+    }
+    if (fname_dir(to, dir, sizeof (dir)) && prefetch_queue_dir(dir, 0, false, true)) {
+        ++pf_stats.queued;
+    }
+}
+
+/**
+ * @brief Get the prefetched listing of a directory, if there is one.
+ *
+ * @param path    IN   directory, as checkdir() spells it
+ * @param db      OUT  sorted listing; the caller must dirbuf_free() it
+ * @return true if |db| was filled in
+ *
+ */
+
+bool
+prefetch_take(const char *path, dirbuf_t *db)
+{
+    struct pf_shard *sh;
+    struct pf_entry *e;
+    size_t hash, slot;
+
+    if (!pf_active) {
+        return (false);
+    }
+
+    hash = pf_hash(path);
+    sh = pf_shard_of(hash);
+    pthread_mutex_lock(&sh->sh_lock);
+    e = pf_lookup(sh, path, hash, &slot);
+    pthread_mutex_unlock(&sh->sh_lock);
+
+    pthread_mutex_lock(&pf_lock);
+    if (e == NULL) {
+        ++pf_stats.misses;
+        pthread_mutex_unlock(&pf_lock);
+        return (false);
+    }
+
+    if (e->pe_state == PF_QUEUED) {
+        e->pe_state = PF_RUNNING;
+        ++pf_stats.main_reads;
+        pthread_mutex_unlock(&pf_lock);
+        pf_scan(e, pf_rr++ % pf_nthreads);
+        pthread_mutex_lock(&pf_lock);
+    }
+    else if (e->pe_state == PF_RUNNING) {
+        ++pf_stats.waits;
+    }
+    while (e->pe_state == PF_RUNNING) {
+        pthread_cond_wait(&pf_cond, &pf_lock);
+    }
+
+    if (e->pe_state != PF_READY) {
+        pthread_mutex_unlock(&pf_lock);
+        return (false);
+    }
+    *db = e->pe_db;
+    memset(&e->pe_db, 0, sizeof (dirbuf_t));
+    e->pe_state = PF_TAKEN;
+    pf_bytes -= db->db_size;
+    ++pf_stats.takes;
+    pthread_cond_broadcast(&pf_cond);
+    pthread_mutex_unlock(&pf_lock);
+    return (true);
+}
+
+/**
+ * @brief Stop the worker threads and discard all listings not taken.
+ *
+ */
+
+void
+prefetch_finish(void)
+{
+    struct pf_shard *sh;
+    struct pf_entry *e;
+    size_t i, j;
+
+    if (!pf_active) {
+        return;
+    }
+
+    pthread_mutex_lock(&pf_lock);
+    pf_stop = true;
+    pthread_cond_broadcast(&pf_cond);
+    pthread_mutex_unlock(&pf_lock);
+
+    for (i = 0; i < pf_nrunning; ++i) {
+        pthread_join(pf_threads[i], NULL);
+    }
+    free(pf_threads);
+    pf_threads = NULL;
+    pf_nrunning = 0;
+
+    for (j = 0; j < PF_NSHARDS; ++j) {
+        sh = &pf_shards[j];
+        for (i = 0; i < sh->sh_size; ++i) {
+            e = sh->sh_tab[i];
+            if (e == NULL) {
+                continue;
+            }
+            if (e->pe_state == PF_READY) {
+                ++pf_stats.unused;
+            }
+            dirbuf_free(&e->pe_db);
+            free(e->pe_path);
+            free(e);
+        }
+        free(sh->sh_tab);
+        sh->sh_tab = NULL;
+        sh->sh_size = 0;
+        sh->sh_count = 0;
+        pthread_mutex_destroy(&sh->sh_lock);
+    }
+
+    for (i = 0; i < pf_nthreads; ++i) {
+        pthread_mutex_destroy(&pf_deques[i].dq_lock);
+        free(pf_deques[i].dq_vec);
+    }
+    free(pf_deques);
+    pf_deques = NULL;
+    pf_nthreads = 0;
+    pf_hold = false;
+    pf_active = false;
+}
+
+/**
+ * @brief Print counters of the parallel prefetch.
+ *
+ * @param f  IN  Where to print
+ *
+ */
+
+void
+fdump_prefetch_stats(FILE *f)
+{
+    fprintf(f, "prefetch:\n");
+    fprintf(f, "    reads: worker=%zu, main=%zu, steals=%zu, over cap=%zu\n",
+        pf_stats.worker_reads, pf_stats.main_reads, pf_stats.steals, pf_stats.overcap);
+    fprintf(f, "    takedir: takes=%zu, waits=%zu, misses=%zu, unused=%zu\n",
+        pf_stats.takes, pf_stats.waits, pf_stats.misses, pf_stats.unused);
+    fprintf(f, "    pattern lists: seeded=%zu\n", pf_stats.seeded);
+    fprintf(f, "    pairs: queued=%zu, lazy=%zu\n", pf_stats.queued, pf_stats.lazy);
+    fprintf(f, "    walk: pruned=%zu, too long=%zu\n", pf_stats.pruned, pf_stats.toolong);
+    fprintf(f, "    out of memory: entries=%zu\n", pf_stats.nomem);
+}
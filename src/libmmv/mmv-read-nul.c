@@ -90,12 +90,11 @@ int
 mmv_get_pairs_nul(mmv_t *mmv, FILE *f)
 {
     int rv;
-    size_t rlen;
 
     mmv->encoding = ENCODE_NUL;
     while (true) {
         mmv->paterr = 0;
-        rv = get_filename_nul(f, mmv->from, MAXPATLEN, &rlen);
+        rv = readahead_next(mmv, f, get_filename_nul, false);
         if (rv == EOF) {
             rv = 0;
             break;
@@ -103,16 +102,6 @@ mmv_get_pairs_nul(mmv_t *mmv, FILE *f)
         if (rv) {
             break;
         }
-        mmv->fromlen = rlen;
-        rv = get_filename_nul(f, mmv->to, MAXPATLEN, &rlen);
-        if (rv == EOF) {
-            rv = 0;
-            break;
-        }
-        if (rv) {
-            break;
-        }
-        mmv->tolen = rlen;
         dbg_println_str("from=", mmv->from);
         dbg_println_str("to  =", mmv->to);
 
@@ -127,7 +116,8 @@ mmv_get_pairs_nul(mmv_t *mmv, FILE *f)
         }
 
         if (mmv->paterr) {
-            return (mmv->paterr);
+            rv = mmv->paterr;
+            break;
         }
 
         extern int parse_src_fname(mmv_t *mmv);
@@ -137,16 +127,18 @@ mmv_get_pairs_nul(mmv_t *mmv, FILE *f)
         err = parse_src_fname(mmv);
         if (err) {
             mmv->paterr = 1;
-            return (err);
+            rv = err;
+            break;
         }
 
         err = parse_dst_fname(mmv);
         if (err) {
             mmv->paterr = 1;
-            return (err);
+            rv = err;
+            break;
         }
 
-        if (dostage_fnames(mmv, mmv->from, mmv->pathbuf, 0, 0)) {
+        if (dostage_fnames(mmv, mmv->from, mmv->pathbuf, 0)) {
             printf("%s -> %s : no match.\n", mmv->from, mmv->to);
             mmv->paterr = 1;
         }
@@ -156,5 +148,6 @@ mmv_get_pairs_nul(mmv_t *mmv, FILE *f)
         }
     }
 
+    readahead_finish();
     return (rv);
 }
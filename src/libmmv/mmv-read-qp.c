@@ -108,12 +108,11 @@ int
 mmv_get_pairs_qp(mmv_t *mmv, FILE *f)
 {
     int rv;
-    size_t rlen;
 
     mmv->encoding = ENCODE_QP;
     while (true) {
         mmv->paterr = 0;
-        rv = get_filename_qp(f, mmv->from, MAXPATLEN, &rlen);
+        rv = readahead_next(mmv, f, get_filename_qp, false);
         if (rv == EOF) {
             rv = 0;
             break;
@@ -121,16 +120,6 @@ mmv_get_pairs_qp(mmv_t *mmv, FILE *f)
         if (rv) {
             break;
         }
-        mmv->fromlen = rlen;
-        rv = get_filename_qp(f, mmv->to, MAXPATLEN, &rlen);
-        if (rv == EOF) {
-            rv = 0;
-            break;
-        }
-        if (rv) {
-            break;
-        }
-        mmv->tolen = rlen;
         dbg_println_str("from=", mmv->from);
         dbg_println_str("to  =", mmv->to);
 
@@ -145,7 +134,8 @@ mmv_get_pairs_qp(mmv_t *mmv, FILE *f)
         }
 
         if (mmv->paterr) {
-            return (mmv->paterr);
+            rv = mmv->paterr;
+            break;
         }
 
         extern int parse_src_fname(mmv_t *mmv);
@@ -155,16 +145,18 @@ mmv_get_pairs_qp(mmv_t *mmv, FILE *f)
         err = parse_src_fname(mmv);
         if (err) {
             mmv->paterr = 1;
-            return (err);
+            rv = err;
+            break;
         }
 
         err = parse_dst_fname(mmv);
         if (err) {
             mmv->paterr = 1;
-            return (err);
+            rv = err;
+            break;
         }
 
-        if (dostage_fnames(mmv, mmv->from, mmv->pathbuf, 0, 0)) {
+        if (dostage_fnames(mmv, mmv->from, mmv->pathbuf, 0)) {
             printf("%s -> %s : no match.\n", mmv->from, mmv->to);
             mmv->paterr = 1;
         }
@@ -174,5 +166,6 @@ mmv_get_pairs_qp(mmv_t *mmv, FILE *f)
         }
     }
 
+    readahead_finish();
     return (rv);
 }
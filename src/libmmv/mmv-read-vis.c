@@ -110,12 +110,11 @@ int
 mmv_get_pairs_vis(mmv_t *mmv, FILE *f)
 {
     int rv;
-    size_t rlen;
 
     mmv->encoding = ENCODE_VIS;
     while (true) {
         mmv->paterr = 0;
-        rv = get_filename_vis(f, mmv->from, MAXPATLEN, &rlen);
+        rv = readahead_next(mmv, f, get_filename_vis, false);
         if (rv == EOF) {
             rv = 0;
             break;
@@ -123,16 +122,6 @@ mmv_get_pairs_vis(mmv_t *mmv, FILE *f)
         if (rv) {
             break;
         }
-        mmv->fromlen = rlen;
-        rv = get_filename_vis(f, mmv->to, MAXPATLEN, &rlen);
-        if (rv == EOF) {
-            rv = 0;
-            break;
-        }
-        if (rv) {
-            break;
-        }
-        mmv->tolen = rlen;
         dbg_println_str("from=", mmv->from);
         dbg_println_str("to  =", mmv->to);
 
@@ -147,7 +136,8 @@ mmv_get_pairs_vis(mmv_t *mmv, FILE *f)
         }
 
         if (mmv->paterr) {
-            return (mmv->paterr);
+            rv = mmv->paterr;
+            break;
         }
 
         extern int parse_src_fname(mmv_t *mmv);
@@ -157,16 +147,18 @@ mmv_get_pairs_vis(mmv_t *mmv, FILE *f)
         err = parse_src_fname(mmv);
         if (err) {
             mmv->paterr = 1;
-            return (err);
+            rv = err;
+            break;
         }
 
         err = parse_dst_fname(mmv);
         if (err) {
             mmv->paterr = 1;
-            return (err);
+            rv = err;
+            break;
         }
 
-        if (dostage_fnames(mmv, mmv->from, mmv->pathbuf, 0, 0)) {
+        if (dostage_fnames(mmv, mmv->from, mmv->pathbuf, 0)) {
             printf("%s -> %s : no match.\n", mmv->from, mmv->to);
             mmv->paterr = 1;
         }
@@ -176,5 +168,6 @@ mmv_get_pairs_vis(mmv_t *mmv, FILE *f)
         }
     }
 
+    readahead_finish();
     return (rv);
 }
@@ -108,11 +108,10 @@ int
 mmv_get_pairs_xnn(mmv_t *mmv, FILE *f)
 {
     int rv;
-    size_t rlen;
 
     mmv->encoding = ENCODE_XNN;
     while (true) {
-        rv = get_filename_xnn(f, mmv->from, MAXPATLEN, &rlen);
+        rv = readahead_next(mmv, f, get_filename_xnn, true);
         if (rv == EOF) {
             rv = 0;
             break;
@@ -120,24 +119,16 @@ mmv_get_pairs_xnn(mmv_t *mmv, FILE *f)
         if (rv) {
             break;
         }
-        mmv->fromlen = rlen;
-        rv = get_filename_xnn(f, mmv->to, MAXPATLEN, &rlen);
-        if (rv == EOF) {
-            rv = 0;
-            break;
-        }
-        if (rv) {
-            break;
-        }
-        mmv->tolen = rlen;
         dbg_println_str("from=", mmv->from);
         dbg_println_str("to  =", mmv->to);
 
         matchpat(mmv);
         if (mmv->paterr) {
-            return (-1);
+            rv = -1;
+            break;
         }
     }
 
+    readahead_finish();
     return (rv);
 }
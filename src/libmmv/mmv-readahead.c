@@ -0,0 +1,190 @@
+/*
+ * Filename: src/libmmv/mmv-readahead.c
+ * Library: libmmv
+ * Brief: Decode { from->to } pairs a window ahead, and read their directories
+ *
+ * Description:
+ *   mmv_get_pairs_nul(), mmv_get_pairs_qp(), mmv_get_pairs_vis()
+ *   and mmv_get_pairs_xnn() each decode one pair, then match it,
+ *   and matching stops to read any directory that has not been seen yet.
+ *   On a cold cache, over many directories, that is one disk wait
+ *   after another, with nothing else going on.
+ *
+ *   So, when mmv->scan_threads is not 0, pairs are decoded up to
+ *   RA_WINDOW pairs ahead of the one being matched.  As each pair
+ *   is decoded, its source and target directories are queued on the
+ *   pool of mmv-prefetch.c, which reads and sorts them in the
+ *   background.  By the time the pair is matched, checkdir() finds
+ *   its directories already read.
+ *
+ *   Pairs are still handed out, and matched, one at a time,
+ *   in input order.  The only difference is how far ahead the
+ *   input has been read.
+ *
+ * Copyright (C) 2016 Guy Shaw
+ * Written by Guy Shaw <gshaw@acm.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>         // Import size_t
+#include <stdio.h>          // Import type FILE
+#include <stdlib.h>         // Import free()
+#include <string.h>         // Import memcpy(), strlen()
+
+#define IMPORT_PATTERN
+#define IMPORT_ALLOC
+#include <mmv-impl.h>
+#include <mmv-state.h>
+
+/*
+ * Number of pairs decoded ahead of the one being matched.
+ */
+
+#define RA_WINDOW 64
+
+struct ra_pair {
+    char   rp_from[MAXPATLEN];
+    char   rp_to[MAXPATLEN];
+    size_t rp_fromlen;
+    size_t rp_tolen;
+    int    rp_rv;           // Status of decoding; 0, EOF, or an error
+};
+
+static struct ra_pair *ra_win;  // Ring of RA_WINDOW pairs
+static size_t ra_head;
+static size_t ra_count;
+static bool ra_eof;             // Last pair in the window has |rp_rv| != 0
+static bool ra_holding;         // prefetch_hold() was called
+
+/**
+ * @brief Decode one { from->to } pair.
+ *
+ * @return status of the first of the two decodes that did not succeed,
+ *         or 0
+ *
+ */
+
+static int
+ra_get(FILE *f, getfname_fn get, char *from, size_t *pfromlen, char *to, size_t *ptolen)
+{
+    int rv;
+
+    rv = get(f, from, MAXPATLEN, pfromlen);
+    if (rv == 0) {
+        rv = get(f, to, MAXPATLEN, ptolen);
+    }
+    return (rv);
+}
+
+/**
+ * @brief Queue the directories of a pair just decoded.
+ *
+ */
+
+static void
+ra_queue(const struct ra_pair *rp, bool patterns)
+{
+    char dir[MAXPATLEN + 2];
+    unsigned int depth;
+    bool walk;
+
+    if (!patterns) {
+        prefetch_queue_pair(rp->rp_from, rp->rp_to);
+    }
+    else if (pattern_start_dir(rp->rp_from, dir, &depth, &walk)) {
+        prefetch_queue_dir(dir, depth, walk, false);
+    }
+}
+
+/**
+ * @brief Get the next { from->to } pair, reading ahead if prefetch is on.
+ *
+ * @param mmv
+ * @param f         IN  File (stdio stream) to read from
+ * @param get       IN  decoder for one filename
+ * @param patterns  IN  true if 'from' is a pattern, to be given to matchpat()
+ * @return errno-style status of decoding; EOF at end of input
+ *
+ * On success, mmv->from, mmv->fromlen, mmv->to and mmv->tolen
+ * are set, just as if |get| had been called on them directly.
+ * The caller must call readahead_finish() when done,
+ * whatever the status.
+ *
+ */
+
+int
+readahead_next(mmv_t *mmv, FILE *f, getfname_fn get, bool patterns)
+{
+    struct ra_pair *rp;
+    int rv;
+
+    if (mmv->scan_threads == 0) {
+        return (ra_get(f, get, mmv->from, &mmv->fromlen, mmv->to, &mmv->tolen));
+    }
+
+    if (ra_win == NULL) {
+        ra_win = (struct ra_pair *) mmv_alloc(RA_WINDOW * sizeof (struct ra_pair));
+        ra_head = 0;
+        ra_count = 0;
+        ra_eof = false;
+        ra_holding = prefetch_hold(mmv);
+    }
+
+    while (!ra_eof && ra_count < RA_WINDOW) {
+        rp = &ra_win[(ra_head + ra_count) % RA_WINDOW];
+        rp->rp_from[0] = '\0';
+        rp->rp_to[0] = '\0';
+        rp->rp_fromlen = 0;
+        rp->rp_tolen = 0;
+        rp->rp_rv = ra_get(f, get, rp->rp_from, &rp->rp_fromlen, rp->rp_to, &rp->rp_tolen);
+        ++ra_count;
+        if (rp->rp_rv != 0) {
+            ra_eof = true;
+        }
+        else {
+            ra_queue(rp, patterns);
+        }
+    }
+
+    rp = &ra_win[ra_head];
+    ra_head = (ra_head + 1) % RA_WINDOW;
+    --ra_count;
+    rv = rp->rp_rv;
+    memcpy(mmv->from, rp->rp_from, strlen(rp->rp_from) + 1);
+    memcpy(mmv->to, rp->rp_to, strlen(rp->rp_to) + 1);
+    mmv->fromlen = rp->rp_fromlen;
+    mmv->tolen = rp->rp_tolen;
+    return (rv);
+}
+
+/**
+ * @brief Stop reading ahead; discard any pairs and listings not used.
+ *
+ */
+
+void
+readahead_finish(void)
+{
+    if (ra_holding) {
+        prefetch_finish();
+        ra_holding = false;
+    }
+    free(ra_win);
+    ra_win = NULL;
+    ra_head = 0;
+    ra_count = 0;
+    ra_eof = false;
+}
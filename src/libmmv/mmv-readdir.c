@@ -0,0 +1,414 @@
+/*
+ * Filename: src/libmmv/mmv-readdir.c
+ * Library: libmmv
+ * Brief: Read all entries of a directory into one buffer, using getdents64()
+ *
+ * Copyright (C) 2016 Guy Shaw
+ * Written by Guy Shaw <gshaw@acm.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdbool.h>
+#include <stddef.h>         // Import offsetof()
+#include <stdio.h>          // Import type FILE
+#include <stdlib.h>         // Import free()
+#include <string.h>         // Import memcpy(), strlen()
+#include <errno.h>          // Import errno
+#include <fcntl.h>          // Import open(), O_DIRECTORY
+#include <unistd.h>         // Import close(), syscall()
+#include <sys/syscall.h>    // Import SYS_getdents64
+#include <dirent.h>         // Import DT_UNKNOWN, opendir(), readdir()
+
+#define IMPORT_DIRBUF
+#define IMPORT_NAMEKEY
+#include <mmv-impl.h>
+
+/*
+ * The buffer starts out big enough for a typical directory
+ * in one getdents64() call.  Whenever less than DIRBUF_MINFREE
+ * bytes are left, its size is doubled.
+ */
+
+#define DIRBUF_INITSIZE (32 * 1024)
+#define DIRBUF_MINFREE  (16 * 1024)
+
+/**
+ * @brief Make sure there are at least |need| free bytes in a |dirbuf_t|.
+ *
+ * @param db    INOUT  the directory buffer
+ * @param need  IN     number of free bytes wanted
+ * @return 0, or ENOMEM, in which case |db| is left as it was
+ *
+ * Prefetch worker threads read directories, too, so running out
+ * of memory is reported, not acted on.
+ *
+ */
+
+static int
+dirbuf_reserve(dirbuf_t *db, size_t need)
+{
+    size_t new_size;
+    char *new_buf;
+
+    if (db->db_size - db->db_len >= need) {
+        return (0);
+    }
+
+    new_size = db->db_size ? db->db_size : DIRBUF_INITSIZE;
+    while (new_size - db->db_len < need) {
+        new_size *= 2;
+    }
+    new_buf = (char *) mmv_try_realloc(db->db_buf, new_size);
+    if (new_buf == NULL) {
+        return (ENOMEM);
+    }
+    db->db_buf = new_buf;
+    db->db_size = new_size;
+    return (0);
+}
+
+#if defined(SYS_getdents64)
+
+/**
+ * @brief Read directory entries in large batches, using getdents64().
+ *
+ * @param fd     IN     Descriptor of a directory, open for reading
+ * @param db     INOUT  Buffer of directory entries
+ * @param grow   IN     true to grow |db| as needed; false to stop when full
+ * @param peof   OUT    true if the end of the directory was reached
+ * @return errno-style status
+ *
+ * The kernel writes linux_dirent64 records directly into |db|,
+ * and |dirbuf_rec| has the same layout, so no copying is needed.
+ *
+ */
+
+static int
+dirbuf_getdents(int fd, dirbuf_t *db, bool grow, bool *peof)
+{
+    long rlen;
+    size_t pos;
+    int err;
+
+    *peof = false;
+    for (;;) {
+        if (grow) {
+            if ((err = dirbuf_reserve(db, DIRBUF_MINFREE)) != 0) {
+                return (err);
+            }
+        }
+        else if (db->db_size - db->db_len < DIRBUF_MINFREE) {
+            return (0);
+        }
+        rlen = syscall(SYS_getdents64, fd, db->db_buf + db->db_len, db->db_size - db->db_len);
+        if (rlen < 0) {
+            return (errno);
+        }
+        if (rlen == 0) {
+            *peof = true;
+            return (0);
+        }
+        for (pos = db->db_len; pos < db->db_len + rlen; ) {
+            pos += ((struct dirbuf_rec *)(db->db_buf + pos))->d_reclen;
+            ++db->db_count;
+        }
+        db->db_len += rlen;
+    }
+}
+
+/**
+ * @brief Read all directory entries, using getdents64().
+ *
+ * The descriptor, |fd|, is closed.
+ *
+ */
+
+static int
+dirbuf_fill(int fd, dirbuf_t *db)
+{
+    bool eof;
+    int err;
+
+    err = dirbuf_getdents(fd, db, true, &eof);
+    close(fd);
+    return (err);
+}
+
+#else
+
+/**
+ * @brief Read directory entries using readdir().
+ *
+ * Fallback for systems without getdents64().
+ * Records are laid out exactly as getdents64() would have written them.
+ * The descriptor, |fd|, is closed.
+ *
+ */
+
+static int
+dirbuf_fill(int fd, dirbuf_t *db)
+{
+    DIR *dirp;
+    struct dirent *dp;
+    struct dirbuf_rec *rec;
+    size_t namelen, reclen;
+    int err;
+
+    if ((dirp = fdopendir(fd)) == NULL) {
+        err = errno;
+        close(fd);
+        return (err);
+    }
+
+    while ((dp = readdir(dirp)) != NULL) {
+        namelen = strlen(dp->d_name);
+        reclen = offsetof(struct dirbuf_rec, d_name) + namelen + 1;
+        reclen = (reclen + 7) & ~(size_t)7;
+        if ((err = dirbuf_reserve(db, reclen)) != 0) {
+            closedir(dirp);
+            return (err);
+        }
+        rec = (struct dirbuf_rec *)(db->db_buf + db->db_len);
+        rec->d_ino = dp->d_ino;
+        rec->d_off = 0;
+        rec->d_reclen = reclen;
+#ifdef _DIRENT_HAVE_D_TYPE
+        rec->d_type = dp->d_type;
+#else
+        rec->d_type = DT_UNKNOWN;
+#endif
+        memcpy(rec->d_name, dp->d_name, namelen + 1);
+        db->db_len += reclen;
+        ++db->db_count;
+    }
+
+    closedir(dirp);
+    return (0);
+}
+
+/**
+ * @brief Without getdents64(), a "chunk" is the whole directory.
+ *
+ * readdir() needs its own |DIR|, so it reads a duplicate of |fd|.
+ *
+ */
+
+static int
+dirbuf_getdents(int fd, dirbuf_t *db, bool grow, bool *peof)
+{
+    int dfd;
+
+    (void) grow;
+    *peof = true;
+    dfd = dup(fd);
+    if (dfd < 0) {
+        return (errno);
+    }
+    return (dirbuf_fill(dfd, db));
+}
+
+#endif /* SYS_getdents64 */
+
+/**
+ * @brief Read all entries of an open directory into one buffer.
+ *
+ * @param fd    IN   Descriptor of a directory, open for reading
+ * @param db    OUT  Buffer of directory entries
+ * @return errno-style status
+ *
+ * On success, |db| holds |db_count| packed |dirbuf_rec| records,
+ * in the order in which the filesystem returned them.
+ * The caller owns the buffer, and must release it with dirbuf_free().
+ * In any case, |fd| is closed.
+ *
+ */
+
+int
+dirbuf_read_fd(int fd, dirbuf_t *db)
+{
+    int err;
+
+    db->db_buf = NULL;
+    db->db_len = 0;
+    db->db_size = 0;
+    db->db_count = 0;
+    db->db_sorted = 0;
+
+    err = dirbuf_fill(fd, db);
+    if (err) {
+        dirbuf_free(db);
+    }
+    return (err);
+}
+
+/**
+ * @brief Read the next chunk of entries of an open directory.
+ *
+ * @param fd     IN   Descriptor of a directory, open for reading
+ * @param db     OUT  Buffer of directory entries
+ * @param limit  IN   Size of the buffer
+ * @param peof   OUT  true if there are no more entries after these
+ * @return errno-style status
+ *
+ * Like dirbuf_read_fd(), but the buffer never grows past |limit| bytes,
+ * and |fd| is left open, so that the caller can keep reading.
+ * On failure, |db| is left empty.  Running out of memory is
+ * returned as ENOMEM, because prefetch workers read chunks, too.
+ *
+ */
+
+int
+dirbuf_read_chunk(int fd, dirbuf_t *db, size_t limit, bool *peof)
+{
+    int err;
+
+    if (limit < 2 * DIRBUF_MINFREE) {
+        limit = 2 * DIRBUF_MINFREE;
+    }
+    db->db_buf = (char *) mmv_try_alloc(limit);
+    db->db_len = 0;
+    db->db_size = limit;
+    db->db_count = 0;
+    db->db_sorted = 0;
+    if (db->db_buf == NULL) {
+        db->db_size = 0;
+        return (ENOMEM);
+    }
+
+    err = dirbuf_getdents(fd, db, false, peof);
+    if (err) {
+        dirbuf_free(db);
+    }
+    return (err);
+}
+
+/**
+ * @brief Read all entries of a directory into one buffer.
+ *
+ * @param path  IN   Path to directory
+ * @param db    OUT  Buffer of directory entries
+ * @return errno-style status
+ *
+ * Same as dirbuf_read_fd(), but opens the directory by name.
+ *
+ */
+
+int
+dirbuf_read(const char *path, dirbuf_t *db)
+{
+    int fd;
+
+    fd = dirbuf_open(path);
+    if (fd < 0) {
+        return (errno);
+    }
+    return (dirbuf_read_fd(fd, db));
+}
+
+/**
+ * @brief Open a directory, for dirbuf_read_fd() or for fstatat().
+ *
+ * @param path  IN  Path to directory, even one longer than PATH_MAX
+ * @return file descriptor, or -1 (with errno set)
+ *
+ */
+
+int
+dirbuf_open(const char *path)
+{
+    return (long_open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0));
+}
+
+/**
+ * @brief Rearrange the records of a |dirbuf_t| in order of name.
+ *
+ * @param db  INOUT  Buffer of directory entries
+ * @return 0, or ENOMEM, in which case |db| is left as it was
+ *
+ * The records are copied into a new buffer, in strcmp() order,
+ * so that takedir() does not have to sort them, again.
+ * The sort works on inline prefix keys; see mmv-fsort.c.
+ *
+ * This is for prefetch worker threads, which must not quit
+ * on running out of memory.  The main thread uses dirbuf_sort().
+ *
+ */
+
+int
+dirbuf_try_sort(dirbuf_t *db)
+{
+    namekey_t *vec;
+    struct dirbuf_rec *rec;
+    char *new_buf;
+    size_t pos, i;
+
+    if (db->db_sorted || db->db_count == 0) {
+        db->db_sorted = 1;
+        return (0);
+    }
+
+    vec = (namekey_t *) mmv_try_alloc(db->db_count * sizeof (namekey_t));
+    if (vec == NULL) {
+        return (ENOMEM);
+    }
+    for (pos = 0, i = 0; pos < db->db_len; pos += rec->d_reclen, ++i) {
+        rec = (struct dirbuf_rec *)(db->db_buf + pos);
+        namekey_set(&vec[i], rec->d_name);
+    }
+    new_buf = (char *) mmv_try_alloc(db->db_len);
+    if (new_buf == NULL || namekey_sort(vec, db->db_count) != 0) {
+        free(new_buf);
+        free(vec);
+        return (ENOMEM);
+    }
+
+    for (pos = 0, i = 0; i < db->db_count; ++i) {
+        rec = (struct dirbuf_rec *)(vec[i].nk_name - offsetof(struct dirbuf_rec, d_name));
+        memcpy(new_buf + pos, rec, rec->d_reclen);
+        pos += rec->d_reclen;
+    }
+    free(vec);
+    free(db->db_buf);
+    db->db_buf = new_buf;
+    db->db_size = db->db_len;
+    db->db_sorted = 1;
+    return (0);
+}
+
+/**
+ * @brief Rearrange the records of a |dirbuf_t| in order of name, or quit.
+ *
+ */
+
+void
+dirbuf_sort(dirbuf_t *db)
+{
+    if (dirbuf_try_sort(db) != 0) {
+        mmv_nomem();
+    }
+}
+
+void
+dirbuf_free(dirbuf_t *db)
+{
+    free(db->db_buf);
+    db->db_buf = NULL;
+    db->db_len = 0;
+    db->db_size = 0;
+    db->db_count = 0;
+    db->db_sorted = 0;
+}
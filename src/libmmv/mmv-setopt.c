@@ -28,6 +28,8 @@
 #include <assert.h>
 
 #include <stdbool.h>
+#include <stdint.h>     // Import SIZE_MAX
+#include <limits.h>     // Import UINT_MAX
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
@@ -61,6 +63,61 @@
 
 #include <mmv-impl.h>
 
+static void mmv_add_prune_list(mmv_t *mmv, const char *list);
+
+/**
+ * @brief Convert a string to a number.
+ *
+ * @param str   IN   the string
+ * @param max   IN   largest value allowed
+ * @param pval  OUT  the value, if it is good
+ * @return true if |str| is all decimal digits, with a value no more than |max|
+ *
+ */
+
+static bool
+parse_number(const char *str, unsigned long long max, unsigned long long *pval)
+{
+    char *end;
+    unsigned long long val;
+
+    errno = 0;
+    val = strtoull(str, &end, 10);
+    if (!isdigit((unsigned char)*str) || *end != '\0' || errno != 0 || val > max) {
+        return (false);
+    }
+    *pval = val;
+    return (true);
+}
+
+/**
+ * @brief Forget all globs given to mmv_add_prune().
+ *
+ */
+
+static void
+mmv_clear_prune(mmv_t *mmv)
+{
+    size_t i;
+
+    for (i = 0; i < mmv->prune_cnt; ++i) {
+        free(mmv->prune_vec[i]);
+    }
+    free(mmv->prune_vec);
+    mmv->prune_vec = NULL;
+    mmv->prune_cnt = 0;
+}
+
+/**
+ * @brief Set all options back to their defaults.
+ *
+ * @param mmv
+ *
+ * Nothing is taken from the environment; that is up to the program.
+ * A long-lived program can call this again, before each batch.
+ *
+ */
+
 void
 mmv_set_default_options(mmv_t *mmv)
 {
@@ -70,6 +127,10 @@ mmv_set_default_options(mmv_t *mmv)
     mmv->matchall = false;
     mmv->delstyle = ASKDEL;
     mmv->badstyle = ASKBAD;
+    mmv_set_snapshot_dir(mmv, NULL);
+    mmv_set_dirmem_cap(mmv, 0);
+    mmv_clear_prune(mmv);
+    mmv_set_walk_maxdepth(mmv, 0);
 }
 
 int
@@ -156,9 +217,285 @@ mmv_setopt(mmv_t *mmv, int opt)
             mmv->op = HARDLINK;
         }
         break;
+    case 'O':
+        mmv_set_walk_onefs(mmv, true);
+        break;
+    case 'P': {
+        long ncpu;
+
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        mmv_set_scan_threads(mmv, ncpu > 1 ? (unsigned int)ncpu : 2);
+        break;
+    }
     default:
         return (EINVAL);
     }
 
     return (0);
 }
+
+/**
+ * @brief Set an option that takes an argument.
+ *
+ * @param mmv
+ * @param opt  IN  option letter
+ * @param arg  IN  its argument
+ * @return errno-style -- 0 == success, EINVAL for an unknown option,
+ *         or a bad argument, which is reported
+ *
+ * -E glob   does the same as mmv_add_prune(); it can be given many times.
+ * -W depth  does the same as mmv_set_walk_maxdepth().
+ *
+ */
+
+int
+mmv_setopt_arg(mmv_t *mmv, int opt, const char *arg)
+{
+    unsigned long long depth;
+
+    switch (opt) {
+    case 'E':
+        if (*arg == '\0') {
+            eprintf("Invalid -E ''; a glob is needed.\n");
+            return (EINVAL);
+        }
+        mmv_add_prune(mmv, arg);
+        break;
+    case 'W':
+        if (!parse_number(arg, UINT_MAX, &depth)) {
+            eprintf("Invalid -W '%s'; a number of levels is needed.\n", arg);
+            return (EINVAL);
+        }
+        mmv_set_walk_maxdepth(mmv, (unsigned int)depth);
+        break;
+    default:
+        return (EINVAL);
+    }
+
+    return (0);
+}
+
+/**
+ * @brief Set an option from the value of a variable, by name.
+ *
+ * @param mmv
+ * @param name   IN  name of the variable
+ * @param value  IN  its value, as a string; an empty value is the same as none
+ * @return errno-style -- 0 == success, EINVAL for an unknown name,
+ *         or a value that is not good for it; nothing is reported
+ *
+ * Programs that take options from the environment pass them here,
+ * so that all of them read the values the same way:
+ *
+ *   MMV_SNAPSHOT_DIR   as for mmv_set_snapshot_dir()
+ *   MMV_DIRMEM_CAP     as for mmv_set_dirmem_cap(), in bytes
+ *   MMV_PRUNE          a colon-separated list of globs, for mmv_add_prune()
+ *   MMV_WALK_MAXDEPTH  as for mmv_set_walk_maxdepth()
+ *
+ */
+
+int
+mmv_setopt_var(mmv_t *mmv, const char *name, const char *value)
+{
+    unsigned long long num;
+
+    if (value == NULL || *value == '\0') {
+        return (0);
+    }
+    if (strcmp(name, "MMV_SNAPSHOT_DIR") == 0) {
+        return (mmv_set_snapshot_dir(mmv, value));
+    }
+    if (strcmp(name, "MMV_PRUNE") == 0) {
+        mmv_add_prune_list(mmv, value);
+        return (0);
+    }
+    if (strcmp(name, "MMV_DIRMEM_CAP") == 0) {
+        if (!parse_number(value, SIZE_MAX, &num)) {
+            return (EINVAL);
+        }
+        mmv_set_dirmem_cap(mmv, (size_t)num);
+        return (0);
+    }
+    if (strcmp(name, "MMV_WALK_MAXDEPTH") == 0) {
+        if (!parse_number(value, UINT_MAX, &num)) {
+            return (EINVAL);
+        }
+        mmv_set_walk_maxdepth(mmv, (unsigned int)num);
+        return (0);
+    }
+    return (EINVAL);
+}
+
+/**
+ * @brief Set the number of threads used to read directory trees.
+ *
+ * @param mmv
+ * @param nthreads  IN  number of worker threads; 0 means serial
+ *
+ * When a 'from' pattern has a ';' (any level) component,
+ * the directories under that point are read and sorted by
+ * a pool of |nthreads| worker threads, ahead of the serial walk.
+ * When patterns are read from stdin, the directories where they
+ * start are read by the same pool, ahead of matching.
+ * The results are the same, in the same order.
+ *
+ */
+
+void
+mmv_set_scan_threads(mmv_t *mmv, unsigned int nthreads)
+{
+    mmv->scan_threads = nthreads > MAX_SCAN_THREADS ? MAX_SCAN_THREADS : nthreads;
+}
+
+/**
+ * @brief Keep snapshots of large directories, to be reused by later runs.
+ *
+ * @param mmv
+ * @param dir  IN  directory to keep snapshot files in; NULL means off
+ * @return errno-style -- 0 == success; EPERM if |dir| is not private
+ *
+ * A snapshot is only used while the directory it was taken of
+ * has not changed.  See mmv-snapcache.c.
+ *
+ * The directory must belong to the effective user, and be writable
+ * by no one else.  If it cannot be used, snapshots are off,
+ * and it is up to the caller to say so.
+ *
+ */
+
+int
+mmv_set_snapshot_dir(mmv_t *mmv, const char *dir)
+{
+    int err;
+
+    mmv->snapshot_dir = NULL;
+    if (dir == NULL || *dir == '\0') {
+        snapcache_set_dir(NULL);
+        return (0);
+    }
+    err = snapcache_set_dir(dir);
+    if (err == 0) {
+        mmv->snapshot_dir = dir;
+    }
+    return (err);
+}
+
+/**
+ * @brief Bound the memory held by directory listings.
+ *
+ * @param mmv
+ * @param bytes  IN  budget, in bytes; 0 means no limit
+ *
+ * For long-lived processes that run many batches.  Listings that
+ * no |REP| refers to are dropped, least recently used first, and
+ * read again if they are needed again.
+ *
+ */
+
+void
+mmv_set_dircache_budget(mmv_t *mmv, size_t bytes)
+{
+    mmv->dircache_budget = bytes;
+    dircache_set_budget(bytes);
+}
+
+/**
+ * @brief Cap the memory used to read any one directory.
+ *
+ * @param mmv
+ * @param bytes  IN  cap, in bytes; 0 means no cap
+ *
+ * A directory too big to sort within the cap is sorted in external
+ * memory, in temporary files.  See mmv-extdir.c.
+ *
+ * The cap is approximate.  A directory is read in chunks of no less
+ * than 32 KiB, and the merge of sorted runs takes no less than 8 KiB,
+ * so a cap below about 128 KiB is exceeded by that much.
+ *
+ */
+
+void
+mmv_set_dirmem_cap(mmv_t *mmv, size_t bytes)
+{
+    mmv->dirmem_cap = bytes;
+    extdir_set_cap(bytes);
+}
+
+/**
+ * @brief Do not let a ';' walk descend into subdirectories with certain names.
+ *
+ * @param mmv
+ * @param glob  IN  fnmatch() pattern for the name of a subdirectory;
+ *                  it is copied
+ *
+ * Any number of globs can be added.  Names that start with '.'
+ * are never descended into, anyway.  Listings read ahead by -P
+ * follow the same rules.
+ *
+ */
+
+void
+mmv_add_prune(mmv_t *mmv, const char *glob)
+{
+    mmv->prune_vec = (char **) mmv_realloc(mmv->prune_vec, (mmv->prune_cnt + 1) * sizeof (char *));
+    mmv->prune_vec[mmv->prune_cnt] = (char *) mmv_alloc(strlen(glob) + 1);
+    strcpy(mmv->prune_vec[mmv->prune_cnt], glob);
+    ++mmv->prune_cnt;
+}
+
+/**
+ * @brief Add each of a colon-separated list of globs, as by mmv_add_prune().
+ *
+ */
+
+static void
+mmv_add_prune_list(mmv_t *mmv, const char *list)
+{
+    char glob[PATH_MAX];
+    const char *p, *colon;
+    size_t len;
+
+    for (p = list; *p != '\0'; p = colon + (*colon != '\0')) {
+        colon = strchr(p, ':');
+        if (colon == NULL) {
+            colon = p + strlen(p);
+        }
+        len = colon - p;
+        if (len != 0 && len < sizeof (glob)) {
+            memcpy(glob, p, len);
+            glob[len] = '\0';
+            mmv_add_prune(mmv, glob);
+        }
+    }
+}
+
+/**
+ * @brief Limit how deep a ';' walk goes.
+ *
+ * @param mmv
+ * @param depth  IN  number of levels of subdirectories below
+ *                   the directory where ';' applies; 0 means no limit
+ *
+ */
+
+void
+mmv_set_walk_maxdepth(mmv_t *mmv, unsigned int depth)
+{
+    mmv->walk_maxdepth = depth;
+}
+
+/**
+ * @brief Keep a ';' walk on the filesystem where it starts.
+ *
+ * @param mmv
+ * @param onefs  IN  C-int-bool; true to skip subdirectories that are on
+ *                   a different device than the directory
+ *                   where ';' applies, such as mount points
+ *
+ */
+
+void
+mmv_set_walk_onefs(mmv_t *mmv, int onefs)
+{
+    mmv->walk_onefs = (onefs != 0);
+}
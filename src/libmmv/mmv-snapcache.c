@@ -0,0 +1,400 @@
+/*
+ * Filename: src/libmmv/mmv-snapcache.c
+ * Library: libmmv
+ * Brief: Persistent on-disk snapshots of large directories
+ *
+ * Description:
+ *   Jobs that run mmv many times against the same few huge directories
+ *   read and sort each of them from scratch, every time.  When a
+ *   snapshot directory is configured, with mmv_set_snapshot_dir()
+ *   (the commands take it from the environment variable,
+ *   MMV_SNAPSHOT_DIR), then the sorted listing of every large
+ *   directory that is read is also written to a file in the
+ *   snapshot directory, named after the (st_dev, st_ino)
+ *   of the directory.  The next process that needs the same directory
+ *   maps that file read-only, and uses the names right where they lie.
+ *
+ *   A snapshot is only used if the st_mtim and st_ctim of the directory
+ *   are still exactly what they were when the snapshot was taken.
+ *   Any change to the set of names in a directory changes its st_mtim.
+ *   A snapshot is not written at all if the directory changed so
+ *   recently that another change could happen within the same tick
+ *   of the timestamp clock.
+ *
+ *   Only what d_type told about each entry is kept, not what getstat()
+ *   learns later.  The type or mode of a file, or of the target of a
+ *   symbolic link, can change without touching the directory, so
+ *   those are always looked up again.
+ *
+ *   A snapshot is written to a temporary file, and renamed into place,
+ *   so concurrent jobs never see a partial snapshot.  Any problem
+ *   with a snapshot file just means the directory is read, as usual.
+ *
+ *   Whoever can write a snapshot decides what mmv believes is in
+ *   a directory.  So the snapshot directory, and every snapshot file,
+ *   must belong to the effective user, and be writable by no one else,
+ *   and neither may be a symbolic link.
+ *
+ * Copyright (C) 2016 Guy Shaw
+ * Written by Guy Shaw <gshaw@acm.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdbool.h>
+#include <stdint.h>         // Import uint32_t, uint64_t
+#include <stdio.h>          // Import fdopen(), fwrite(), fprintf(), snprintf()
+#include <stdlib.h>         // Import free(), mkstemp()
+#include <string.h>         // Import memcmp(), memcpy(), memset(), strcpy()
+#include <time.h>           // Import time()
+#include <errno.h>          // Import errno, EPERM
+#include <fcntl.h>          // Import open(), O_NOFOLLOW
+#include <unistd.h>         // Import close(), unlink(), geteuid()
+#include <sys/mman.h>       // Import mmap()
+#include <sys/stat.h>       // Import fstat()
+#include <linux/limits.h>   // Import PATH_MAX
+
+#define IMPORT_FILEINFO
+#define IMPORT_DIRINFO
+#include <mmv-impl.h>
+#include <mmv-impl-rep.h>
+
+/*
+ * Directories with fewer than SNAP_MIN_ENTRIES entries are cheaper
+ * to read than to look up in the snapshot directory.
+ */
+
+#define SNAP_MIN_ENTRIES 256
+#define SNAP_VERSION     1
+
+static const char snap_magic[8] = { 'M', 'M', 'V', 'S', 'N', 'A', 'P', '\0' };
+
+struct snap_header {
+    char     sh_magic[8];
+    uint32_t sh_version;
+    uint32_t sh_count;          // Number of |snap_rec|s
+    uint64_t sh_dev;
+    uint64_t sh_ino;
+    int64_t  sh_mtim_sec;
+    int64_t  sh_mtim_nsec;
+    int64_t  sh_ctim_sec;
+    int64_t  sh_ctim_nsec;
+    uint64_t sh_poolsize;       // Bytes of names, each with its '\0'
+};
+
+struct snap_rec {
+    uint32_t sr_name;           // Offset of the name in the pool
+    uint32_t sr_len;            // strlen() of the name
+    uint32_t sr_flags;          // FI_TYPEKNOWN, FI_ISDIR
+    uint32_t sr_pad;
+};
+
+#define SNAP_FLAGS (FI_TYPEKNOWN | FI_ISDIR)
+
+static char *snap_dir;
+
+struct snapcache_stats {
+    size_t loads;
+    size_t stale;       // Snapshot found, but the directory has changed
+    size_t bad;         // Snapshot found, but not usable
+    size_t saves;
+    size_t racy;        // Directory changed too recently to save
+};
+
+static struct snapcache_stats scstats;
+
+/**
+ * @brief Tell whether a snapshot directory or file can be trusted.
+ *
+ * @param st  IN  fstat() information of it
+ * @return true if it is ours, and no one else can write to it
+ *
+ */
+
+static bool
+snap_trusted(const struct stat *st)
+{
+    return (st->st_uid == geteuid() && (st->st_mode & (S_IWGRP | S_IWOTH)) == 0);
+}
+
+/**
+ * @brief Set the directory where snapshots are kept.
+ *
+ * @param dir  IN  directory, or NULL to turn snapshots off
+ * @return errno-style status; EPERM if |dir| cannot be trusted
+ *
+ * If |dir| cannot be used, snapshots are off.
+ *
+ */
+
+int
+snapcache_set_dir(const char *dir)
+{
+    struct stat dstat;
+    int fd;
+    int err;
+
+    free(snap_dir);
+    snap_dir = NULL;
+    if (dir == NULL || *dir == '\0') {
+        return (0);
+    }
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return (errno);
+    }
+    err = 0;
+    if (fstat(fd, &dstat) != 0) {
+        err = errno;
+    }
+    else if (!snap_trusted(&dstat)) {
+        err = EPERM;
+    }
+    close(fd);
+    if (err) {
+        return (err);
+    }
+    snap_dir = (char *) mmv_alloc(strlen(dir) + 1);
+    strcpy(snap_dir, dir);
+    return (0);
+}
+
+static bool
+snap_fname(char *buf, size_t sz, const struct stat *dstat)
+{
+    int len;
+
+    len = snprintf(buf, sz, "%s/%jx-%jx.snap", snap_dir,
+        (uintmax_t)dstat->st_dev, (uintmax_t)dstat->st_ino);
+    return (len > 0 && (size_t)len < sz);
+}
+
+static void
+snap_header_init(struct snap_header *sh, const struct stat *dstat)
+{
+    memset(sh, 0, sizeof (*sh));
+    memcpy(sh->sh_magic, snap_magic, sizeof (sh->sh_magic));
+    sh->sh_version = SNAP_VERSION;
+    sh->sh_dev = dstat->st_dev;
+    sh->sh_ino = dstat->st_ino;
+    sh->sh_mtim_sec = dstat->st_mtim.tv_sec;
+    sh->sh_mtim_nsec = dstat->st_mtim.tv_nsec;
+    sh->sh_ctim_sec = dstat->st_ctim.tv_sec;
+    sh->sh_ctim_nsec = dstat->st_ctim.tv_nsec;
+}
+
+/**
+ * @brief Populate a |DIRINFO| from a snapshot, if there is a valid one.
+ *
+ * @param di      OUT  Directory information to be populated
+ * @param dstat   IN   stat() information of the directory, just now
+ * @param sticky  IN   FI_INSTICKY, if the directory is sticky and not ours
+ * @return true if |di| was populated
+ *
+ * The names are used in place, in the read-only mapping of the
+ * snapshot file, which stays mapped until the listing is evicted.
+ *
+ */
+
+bool
+snapcache_load(DIRINFO *di, const struct stat *dstat, int sticky)
+{
+    char fname[PATH_MAX];
+    struct stat sstat;
+    struct snap_header want;
+    const struct snap_header *sh;
+    const struct snap_rec *recs;
+    const char *pool;
+    FILEINFO *fvec, *f;
+    char *map;
+    size_t size, avail, i;
+    unsigned int nuntyped;
+    int fd;
+
+    if (snap_dir == NULL || !snap_fname(fname, sizeof (fname), dstat)) {
+        return (false);
+    }
+    fd = open(fname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return (false);
+    }
+    if (fstat(fd, &sstat) || !S_ISREG(sstat.st_mode) || !snap_trusted(&sstat)
+        || (size_t)sstat.st_size < sizeof (struct snap_header)) {
+        close(fd);
+        ++scstats.bad;
+        return (false);
+    }
+    size = sstat.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ++scstats.bad;
+        return (false);
+    }
+
+    sh = (const struct snap_header *)map;
+    snap_header_init(&want, dstat);
+    want.sh_count = sh->sh_count;
+    want.sh_poolsize = sh->sh_poolsize;
+    if (memcmp(sh, &want, sizeof (want)) != 0) {
+        munmap(map, size);
+        ++scstats.stale;
+        return (false);
+    }
+    // Check each part against what is left, so that nothing can overflow.
+    avail = size - sizeof (*sh);
+    if (sh->sh_poolsize > avail
+        || sh->sh_count > (avail - sh->sh_poolsize) / sizeof (struct snap_rec)
+        || avail != sh->sh_count * sizeof (struct snap_rec) + sh->sh_poolsize) {
+        munmap(map, size);
+        ++scstats.bad;
+        return (false);
+    }
+    if (!extdir_fits((sh->sh_count + 1) * (sizeof (FILEINFO *) + sizeof (FILEINFO)))) {
+        // Too big to use in memory; read it in external memory, instead.
+        munmap(map, size);
+        return (false);
+    }
+
+    recs = (const struct snap_rec *)(map + sizeof (*sh));
+    pool = (const char *)(recs + sh->sh_count);
+    for (i = 0; i < sh->sh_count; ++i) {
+        if ((uint64_t)recs[i].sr_name + recs[i].sr_len >= sh->sh_poolsize
+            || pool[recs[i].sr_name + recs[i].sr_len] != '\0') {
+            munmap(map, size);
+            ++scstats.bad;
+            return (false);
+        }
+    }
+
+    di->di_fils = (FILEINFO **) mmv_alloc((sh->sh_count + 1) * sizeof (FILEINFO *));
+    fvec = (FILEINFO *) mmv_alloc((sh->sh_count + 1) * sizeof (FILEINFO));
+    nuntyped = 0;
+    for (i = 0; i < sh->sh_count; ++i) {
+        di->di_fils[i] = f = &fvec[i];
+        f->fi_name = (char *)pool + recs[i].sr_name;
+        f->fi_len = recs[i].sr_len;
+        f->fi_mode = 0;
+        f->fi_stflags = sticky | (recs[i].sr_flags & SNAP_FLAGS);
+        f->fi_rep = NULL;
+        if (!(f->fi_stflags & FI_TYPEKNOWN)) {
+            ++nuntyped;
+        }
+    }
+    di->di_nfils = sh->sh_count;
+    di->di_nuntyped = nuntyped;
+    di->di_recs = fvec;
+    di->di_pool = map;
+    di->di_poolsize = size;
+    di->di_flags |= DI_MAPPED;
+    di->di_index = NULL;
+    di->di_indexsize = 0;
+    ++scstats.loads;
+    return (true);
+}
+
+/**
+ * @brief Write a snapshot of a freshly read |DIRINFO|.
+ *
+ * @param di     IN  Directory information, just as takedir() left it
+ * @param dstat  IN  stat() information of the directory, taken before it was read
+ *
+ * Failure is silent; there just will not be a snapshot.
+ *
+ */
+
+void
+snapcache_save(DIRINFO *di, const struct stat *dstat)
+{
+    char fname[PATH_MAX];
+    char tmpname[PATH_MAX];
+    struct snap_header sh;
+    struct snap_rec *recs;
+    FILEINFO *f;
+    FILE *fp;
+    size_t poolsize, i;
+    bool ok;
+    int fd;
+
+    if (snap_dir == NULL || di->di_nfils < SNAP_MIN_ENTRIES || (di->di_flags & DI_EXTERNAL)) {
+        return;
+    }
+    if (dstat->st_mtim.tv_sec >= time(NULL) - 1 || dstat->st_ctim.tv_sec >= time(NULL) - 1) {
+        ++scstats.racy;
+        return;
+    }
+    if (!snap_fname(fname, sizeof (fname), dstat)) {
+        return;
+    }
+    if (snprintf(tmpname, sizeof (tmpname), "%s/.snap-XXXXXX", snap_dir) >= (int)sizeof (tmpname)) {
+        return;
+    }
+
+    recs = (struct snap_rec *) mmv_alloc(di->di_nfils * sizeof (struct snap_rec));
+    poolsize = 0;
+    for (i = 0; i < di->di_nfils; ++i) {
+        f = di->di_fils[i];
+        recs[i].sr_name = poolsize;
+        recs[i].sr_len = f->fi_len;
+        recs[i].sr_flags = f->fi_stflags & SNAP_FLAGS;
+        recs[i].sr_pad = 0;
+        poolsize += f->fi_len + 1;
+    }
+    if (poolsize > UINT32_MAX) {
+        free(recs);
+        return;
+    }
+
+    snap_header_init(&sh, dstat);
+    sh.sh_count = di->di_nfils;
+    sh.sh_poolsize = poolsize;
+
+    fd = mkstemp(tmpname);
+    if (fd < 0) {
+        free(recs);
+        return;
+    }
+    if ((fp = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        unlink(tmpname);
+        free(recs);
+        return;
+    }
+    fwrite(&sh, sizeof (sh), 1, fp);
+    fwrite(recs, sizeof (struct snap_rec), di->di_nfils, fp);
+    for (i = 0; i < di->di_nfils; ++i) {
+        f = di->di_fils[i];
+        fwrite(f->fi_name, 1, f->fi_len + 1, fp);
+    }
+    free(recs);
+    ok = !ferror(fp);
+    if (fclose(fp) != 0 || !ok || rename(tmpname, fname) != 0) {
+        unlink(tmpname);
+        return;
+    }
+    ++scstats.saves;
+}
+
+void
+fdump_snapcache_stats(FILE *f)
+{
+    if (snap_dir == NULL) {
+        return;
+    }
+    fprintf(f, "snapcache:\n");
+    fprintf(f, "    loads=%zu, stale=%zu, bad=%zu, saves=%zu, racy=%zu\n",
+        scstats.loads, scstats.stale, scstats.bad, scstats.saves, scstats.racy);
+}
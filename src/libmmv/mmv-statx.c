@@ -0,0 +1,511 @@
+/*
+ * Filename: src/libmmv/mmv-statx.c
+ * Library: libmmv
+ * Brief: Learn the types of many directory entries at once, using io_uring
+ *
+ * Description:
+ *   Most entries get their type from d_type, when the directory is read.
+ *   The rest (symbolic links, and everything on filesystems that do not
+ *   fill in d_type) have to be stat()ed, one at a time, by gettype().
+ *   On a cold cache, each of those is a synchronous trip to the disk.
+ *
+ *   Before a directory is matched, statx_prefetch() collects all the
+ *   candidates whose type is still unknown, and submits them to the
+ *   kernel as one batch of IORING_OP_STATX requests, relative to the
+ *   directory descriptor of the |HANDLE|.  The completions fill in
+ *   the |FILEINFO|s exactly as getstat() would have.
+ *
+ *   io_uring is optional.  If the headers are missing, or the kernel
+ *   refuses io_uring_setup(), or does not know IORING_OP_STATX, then
+ *   nothing is done here, and gettype() stat()s each file, as before.
+ *   Any entry whose statx fails is left alone, too, so that getstat()
+ *   reports the problem the same way it always has.
+ *
+ * Copyright (C) 2016 Guy Shaw
+ * Written by Guy Shaw <gshaw@acm.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdbool.h>
+#include <stdint.h>         // Import uintptr_t
+#include <stdio.h>          // Import fprintf()
+#include <stdlib.h>         // Import free()
+#include <string.h>         // Import memset()
+#include <errno.h>          // Import errno, EINTR
+#include <unistd.h>         // Import syscall(), close()
+#include <sys/stat.h>       // Import struct statx, STATX_*, fstatat()
+#include <sys/syscall.h>    // Import SYS_io_uring_*
+#include <sys/sysmacros.h>  // Import makedev()
+
+#if defined(__linux__) && defined(SYS_io_uring_setup) && defined(SYS_io_uring_enter) \
+    && defined(STATX_TYPE) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>       // Import mmap(), munmap()
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#define IMPORT_FILEINFO
+#define IMPORT_DIRINFO
+#include <mmv-impl.h>
+#include <mmv-impl-rep.h>
+#include <mmv-state.h>
+
+/*
+ * Batches smaller than STATX_BATCH_MIN are not worth a ring;
+ * gettype() just stat()s them.  At most STATX_RING_ENTRIES
+ * requests are in flight at any one time.
+ */
+
+#define STATX_BATCH_MIN     4
+#define STATX_RING_ENTRIES  64
+
+struct statx_stats {
+    size_t batches;
+    size_t submitted;
+    size_t filled;
+    size_t failed;      // Left for getstat()
+    bool   disabled;    // io_uring is not available
+};
+
+static struct statx_stats sxstats;
+
+#if defined(STATX_TYPE)
+
+/**
+ * @brief Get the PERM_ATTR_* flags of a file, for perm_fi_flags().
+ *
+ */
+
+static unsigned int
+stx_perm_attr(const struct statx *stx)
+{
+    const uint64_t lock = STATX_ATTR_IMMUTABLE | STATX_ATTR_APPEND;
+
+    if ((stx->stx_attributes_mask & lock) != lock) {
+        return (0);
+    }
+    return (PERM_ATTR_KNOWN | ((stx->stx_attributes & lock) ? PERM_ATTR_LOCKED : 0));
+}
+
+#endif
+
+#if defined(HAVE_IO_URING)
+
+struct uring {
+    int            fd;
+    unsigned int   entries;
+    unsigned int  *sq_head;
+    unsigned int  *sq_tail;
+    unsigned int  *sq_mask;
+    unsigned int  *sq_array;
+    unsigned int  *cq_head;
+    unsigned int  *cq_tail;
+    unsigned int  *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void          *sq_ring;
+    size_t         sq_ring_size;
+    void          *cq_ring;
+    size_t         cq_ring_size;
+    size_t         sqes_size;
+};
+
+static struct uring ring = { .fd = -1 };
+static struct statx *stxbuf;
+
+static void
+uring_teardown(void)
+{
+    if (ring.sqes != NULL) {
+        munmap(ring.sqes, ring.sqes_size);
+    }
+    if (ring.cq_ring != NULL && ring.cq_ring != ring.sq_ring) {
+        munmap(ring.cq_ring, ring.cq_ring_size);
+    }
+    if (ring.sq_ring != NULL) {
+        munmap(ring.sq_ring, ring.sq_ring_size);
+    }
+    if (ring.fd >= 0) {
+        close(ring.fd);
+    }
+    memset(&ring, 0, sizeof (ring));
+    ring.fd = -1;
+    free(stxbuf);
+    stxbuf = NULL;
+    sxstats.disabled = true;
+}
+
+/**
+ * @brief Give up on the ring, without tearing it down.
+ *
+ * Some requests may still be in flight, and the kernel would write
+ * their results into |stxbuf|.  So neither |stxbuf| nor the ring
+ * may go away; both are leaked.  io_uring is not used again,
+ * and a later uring_teardown() has nothing left to release.
+ *
+ */
+
+static void
+uring_abandon(void)
+{
+    memset(&ring, 0, sizeof (ring));
+    ring.fd = -1;
+    stxbuf = NULL;
+    sxstats.disabled = true;
+}
+
+/**
+ * @brief Set up the submission and completion rings, once.
+ *
+ * @return true if io_uring can be used
+ *
+ */
+
+static bool
+uring_setup(void)
+{
+    struct io_uring_params params;
+    char *sq, *cq;
+
+    if (ring.fd >= 0) {
+        return (true);
+    }
+    if (sxstats.disabled) {
+        return (false);
+    }
+
+    memset(&params, 0, sizeof (params));
+    ring.fd = syscall(SYS_io_uring_setup, STATX_RING_ENTRIES, &params);
+    if (ring.fd < 0) {
+        ring.fd = -1;
+        sxstats.disabled = true;
+        return (false);
+    }
+    ring.entries = params.sq_entries;
+
+    ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned int);
+    ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_ring_size > ring.sq_ring_size) {
+            ring.sq_ring_size = ring.cq_ring_size;
+        }
+        ring.cq_ring_size = ring.sq_ring_size;
+    }
+
+    sq = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        uring_teardown();
+        return (false);
+    }
+    ring.sq_ring = sq;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    }
+    else {
+        cq = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            uring_teardown();
+            return (false);
+        }
+    }
+    ring.cq_ring = cq;
+
+    ring.sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        ring.sqes = NULL;
+        uring_teardown();
+        return (false);
+    }
+
+    ring.sq_head  = (unsigned int *)(sq + params.sq_off.head);
+    ring.sq_tail  = (unsigned int *)(sq + params.sq_off.tail);
+    ring.sq_mask  = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring.cq_head  = (unsigned int *)(cq + params.cq_off.head);
+    ring.cq_tail  = (unsigned int *)(cq + params.cq_off.tail);
+    ring.cq_mask  = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring.cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    stxbuf = (struct statx *) mmv_alloc(ring.entries * sizeof (struct statx));
+    return (true);
+}
+
+/**
+ * @brief statx() up to |ring.entries| files, in one submission.
+ *
+ * @param dfd  IN     directory descriptor that the names are relative to
+ * @param vec  INOUT  |FILEINFO|s to fill in
+ * @param n    IN     how many; no more than |ring.entries|
+ * @return true if io_uring is still usable
+ *
+ * If io_uring_enter() fails, the requests that the kernel has already
+ * taken are still reaped, before anything is torn down.  If even that
+ * fails, the ring is abandoned, not torn down.
+ *
+ */
+
+static bool
+uring_statx(int dfd, FILEINFO **vec, unsigned int n)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct statx *stx;
+    FILEINFO *f;
+    unsigned int tail, head, idx, j, done, queued, inflight;
+    long rv;
+    bool usable;
+    bool draining;
+
+    tail = *ring.sq_tail;
+    for (j = 0; j < n; ++j) {
+        idx = tail & *ring.sq_mask;
+        sqe = &ring.sqes[idx];
+        memset(sqe, 0, sizeof (*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dfd;
+        sqe->addr = (uintptr_t)vec[j]->fi_name;
+        sqe->len = STATX_TYPE | STATX_MODE | STATX_INO | STATX_UID;
+        sqe->off = (uintptr_t)&stxbuf[j];
+        sqe->statx_flags = 0;
+        sqe->user_data = j;
+        ring.sq_array[idx] = idx;
+        ++tail;
+    }
+    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+    ++sxstats.batches;
+    sxstats.submitted += n;
+
+    usable = true;
+    draining = false;
+    done = 0;
+    while (done < n) {
+        // Requests not yet taken by the kernel, and those it is working on
+        queued = tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        inflight = n - queued - done;
+        if (draining) {
+            if (inflight == 0) {
+                // What is left was never taken, and never will be.
+                break;
+            }
+            rv = syscall(SYS_io_uring_enter, ring.fd, 0, inflight, IORING_ENTER_GETEVENTS, NULL, 0);
+        }
+        else {
+            rv = syscall(SYS_io_uring_enter, ring.fd, queued, n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+        }
+        if (rv < 0 && errno != EINTR) {
+            if (draining) {
+                sxstats.failed += n - done;
+                uring_abandon();
+                return (false);
+            }
+            // Submit nothing more; just wait for what is in flight.
+            draining = true;
+        }
+
+        head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            f = vec[cqe->user_data];
+            if (cqe->res == 0 && (stxbuf[cqe->user_data].stx_mask & STATX_TYPE)) {
+                stx = &stxbuf[cqe->user_data];
+                f->fi_mode = stx->stx_mode;
+                f->fi_stflags |= FI_STTAKEN | FI_TYPEKNOWN;
+                if (S_ISDIR(f->fi_mode)) {
+                    f->fi_stflags |= FI_ISDIR;
+                }
+                if ((stx->stx_mask & (STATX_MODE | STATX_UID)) == (STATX_MODE | STATX_UID)) {
+                    f->fi_stflags |= perm_fi_flags(makedev(stx->stx_dev_major, stx->stx_dev_minor), stx->stx_mode, stx->stx_uid, stx_perm_attr(stx));
+                }
+                ++sxstats.filled;
+            }
+            else {
+                if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+                    // This kernel does not know IORING_OP_STATX.
+                    usable = false;
+                }
+                ++sxstats.failed;
+            }
+            ++head;
+            ++done;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    if (draining) {
+        // Leave the rest to getstat().
+        sxstats.failed += n - done;
+        return (false);
+    }
+    return (usable);
+}
+
+#endif /* HAVE_IO_URING */
+
+/**
+ * @brief Learn the types of a set of files in one directory, in batches.
+ *
+ * @param h    IN     |HANDLE| of the directory that holds them all
+ * @param vec  INOUT  |FILEINFO|s of unknown type
+ * @param n    IN     how many
+ *
+ */
+
+static void
+statx_batch(HANDLE *h, FILEINFO **vec, size_t n)
+{
+#if defined(HAVE_IO_URING)
+    unsigned int chunk;
+    int dfd;
+
+    if (!uring_setup()) {
+        return;
+    }
+    dfd = handle_fd(h);
+    if (dfd < 0) {
+        return;
+    }
+
+    while (n != 0) {
+        chunk = n < ring.entries ? n : ring.entries;
+        if (!uring_statx(dfd, vec, chunk)) {
+            // Nothing is in flight now, or else the ring was abandoned.
+            uring_teardown();
+            return;
+        }
+        vec += chunk;
+        n -= chunk;
+    }
+#else
+    (void)h;
+    (void)vec;
+    (void)n;
+#endif
+}
+
+/**
+ * @brief Batch up the type lookups that matching a directory is going to need.
+ *
+ * @param mmv
+ * @param h        IN  |HANDLE| of the directory about to be matched
+ * @param first    IN  index of the first candidate, as given by ffirst()
+ * @param end      IN  index just past the last candidate, also from ffirst()
+ * @param lastend  IN  pattern for this stage
+ * @param anylev   IN  the directory is also going to be walked, for a ';'
+ *
+ * The candidates are the same ones that the matching loop looks at:
+ * names with the literal prefix that trymatch() does not reject,
+ * and, for a ';' walk, every name that does not start with a '.'.
+ *
+ */
+
+void
+statx_prefetch(mmv_t *mmv, HANDLE *h, int first, int end, char *lastend, bool anylev)
+{
+    DIRINFO *di = h->h_di;
+    FILEINFO **vec, *f;
+    size_t n;
+    int i, last;
+
+    if (di->di_nuntyped < STATX_BATCH_MIN || sxstats.disabled) {
+        return;
+    }
+
+    last = anylev ? (int)di->di_nfils : end;
+    vec = (FILEINFO **) mmv_alloc(di->di_nfils * sizeof (FILEINFO *));
+    n = 0;
+    for (i = anylev ? 0 : first; i < last; ++i) {
+        f = di->di_fils[i];
+        if (i >= first && i < end) {
+            if (trymatch(mmv, f, lastend) == 0) {
+                if (!anylev || f->fi_name[0] == '.') {
+                    continue;
+                }
+            }
+        }
+        else if (f->fi_name[0] == '.') {
+            continue;
+        }
+        if (!(f->fi_stflags & (FI_STTAKEN | FI_TYPEKNOWN))) {
+            vec[n++] = f;
+        }
+    }
+
+    if (n >= STATX_BATCH_MIN) {
+        statx_batch(h, vec, n);
+    }
+    free(vec);
+}
+
+/**
+ * @brief stat() a file, and learn its PERM_ATTR_* flags in the same call.
+ *
+ * @param dfd    IN   directory descriptor, or AT_FDCWD, as for fstatat()
+ * @param path   IN   name of the file, relative to |dfd|
+ * @param st     OUT  the same as fstatat() would give
+ * @param pattr  OUT  PERM_ATTR_* flags, for perm_granted(); 0 if not known
+ * @return 0 or -1, with errno set, as for fstatat()
+ *
+ * Symbolic links are followed.  Without statx(), this is just fstatat().
+ *
+ */
+
+int
+stat_perm(int dfd, const char *path, struct stat *st, unsigned int *pattr)
+{
+#if defined(STATX_TYPE)
+    struct statx stx;
+
+    if (statx(dfd, path, 0, STATX_BASIC_STATS, &stx) == 0) {
+        memset(st, 0, sizeof (*st));
+        st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        st->st_ino = stx.stx_ino;
+        st->st_mode = stx.stx_mode;
+        st->st_nlink = stx.stx_nlink;
+        st->st_uid = stx.stx_uid;
+        st->st_gid = stx.stx_gid;
+        st->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+        st->st_size = stx.stx_size;
+        st->st_blksize = stx.stx_blksize;
+        st->st_blocks = stx.stx_blocks;
+        st->st_atim.tv_sec = stx.stx_atime.tv_sec;
+        st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+        st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+        st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+        st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+        st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+        *pattr = stx_perm_attr(&stx);
+        return (0);
+    }
+    if (errno != ENOSYS) {
+        return (-1);
+    }
+#endif
+    *pattr = 0;
+    return (fstatat(dfd, path, st, 0));
+}
+
+void
+fdump_statx_stats(FILE *f)
+{
+    fprintf(f, "statx:\n");
+    fprintf(f, "    batches=%zu, submitted=%zu, filled=%zu, failed=%zu%s\n",
+        sxstats.batches, sxstats.submitted, sxstats.filled, sxstats.failed,
+        sxstats.disabled ? ", io_uring unavailable" : "");
+}
@@ -24,22 +24,45 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE 1
+
 #include <signal.h>
     // Import constant SIGINT
     // Import signal()
+#include <stdbool.h>
 #include <stddef.h>
     // Import constant NULL
+#include <stdio.h>
+    // Import fprintf()
 #include <stdlib.h>
     // Import getenv()
 #include <string.h>
     // Import strcmp()
     // Import strlen()
+#include <sys/syscall.h>
+    // Import SYS_capget
 #include <sys/types.h>
     // Import type uid_t
+#include <sys/stat.h>
+    // Import S_IROTH, etc.
+#include <sys/vfs.h>
+    // Import statfs(), fstatfs()
+#include <sys/statvfs.h>
+    // Import ST_RDONLY
+#include <fcntl.h>
+    // Import O_PATH
 #include <unistd.h>
+    // Import close()
     // Import geteuid()
     // Import getuid()
+    // Import R_OK, W_OK, X_OK
     // Import type size_t
+#include <linux/capability.h>
+    // Import CAP_DAC_OVERRIDE, CAP_DAC_READ_SEARCH
+#include <linux/limits.h>
+    // Import PATH_MAX
+
+#include <mmv-impl.h>
 
 typedef void sigreturn_t;    // XXX Unify signal typedefs
 
@@ -60,6 +83,104 @@ uid_t uid, euid;
 char *sys_home;
 size_t sys_homelen;
 
+/*
+ * Permissions, decided in-process.
+ *
+ * access() and faccessat() resolve a path, and then check the mode
+ * bits against the real uid and gid, and the supplementary groups.
+ * The mode and owner of directories, and of many files, are already
+ * at hand, from stat(), so some of those decisions can be made here,
+ * with no system call at all.
+ *
+ * Only a grant is trusted, and only a grant to root, or to the owner
+ * of a file.  Root is trusted only if it really has CAP_DAC_OVERRIDE
+ * and CAP_DAC_READ_SEARCH, in the initial user namespace.  An access ACL (system.posix_acl_access) can take away
+ * from named users and groups what the group and other mode bits
+ * seem to give, but it cannot change the owner's entry, which is
+ * the owner mode bits, and root is not held to it.  So no ACL
+ * needs to be read.  Everything else is asked of the kernel.
+ *
+ * An immutable or append-only file cannot be written, even by root.
+ * Those attributes come only from statx(), so write permission is
+ * granted only when statx() says that neither is set.
+ *
+ * On filesystems where a server has the last word (NFS, CIFS,
+ * FUSE, ...) nothing is decided here, and neither is write
+ * permission on a filesystem that is mounted read-only.
+ */
+
+struct fs_perm {
+    DEVID fp_dev;
+    bool  fp_trusted;       // Mode bits tell the whole story
+    bool  fp_rdonly;        // Mounted read-only
+};
+
+static struct fs_perm *fs_vec;
+static size_t fs_cnt;
+static size_t fs_last;      // Index of the last device looked up
+
+struct perm_stats {
+    size_t granted;     // Decided in-process
+    size_t asked;       // Left to access() or faccessat()
+};
+
+static struct perm_stats pmstats;
+static bool root_dac;       // uid 0 is not held to mode bits
+
+/*
+ * Filesystems whose permissions are decided by a server,
+ * or by a user-space daemon, by f_type from statfs().
+ */
+
+static const unsigned long untrusted_fs[] = {
+    0x6969,             // NFS
+    0x517b,             // SMB
+    0xff534d42,         // CIFS
+    0xfe534d42,         // SMB2
+    0x65735546,         // FUSE
+    0x01021997,         // 9P
+    0x00c36400,         // Ceph
+    0x5346414f,         // AFS
+    0x73757245,         // Coda
+};
+
+/**
+ * @brief Tell whether root, here, can read, write and search anything.
+ *
+ * Root in a user namespace, or with CAP_DAC_OVERRIDE or
+ * CAP_DAC_READ_SEARCH dropped, is refused like anybody else.
+ *
+ */
+
+static bool
+root_dac_check(void)
+{
+    struct __user_cap_header_struct hdr;
+    struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+    const uint32_t need = (1U << CAP_DAC_OVERRIDE) | (1U << CAP_DAC_READ_SEARCH);
+    unsigned long inside, outside, count;
+    FILE *f;
+    int n;
+
+    hdr.version = _LINUX_CAPABILITY_VERSION_3;
+    hdr.pid = 0;
+    if (syscall(SYS_capget, &hdr, data) != 0 || (data[0].effective & need) != need) {
+        return (false);
+    }
+
+    // Only the initial user namespace maps every uid to itself.
+    f = fopen("/proc/self/uid_map", "r");
+    if (f == NULL) {
+        return (false);
+    }
+    n = fscanf(f, "%lu %lu %lu", &inside, &outside, &count);
+    if (n == 3 && fscanf(f, "%lu", &inside) == 1) {
+        n = 0;
+    }
+    fclose(f);
+    return (n == 3 && inside == 0 && outside == 0 && count == 4294967295UL);
+}
+
 /*
  * @brief: Global data cache of system properties
  */
@@ -84,5 +205,166 @@ init_sys(void)
 
     euid = geteuid();
     uid = getuid();
+    root_dac = uid == 0 && root_dac_check();
     signal(SIGINT, breakout);
 }
+
+static struct fs_perm *
+fs_lookup(DEVID dev)
+{
+    size_t i;
+
+    if (fs_last < fs_cnt && fs_vec[fs_last].fp_dev == dev) {
+        return (&fs_vec[fs_last]);
+    }
+    for (i = 0; i < fs_cnt; ++i) {
+        if (fs_vec[i].fp_dev == dev) {
+            fs_last = i;
+            return (&fs_vec[i]);
+        }
+    }
+    return (NULL);
+}
+
+/**
+ * @brief Learn what kind of filesystem a device is, once.
+ *
+ * @param dev   IN  st_dev of |path|
+ * @param path  IN  any path on that device; it can be longer than PATH_MAX
+ *
+ * Until a device has been noted, perm_granted() grants nothing on it.
+ *
+ */
+
+void
+perm_fs_note(DEVID dev, const char *path)
+{
+    struct statfs sfs;
+    struct fs_perm *fp;
+    size_t i;
+    int fd, rv;
+
+    if (fs_lookup(dev) != NULL) {
+        return;
+    }
+    fs_vec = (struct fs_perm *) mmv_realloc(fs_vec, (fs_cnt + 1) * sizeof (struct fs_perm));
+    fp = &fs_vec[fs_cnt];
+    fp->fp_dev = dev;
+    fp->fp_trusted = false;
+    fp->fp_rdonly = true;
+    if (strlen(path) < PATH_MAX) {
+        rv = statfs(path, &sfs);
+    }
+    else {
+        fd = long_open(path, O_PATH | O_CLOEXEC, 0);
+        rv = fd < 0 ? -1 : fstatfs(fd, &sfs);
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (rv == 0) {
+        fp->fp_trusted = true;
+        for (i = 0; i < sizeof (untrusted_fs) / sizeof (untrusted_fs[0]); ++i) {
+            if ((unsigned long)sfs.f_type == untrusted_fs[i]) {
+                fp->fp_trusted = false;
+            }
+        }
+        fp->fp_rdonly = (sfs.f_flags & ST_RDONLY) != 0;
+    }
+    fs_last = fs_cnt++;
+}
+
+/**
+ * @brief Tell, with no system call, whether access() would surely succeed.
+ *
+ * @param dev    IN  st_dev of the file
+ * @param mode   IN  st_mode of the file
+ * @param fuid   IN  st_uid of the file
+ * @param attr   IN  PERM_ATTR_* flags, from statx(); 0 if not known
+ * @param amode  IN  R_OK, W_OK and X_OK, or-ed together, as for access()
+ * @return true if access(|amode|) is certain to succeed;
+ *         false if the kernel must be asked
+ *
+ */
+
+bool
+perm_granted(DEVID dev, mode_t mode, uid_t fuid, unsigned int attr, int amode)
+{
+    struct fs_perm *fp;
+    mode_t need;
+    bool ok;
+
+    fp = fs_lookup(dev);
+    if (fp == NULL || !fp->fp_trusted || ((amode & W_OK) && (fp->fp_rdonly || attr != PERM_ATTR_KNOWN))) {
+        ++pmstats.asked;
+        return (false);
+    }
+
+    if (uid == 0 && root_dac) {
+        // Root may execute only what somebody may execute.
+        ok = !(amode & X_OK) || S_ISDIR(mode) || (mode & (S_IXUSR | S_IXGRP | S_IXOTH));
+    }
+    else if (fuid == uid) {
+        need = 0;
+        if (amode & R_OK) {
+            need |= S_IRUSR;
+        }
+        if (amode & W_OK) {
+            need |= S_IWUSR;
+        }
+        if (amode & X_OK) {
+            need |= S_IXUSR;
+        }
+        ok = (mode & need) == need;
+    }
+    else {
+        // The group or other class; an ACL could say otherwise.
+        ok = false;
+    }
+
+    if (ok) {
+        ++pmstats.granted;
+    }
+    else {
+        ++pmstats.asked;
+    }
+    return (ok);
+}
+
+/**
+ * @brief Get what is certain about the permissions of a file, as FI_* flags.
+ *
+ * @return FI_KNOWREAD | FI_CANREAD, if it can surely be read,
+ *         and FI_KNOWWRITE | FI_CANWRITE, if it can surely be written
+ *
+ */
+
+unsigned int
+perm_fi_flags(DEVID dev, mode_t mode, uid_t fuid, unsigned int attr)
+{
+    unsigned int flags;
+
+    flags = 0;
+    if (perm_granted(dev, mode, fuid, attr, R_OK)) {
+        flags |= FI_KNOWREAD | FI_CANREAD;
+    }
+    if (perm_granted(dev, mode, fuid, attr, W_OK)) {
+        flags |= FI_KNOWWRITE | FI_CANWRITE;
+    }
+    return (flags);
+}
+
+/**
+ * @brief Print counters of in-process permission checks.
+ *
+ * @param f  IN  Where to print
+ *
+ */
+
+void
+fdump_perm_stats(FILE *f)
+{
+    fprintf(f, "permissions:\n");
+    fprintf(f, "    granted=%zu, asked-kernel=%zu, filesystems=%zu\n",
+        pmstats.granted, pmstats.asked, fs_cnt);
+}
@@ -24,8 +24,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE 1
+
 #include <stdio.h>
-#include <unistd.h>		// Import unlink()
+#include <unistd.h>		// Import unlink(), unlinkat()
+#include <fcntl.h>		// Import AT_FDCWD
 #include <errno.h>		// Import errno
 #include <eprint.h>
 
@@ -59,3 +62,32 @@ mmv_unlink(const char *fname)
     eexplain_err(err);
     return (rv);
 }
+
+/**
+ * @brief Unlink a file name relative to a directory; report/explain any errors.
+ *
+ * @param  dfd    IN  directory descriptor, or AT_FDCWD
+ * @param  name   IN  file name, relative to |dfd|
+ * @param  fname  IN  full file name, for messages
+ * @return errno-style status
+ *
+ */
+
+int
+mmv_unlinkat(int dfd, const char *name, const char *fname)
+{
+    int rv;
+    int err;
+
+    rv = unlinkat(dfd, name, 0);
+
+    if (rv == 0) {
+        return (0);
+    }
+    err = errno;
+    eprint("unlink('");
+    eprint_filename(fname);
+    eprint("') failed\n");
+    eexplain_err(err);
+    return (rv);
+}